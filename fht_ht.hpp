@@ -7,9 +7,20 @@
 
 #include <assert.h>
 #include <stdint.h>
+#include <string.h>
 #include <sys/mman.h>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
 #include <string>
+#include <thread>
 #include <type_traits>
+#include <vector>
+
+#if __cplusplus >= 201703L
+#include <string_view>
+#define FHT_HAS_STRING_VIEW
+#endif
 
 
 // if using big pages might want to use a seperate allocator and redefine
@@ -30,8 +41,8 @@
 
 #endif
 
-#define FHT_TAGS_PER_CLINE     (L1_CACHE_LINE_SIZE)
-#define FHT_LOG_TAGS_PER_CLINE (L1_LOG_CACHE_LINE_SIZE)
+// default slots per chunk (see fht_chunk_slots)
+#define FHT_TAGS_PER_CLINE (L1_CACHE_LINE_SIZE)
 
 //////////////////////////////////////////////////////////////////////
 // Table params
@@ -50,22 +61,6 @@ const uint64_t FHT_ERASED     = 1;
 // for smaller key types. Generally 8 has worked well go me but set to w.e
 #define PREFETCH_BOUND 8
 
-template<typename K>
-static inline typename std::enable_if<(sizeof(K) >= PREFETCH_BOUND), void>::type
-    __attribute__((const)) __attribute__((always_inline))
-    node_prefetch(const uint32_t slot_mask, const int8_t * const ptr) {
-    uint32_t idx;
-    __asm__("lzcnt %1, %0" : "=r"((idx)) : "rm"((slot_mask)));
-    __builtin_prefetch(ptr + (31 - idx));
-}
-
-template<typename K>
-static constexpr
-    typename std::enable_if<!(sizeof(K) >= PREFETCH_BOUND), void>::type
-    __attribute__((const)) __attribute__((always_inline))
-    node_prefetch(const uint32_t slot_mask, const int8_t * const ptr) {}
-
-
 template<typename K>
 static constexpr
     typename std::enable_if<(sizeof(K) >= PREFETCH_BOUND), void>::type
@@ -84,6 +79,57 @@ static constexpr
 // when to change pass by from actual value to reference
 #define FHT_PASS_BY_VAL_THRESH 8
 
+// load factor the table will grow at. Since full chunks overflow into other
+// chunks this can be set pretty high without add() falling off a cliff
+#ifndef FHT_MAX_LOAD_FACTOR
+#define FHT_MAX_LOAD_FACTOR 0.875
+#endif
+
+// fraction of slots that can be tombstones (ERASED_MASK) before erase() purges
+// them. Tombstones are only left in lines without an empty slot so they keep
+// finds from stopping early
+#ifndef FHT_MAX_ERASED_RATIO
+#define FHT_MAX_ERASED_RATIO 0.125
+#endif
+
+// number of other chunks add() will try before giving up and growing the
+// table. Only really comes into play when the hash function is clumping keys
+// into a few chunks
+const uint32_t FHT_MAX_OVERFLOW_CHUNKS = 8;
+
+// when growing incrementally how many chunks of the new array get their tags
+// reset per chunk moved from the old one (reset is just 2 stores)
+const uint32_t FHT_RESET_CHUNKS_PER_MIGRATE = 8;
+
+// least chunks each thread of a parallel rehash gets. Below that starting the
+// thread costs more than it saves
+const uint32_t FHT_PARALLEL_MIN_CHUNKS = 1024;
+
+// pauses fht_spin_lock spins for before it starts yielding its thread
+const uint32_t FHT_SPIN_PAUSES = 64;
+
+// fht_cas_table threads compare the table's size to grow_npairs once every
+// this many of their own adds (summing the size touches every thread's
+// counter). So the table can go about this many per thread past grow_npairs
+const uint32_t FHT_CAS_SIZE_CHECK = 256;
+
+// number of keys find_many() / count_many() hash and prefetch before resolving
+// any of them. Enough to keep a bunch of cache misses in flight without the
+// first ones getting evicted before they are used
+const uint32_t FHT_FIND_BATCH = 16;
+
+// insert_many() sorts at most this many keys by home chunk at a time (bounds
+// the scratch memory it needs to 32 bytes per key of this)
+const uint64_t FHT_INSERT_BATCH = ((1UL) << 20);
+
+// insert_many() groups keys by the top this many bits of their home chunk
+// index
+const uint32_t FHT_INSERT_RADIX_BITS = 11;
+
+// how many keys ahead of the one being added insert_many() prefetches the
+// input pair of
+const uint32_t FHT_INSERT_PREFETCH = 16;
+
 // tunable but less important
 
 // max memory willing to use (this doesn't really have effect with default
@@ -99,6 +145,100 @@ const uint32_t FHT_DEFAULT_INIT_SIZE = FHT_TAGS_PER_CLINE;
 const uint32_t FHT_HASH_SEED = 0;
 
 
+//////////////////////////////////////////////////////////////////////
+// instruction sets
+
+// tag kernels come in SSE2, AVX2 and AVX512BW versions. Built with -mavx2 or
+// better (i.e -march=native) the best one the build targets is used directly.
+// Otherwise (a build for the x86-64 baseline that has to run anywhere) each
+// table op picks one at runtime from what the cpu supports, see
+// fht_isa_dispatch. Define FHT_DISPATCH_ISA / FHT_NO_DISPATCH_ISA to force
+// either way. Define FHT_SWAR_TAGS to use plain 64 bit integer kernels
+// everywhere instead (hosts without vector units, valgrind / sanitizer runs)
+struct fht_isa_sse2 {};
+struct fht_isa_avx2 {};
+struct fht_isa_avx512 {};
+struct fht_isa_swar {};
+
+#if defined(FHT_SWAR_TAGS) && defined(FHT_DISPATCH_ISA)
+#error "FHT_SWAR_TAGS and FHT_DISPATCH_ISA don't go together"
+#endif
+
+#if !defined(FHT_DISPATCH_ISA) && !defined(FHT_NO_DISPATCH_ISA) &&            \
+    !defined(FHT_SWAR_TAGS) && !defined(__AVX2__)
+#define FHT_DISPATCH_ISA
+#endif
+
+#if defined(FHT_SWAR_TAGS)
+typedef fht_isa_swar fht_isa_native;
+#elif defined(__AVX512BW__)
+typedef fht_isa_avx512 fht_isa_native;
+#elif defined(__AVX2__)
+typedef fht_isa_avx2 fht_isa_native;
+#else
+typedef fht_isa_sse2 fht_isa_native;
+#endif
+
+const uint32_t FHT_ISA_SSE2   = 0;
+const uint32_t FHT_ISA_AVX2   = 1;
+const uint32_t FHT_ISA_AVX512 = 2;
+
+#define FHT_AVX2_TARGET   "avx2,bmi,bmi2,popcnt,sse4.2"
+#define FHT_AVX512_TARGET "avx512f,avx512bw,avx2,bmi,bmi2,popcnt,sse4.2"
+
+// kernels above the build target can't be forced inline into table code that
+// isn't built for them yet. fht_isa_run flattens them in instead
+#ifdef FHT_DISPATCH_ISA
+#define FHT_ISA_INLINE(isa_target) __attribute__((target(isa_target)))
+#else
+#define FHT_ISA_INLINE(isa_target)                                             \
+    __attribute__((always_inline, target(isa_target)))
+#endif
+
+// best kernels the cpu (and os) this is running on supports. cpuid is only
+// run once by libgcc before main, this just reads what it found. Define
+// FHT_FORCE_ISA to one of the FHT_ISA_* to cap it (i.e to test the SSE2
+// kernels on a machine with AVX512)
+static inline uint32_t
+fht_cpu_isa() {
+    __builtin_cpu_init();
+    uint32_t isa = FHT_ISA_SSE2;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi") &&
+        __builtin_cpu_supports("bmi2") && __builtin_cpu_supports("popcnt") &&
+        __builtin_cpu_supports("sse4.2")) {
+        isa = FHT_ISA_AVX2;
+        if (__builtin_cpu_supports("avx512f") &&
+            __builtin_cpu_supports("avx512bw")) {
+            isa = FHT_ISA_AVX512;
+        }
+    }
+#ifdef FHT_FORCE_ISA
+    isa = isa < (FHT_FORCE_ISA) ? isa : (FHT_FORCE_ISA);
+#endif
+    return isa;
+}
+
+// whether crc32 instructions can be used. Forcing the SSE2 kernels makes crc
+// software too
+static inline bool
+fht_cpu_crc() {
+    __builtin_cpu_init();
+#ifdef FHT_FORCE_ISA
+    if ((FHT_FORCE_ISA) == FHT_ISA_SSE2) {
+        return false;
+    }
+#endif
+    return __builtin_cpu_supports("sse4.2");
+}
+
+#ifdef FHT_DISPATCH_ISA
+// per translation unit but the same everywhere. Zero (SSE2 / software crc)
+// until initialized which is still correct, just slower
+static const uint32_t FHT_CPU_ISA = fht_cpu_isa();
+static const bool     FHT_CPU_CRC = fht_cpu_crc();
+#endif
+
+
 //////////////////////////////////////////////////////////////////////
 // SSE / tags stuff
 // necessary includes
@@ -113,1180 +253,6143 @@ static const int8_t ERASED_MASK  = ((int8_t)0xC0);
 static const int8_t CONTENT_MASK = ((int8_t)0x7F);
 #define CONTENT_BITS 7
 
-#define FHT_IS_ERASED(tag)  (((tag)) == ERASED_MASK)
-#define FHT_SET_ERASED(tag) ((tag) = ERASED_MASK)
+// slot a fht_cas_table add has claimed but not filled in yet. No kernel sees
+// it as empty. Only in a table while adds are running so clear_erased (which
+// assumes the other two are the only tags with the high bit set) never sees it
+static const int8_t BUSY_MASK = ((int8_t)0xA0);
+
+// same for 16 bit tags (see fht_wide_tags)
+static const int16_t WIDE_INVALID_MASK = ((int16_t)0x8000);
+static const int16_t WIDE_ERASED_MASK  = ((int16_t)0xC000);
+static const int16_t WIDE_CONTENT_MASK = ((int16_t)0x7FFF);
+#define WIDE_CONTENT_BITS 15
+
+static const int16_t WIDE_BUSY_MASK = ((int16_t)0xA000);
+
+// tag values by tag type
+template<typename T>
+struct fht_tags;
+
+template<>
+struct fht_tags<int8_t> {
+    static constexpr int8_t   invalid      = INVALID_MASK;
+    static constexpr int8_t   erased       = ERASED_MASK;
+    static constexpr int8_t   content      = CONTENT_MASK;
+    static constexpr int8_t   busy         = BUSY_MASK;
+    static constexpr uint32_t content_bits = CONTENT_BITS;
+};
 
-#define FHT_SET_INVALID(tag) ((tag) = INVALID_MASK)
+template<>
+struct fht_tags<int16_t> {
+    static constexpr int16_t  invalid      = WIDE_INVALID_MASK;
+    static constexpr int16_t  erased       = WIDE_ERASED_MASK;
+    static constexpr int16_t  content      = WIDE_CONTENT_MASK;
+    static constexpr int16_t  busy         = WIDE_BUSY_MASK;
+    static constexpr uint32_t content_bits = WIDE_CONTENT_BITS;
+};
 
-#define FHT_MM_SET(X)             _mm_set1_epi8(X)
-#define FHT_MM_MASK(X, Y)         ((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(X, Y)))
-#define FHT_MM_EMPTY(X)           ((uint32_t)_mm_movemask_epi8(_mm_sign_epi8(X, X)))
-#define FHT_MM_EMPTY_OR_ERASED(X) ((uint32_t)_mm_movemask_epi8(X))
 
+// tags per line (what the line kernels cover) and __m128i per 64 8 bit tags
+// (what the _64 kernels cover)
+static const uint32_t FHT_MM_IDX_MULT = sizeof(__m128i);
+static const uint32_t FHT_MM_IDX_MASK = FHT_MM_IDX_MULT - 1;
 
-static const __m256i FHT_RESET_VEC = _mm256_set1_epi8(INVALID_MASK);
+static const uint32_t FHT_MM_LINE = 64 / FHT_MM_IDX_MULT;
+
+// tag kernels for instruction set Isa and tag type Tag. Line versions take a
+// pointer to 16 tags (one __m128i of 8 bit tags), _64 ones 64 tags (bit n is
+// tag n). reset sets 64 tags to invalid and clear_erased turns tombstones
+// back into invalid. fht_slot_ops puts them together for a whole chunk
+template<typename Isa, typename Tag = int8_t>
+struct fht_tag_ops;
+
+template<>
+struct fht_tag_ops<fht_isa_sse2> {
+    static inline uint32_t __attribute__((always_inline))
+    match(const __m128i * const line, const int8_t tag) {
+        return (uint32_t)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(*line, _mm_set1_epi8(tag)));
+    }
 
+    static inline uint32_t __attribute__((always_inline))
+    empty(const __m128i * const line) {
+        return match(line, INVALID_MASK);
+    }
 
-// this is if I want to play around with non - cache line sized tag arrays
-#define FHT_MM_ITER_LINE FHT_MM_LINE
-static const uint32_t FHT_MM_LINE = FHT_TAGS_PER_CLINE / sizeof(__m128i);
+    static inline uint32_t __attribute__((always_inline))
+    empty_or_erased(const __m128i * const line) {
+        return (uint32_t)_mm_movemask_epi8(*line);
+    }
 
-static const uint32_t FHT_MM_LINE_MASK = FHT_MM_LINE - 1;
+    static inline uint64_t __attribute__((always_inline))
+    match_64(const __m128i * const tags, const int8_t tag) {
+        return ((uint64_t)match(tags, tag)) |
+               (((uint64_t)match(tags + 1, tag)) << 16) |
+               (((uint64_t)match(tags + 2, tag)) << 32) |
+               (((uint64_t)match(tags + 3, tag)) << 48);
+    }
 
-static const uint32_t FHT_MM_IDX_MULT = FHT_TAGS_PER_CLINE / FHT_MM_LINE;
-static const uint32_t FHT_MM_IDX_MASK = FHT_MM_IDX_MULT - 1;
+    static inline uint64_t __attribute__((always_inline))
+    empty_64(const __m128i * const tags) {
+        return match_64(tags, INVALID_MASK);
+    }
 
-//////////////////////////////////////////////////////////////////////
-// manipulation of resize of hash_val
-#define FHT_TO_MASK(n) ((((hash_type_t)1) << ((n))) - 1)
+    static inline uint64_t __attribute__((always_inline))
+    empty_or_erased_64(const __m128i * const tags) {
+        return ((uint64_t)empty_or_erased(tags)) |
+               (((uint64_t)empty_or_erased(tags + 1)) << 16) |
+               (((uint64_t)empty_or_erased(tags + 2)) << 32) |
+               (((uint64_t)empty_or_erased(tags + 3)) << 48);
+    }
 
-// get nths bith
+    static inline void __attribute__((always_inline))
+    reset(void * const tags) {
+        for (uint32_t i = 0; i < FHT_MM_LINE; ++i) {
+            _mm_store_si128(((__m128i *)tags) + i,
+                            _mm_set1_epi8(INVALID_MASK));
+        }
+    }
 
-#define FHT_GET_NTH_BIT(X, n)                                                  \
-    ((((X) >> (CONTENT_BITS - FHT_LOG_TAGS_PER_CLINE)) >> ((n))) & 0x1)
+    static inline void __attribute__((always_inline))
+    clear_erased(void * const tags) {
+        for (uint32_t i = 0; i < FHT_MM_LINE; ++i) {
+            __m128i * const line = ((__m128i *)tags) + i;
+            _mm_store_si128(line,
+                            _mm_min_epu8(_mm_load_si128(line),
+                                         _mm_set1_epi8(INVALID_MASK)));
+        }
+    }
 
-#define FHT_HASH_TO_IDX(hash_val, tbl_log)                                     \
-    ((((hash_val) >> (CONTENT_BITS - FHT_LOG_TAGS_PER_CLINE)) &                \
-      FHT_TO_MASK(tbl_log)) /                                                  \
-     FHT_TAGS_PER_CLINE)
+    // tzcnt is bsf on cpus without BMI which leaves 0 undefined
+    static inline uint64_t __attribute__((always_inline))
+    tzcnt_64(const uint64_t v) {
+        return v ? (uint64_t)__builtin_ctzll(v) : 64;
+    }
+};
 
-#define FHT_GEN_TAG(hash_val) ((hash_val)&CONTENT_MASK)
-#define FHT_GEN_START_IDX(hash_val)                                            \
-    (const uint32_t)((hash_val) >> (8 * sizeof(hash_type_t) - 3))
+template<>
+struct fht_tag_ops<fht_isa_avx2> {
+    static inline uint32_t FHT_ISA_INLINE(FHT_AVX2_TARGET)
+    match(const __m128i * const line, const int8_t tag) {
+        return (uint32_t)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(*line, _mm_set1_epi8(tag)));
+    }
 
-//////////////////////////////////////////////////////////////////////
+    static inline uint32_t FHT_ISA_INLINE(FHT_AVX2_TARGET)
+    empty(const __m128i * const line) {
+        return (uint32_t)_mm_movemask_epi8(_mm_sign_epi8(*line, *line));
+    }
 
+    static inline uint32_t FHT_ISA_INLINE(FHT_AVX2_TARGET)
+    empty_or_erased(const __m128i * const line) {
+        return (uint32_t)_mm_movemask_epi8(*line);
+    }
 
-//////////////////////////////////////////////////////////////////////
-// forward declaration of default helper struct
-// near their implementations below are some alternatives ive written
+    // two 32 tag halves
+    static inline uint64_t FHT_ISA_INLINE(FHT_AVX2_TARGET)
+    to_64(const int lo, const int hi) {
+        return ((uint64_t)(uint32_t)lo) | (((uint64_t)(uint32_t)hi) << 32);
+    }
 
-// Must define:
-// const uint32_t operator()(K) or const uint32_t operator()(K const &)
-template<typename K>
-struct DEFAULT_HASH_32;
+    static inline __m256i FHT_ISA_INLINE(FHT_AVX2_TARGET)
+    load_half(const __m128i * const tags, const uint32_t n) {
+        return _mm256_load_si256(((const __m256i *)tags) + n);
+    }
 
-// const uint64_t operator()(K) or const uint64_t operator()(K const &)
-template<typename K>
-struct DEFAULT_HASH_64;
+    static inline uint64_t FHT_ISA_INLINE(FHT_AVX2_TARGET)
+    match_64(const __m128i * const tags, const int8_t tag) {
+        const __m256i vtag = _mm256_set1_epi8(tag);
+        return to_64(
+            _mm256_movemask_epi8(_mm256_cmpeq_epi8(vtag, load_half(tags, 0))),
+            _mm256_movemask_epi8(_mm256_cmpeq_epi8(vtag, load_half(tags, 1))));
+    }
 
-// remaps each time table resizes
-template<typename K, typename V>
-struct DEFAULT_MMAP_ALLOC;
+    static inline uint64_t FHT_ISA_INLINE(FHT_AVX2_TARGET)
+    empty_64(const __m128i * const tags) {
+        const __m256i lo = load_half(tags, 0);
+        const __m256i hi = load_half(tags, 1);
+        return to_64(_mm256_movemask_epi8(_mm256_sign_epi8(lo, lo)),
+                     _mm256_movemask_epi8(_mm256_sign_epi8(hi, hi)));
+    }
 
-template<typename K, typename V>
-struct DEFAULT_ALLOC;
+    static inline uint64_t FHT_ISA_INLINE(FHT_AVX2_TARGET)
+    empty_or_erased_64(const __m128i * const tags) {
+        return to_64(_mm256_movemask_epi8(load_half(tags, 0)),
+                     _mm256_movemask_epi8(load_half(tags, 1)));
+    }
 
-// this will perform significantly better if the copy time on either keys or
-// values is large (it tries to avoid at least a portion of the copying step in
-// resize)
-template<typename K, typename V>
-struct INPLACE_MMAP_ALLOC;
+    static inline void FHT_ISA_INLINE(FHT_AVX2_TARGET)
+    reset(void * const tags) {
+        ((__m256i *)tags)[0] = _mm256_set1_epi8(INVALID_MASK);
+        ((__m256i *)tags)[1] = _mm256_set1_epi8(INVALID_MASK);
+    }
 
-//////////////////////////////////////////////////////////////////////
-// helpers
+    static inline void FHT_ISA_INLINE(FHT_AVX2_TARGET)
+    clear_erased(void * const tags) {
+        __m256i * const halves = (__m256i *)tags;
+        halves[0] = _mm256_min_epu8(halves[0], _mm256_set1_epi8(INVALID_MASK));
+        halves[1] = _mm256_min_epu8(halves[1], _mm256_set1_epi8(INVALID_MASK));
+    }
 
-// intentionally not specify for inline as this is far from critical path and
-// compiler knows better if its going to bloat executable
-static uint64_t __attribute__((const)) log_b2(uint64_t n) {
-    uint64_t s, t;
-    t = (n > 0xffffffffUL) * (32);
-    n >>= t;
-    t = (n > 0xffffUL) * (16);
-    n >>= t;
-    s = (n > 0xffUL) * (8);
-    n >>= s, t |= s;
-    s = (n > 0xfUL) * (4);
-    n >>= s, t |= s;
-    s = (n > 0x3UL) * (2);
-    n >>= s, t |= s;
-    return (t | (n / 2));
-}
+    static inline uint64_t __attribute__((always_inline))
+    tzcnt_64(const uint64_t v) {
+        uint64_t idx;
+        __asm__("tzcnt %1, %0" : "=r"((idx)) : "rm"((v)));
+        return idx;
+    }
+};
 
-// intentionally not specify for inline as this is far from critical path and
-// compiler knows better if its going to bloat executable
-static uint64_t __attribute__((const)) roundup_next_p2(uint64_t v) {
-    v--;
-    v |= v >> 1;
-    v |= v >> 2;
-    v |= v >> 4;
-    v |= v >> 8;
-    v |= v >> 16;
-    v |= v >> 32;
-    v++;
-    return v;
-}
+// line kernels are the AVX2 ones
+template<>
+struct fht_tag_ops<fht_isa_avx512> : fht_tag_ops<fht_isa_avx2> {
+    static inline __m512i FHT_ISA_INLINE(FHT_AVX512_TARGET)
+    load(const __m128i * const tags) {
+        return _mm512_load_si512((const void *)tags);
+    }
 
-// these get optimized to popcnt. For resize
-static inline uint32_t
-bitcount_32(uint32_t v) {
-    uint32_t c;
-    c = v - ((v >> 1) & 0x55555555);
-    c = ((c >> 2) & 0x33333333) + (c & 0x33333333);
-    c = ((c >> 4) + c) & 0x0F0F0F0F;
-    c = ((c >> 8) + c) & 0x00FF00FF;
-    c = ((c >> 16) + c) & 0x0000FFFF;
-    return c;
-}
+    static inline uint64_t FHT_ISA_INLINE(FHT_AVX512_TARGET)
+    match_64(const __m128i * const tags, const int8_t tag) {
+        return (uint64_t)_mm512_cmpeq_epi8_mask(_mm512_set1_epi8(tag),
+                                                load(tags));
+    }
 
-//////////////////////////////////////////////////////////////////////
-// Really just typedef structs
-template<typename K, typename V>
-struct fht_node {
-    K key;
-    V val;
-};
+    static inline uint64_t FHT_ISA_INLINE(FHT_AVX512_TARGET)
+    empty_64(const __m128i * const tags) {
+        return (uint64_t)_mm512_cmpeq_epi8_mask(_mm512_set1_epi8(INVALID_MASK),
+                                                load(tags));
+    }
 
+    static inline uint64_t FHT_ISA_INLINE(FHT_AVX512_TARGET)
+    empty_or_erased_64(const __m128i * const tags) {
+        return (uint64_t)_mm512_movepi8_mask(load(tags));
+    }
 
-// chunk containing cache line of tags and a single node (either fht_combined_kv
-// or fht_seperate_kv). Either way each chunk contains bytes per cache line
-// number of key value pairs (on most 64 bit machines this will mean 64 Key
-// value pairs)
-template<typename K, typename V>
-struct fht_chunk {
+    static inline void FHT_ISA_INLINE(FHT_AVX512_TARGET)
+    reset(void * const tags) {
+        _mm512_store_si512(tags, _mm512_set1_epi8(INVALID_MASK));
+    }
 
+    static inline void FHT_ISA_INLINE(FHT_AVX512_TARGET)
+    clear_erased(void * const tags) {
+        _mm512_store_si512(tags,
+                           _mm512_min_epu8(_mm512_load_si512(tags),
+                                           _mm512_set1_epi8(INVALID_MASK)));
+    }
+};
 
-    // determine best way to pass K/V depending on size. Generally passing
-    // values machine word size is ill advised
-    template<typename T>
-    using pass_type_t =
-        typename std::conditional<(std::is_arithmetic<T>::value ||
-                                   std::is_pointer<T>::value),
-                                  const T,
-                                  const T &>::type;
+// SWAR versions. Tags are read as 8 byte words, each op sets the high bit of
+// the bytes it matches and then packs those into one bit per tag
+static const uint64_t FHT_SWAR_LO   = 0x0101010101010101ULL;
+static const uint64_t FHT_SWAR_HI   = 0x8080808080808080ULL;
+static const uint64_t FHT_SWAR_PACK = 0x0102040810204080ULL;
+static const uint32_t FHT_SWAR_LINE = 64 / sizeof(uint64_t);
+
+template<>
+struct fht_tag_ops<fht_isa_swar> {
+    static inline uint64_t __attribute__((always_inline))
+    load(const void * const tags, const uint32_t n) {
+        uint64_t w;
+        memcpy(&w, ((const uint8_t *)tags) + n * sizeof(uint64_t), sizeof(w));
+        return w;
+    }
 
+    static inline void __attribute__((always_inline))
+    store(void * const tags, const uint32_t n, const uint64_t w) {
+        memcpy(((uint8_t *)tags) + n * sizeof(uint64_t), &w, sizeof(w));
+    }
 
-    // typedefs to fht_table can access these variables
-    typedef pass_type_t<K> key_pass_t;
-    typedef pass_type_t<V> val_pass_t;
-    typedef fht_node<K, V> node_t;
+    // high bit of byte n -> bit n
+    static inline uint32_t __attribute__((always_inline))
+    pack(const uint64_t hi_bits) {
+        return (uint32_t)(((hi_bits >> 7) * FHT_SWAR_PACK) >> 56);
+    }
 
-    // actual content of chunk
-    const __m128i tags[FHT_MM_LINE];
-    node_t        nodes[FHT_TAGS_PER_CLINE];
+    // high bit set in the zero bytes of w. Exact, the add can't carry into the
+    // next byte so a match doesn't leak into its neighbor like (w - lo) & ~w
+    static inline uint64_t __attribute__((always_inline))
+    zero_bytes(const uint64_t w) {
+        return ~(((w & ~FHT_SWAR_HI) + ~FHT_SWAR_HI) | w) & FHT_SWAR_HI;
+    }
 
-    inline constexpr uint32_t __attribute__((always_inline))
-    get_empty_or_erased(const uint32_t idx) const {
-        return FHT_MM_EMPTY_OR_ERASED(this->tags[idx]);
+    static inline uint32_t __attribute__((always_inline))
+    match_word(const uint64_t w, const int8_t tag) {
+        return pack(zero_bytes(w ^ (FHT_SWAR_LO * (uint8_t)tag)));
     }
 
-    inline constexpr uint32_t __attribute__((always_inline))
-    get_empty(const uint32_t idx) const {
-        return FHT_MM_EMPTY(this->tags[idx]);
+    static inline uint32_t __attribute__((always_inline))
+    match(const __m128i * const line, const int8_t tag) {
+        return match_word(load(line, 0), tag) |
+               (match_word(load(line, 1), tag) << 8);
     }
 
-    inline constexpr uint32_t __attribute__((always_inline))
-    get_tag_matches(const int8_t tag, const uint32_t idx) {
-        return FHT_MM_MASK(FHT_MM_SET(tag), this->tags[idx]);
+    static inline uint32_t __attribute__((always_inline))
+    empty(const __m128i * const line) {
+        return match(line, INVALID_MASK);
     }
 
-    inline constexpr uint32_t __attribute__((always_inline))
-    has_empty(const uint32_t idx) const {
-        const __m128i vcmp =
-            _mm_cmpeq_epi8(this->tags[idx], _mm_set1_epi8(INVALID_MASK));
-        return _mm_testz_si128(vcmp, vcmp);
+    static inline uint32_t __attribute__((always_inline))
+    empty_or_erased(const __m128i * const line) {
+        return pack(load(line, 0) & FHT_SWAR_HI) |
+               (pack(load(line, 1) & FHT_SWAR_HI) << 8);
     }
 
-    inline constexpr uint32_t __attribute__((always_inline))
-    is_erased_n(const uint32_t n) const {
-        return FHT_IS_ERASED(((const int8_t * const)this->tags)[n]);
+    static inline uint64_t __attribute__((always_inline))
+    match_64(const __m128i * const tags, const int8_t tag) {
+        uint64_t m = 0;
+        for (uint32_t i = 0; i < FHT_SWAR_LINE; ++i) {
+            m |= ((uint64_t)match_word(load(tags, i), tag)) << (8 * i);
+        }
+        return m;
     }
 
-    inline void constexpr __attribute__((always_inline))
-    erase_tag_n(const uint32_t n) {
-        FHT_SET_ERASED(((int8_t * const)this->tags)[n]);
+    static inline uint64_t __attribute__((always_inline))
+    empty_64(const __m128i * const tags) {
+        return match_64(tags, INVALID_MASK);
     }
 
-    inline void constexpr __attribute__((always_inline))
-    invalidate_tag_n(const uint32_t n) {
-        FHT_SET_INVALID(((int8_t * const)this->tags)[n]);
+    static inline uint64_t __attribute__((always_inline))
+    empty_or_erased_64(const __m128i * const tags) {
+        uint64_t m = 0;
+        for (uint32_t i = 0; i < FHT_SWAR_LINE; ++i) {
+            m |= ((uint64_t)pack(load(tags, i) & FHT_SWAR_HI)) << (8 * i);
+        }
+        return m;
     }
 
-    inline constexpr uint32_t __attribute__((always_inline))
-    resize_skip_n(const uint32_t n) const {
-        return (((const uint8_t * const)this->tags)[n]) &
-               ((const uint8_t)INVALID_MASK);
+    static inline void __attribute__((always_inline))
+    reset(void * const tags) {
+        for (uint32_t i = 0; i < FHT_SWAR_LINE; ++i) {
+            store(tags, i, FHT_SWAR_HI);
+        }
     }
 
-    // this unerases
-    inline constexpr void __attribute__((always_inline))
-    set_tag_n(const uint32_t n, const int8_t new_tag) {
-        ((int8_t * const)this->tags)[n] = new_tag;
+    // ERASED_MASK and INVALID_MASK are the only tags with the high bit set,
+    // dropping bit 6 of those turns the former into the latter
+    static inline void __attribute__((always_inline))
+    clear_erased(void * const tags) {
+        for (uint32_t i = 0; i < FHT_SWAR_LINE; ++i) {
+            const uint64_t w = load(tags, i);
+            store(tags, i, w & ~((w & FHT_SWAR_HI) >> 1));
+        }
     }
 
+    static inline uint64_t __attribute__((always_inline))
+    tzcnt_64(const uint64_t v) {
+        return v ? (uint64_t)__builtin_ctzll(v) : 64;
+    }
+};
 
-    // the following exist for key/val in a far more complicated format
-    inline constexpr int8_t __attribute__((always_inline))
-    get_tag_n(const uint32_t n) const {
-        return ((const int8_t * const)this->tags)[n];
+// 16 bit tag versions. A line is two __m128i, masks are still a bit per tag
+template<>
+struct fht_tag_ops<fht_isa_sse2, int16_t> {
+    static inline uint32_t __attribute__((always_inline))
+    match(const __m128i * const line, const int16_t tag) {
+        const __m128i vtag = _mm_set1_epi16(tag);
+        return (uint32_t)_mm_movemask_epi8(
+            _mm_packs_epi16(_mm_cmpeq_epi16(line[0], vtag),
+                            _mm_cmpeq_epi16(line[1], vtag)));
     }
 
+    static inline uint32_t __attribute__((always_inline))
+    empty(const __m128i * const line) {
+        return match(line, WIDE_INVALID_MASK);
+    }
 
-    inline constexpr key_pass_t __attribute__((always_inline))
-    get_key_n(const uint32_t n) const {
-        return this->nodes[n].key;
+    // packs saturates so the sign of each tag is kept
+    static inline uint32_t __attribute__((always_inline))
+    empty_or_erased(const __m128i * const line) {
+        return (uint32_t)_mm_movemask_epi8(_mm_packs_epi16(line[0], line[1]));
     }
 
-    inline constexpr const uint32_t __attribute__((always_inline))
-    compare_key_n(const uint32_t n, key_pass_t other_key) const {
-        return this->nodes[n].key == other_key;
+    static inline uint64_t __attribute__((always_inline))
+    match_64(const __m128i * const tags, const int16_t tag) {
+        return ((uint64_t)match(tags, tag)) |
+               (((uint64_t)match(tags + 2, tag)) << 16) |
+               (((uint64_t)match(tags + 4, tag)) << 32) |
+               (((uint64_t)match(tags + 6, tag)) << 48);
     }
 
+    static inline uint64_t __attribute__((always_inline))
+    empty_64(const __m128i * const tags) {
+        return match_64(tags, WIDE_INVALID_MASK);
+    }
 
-    inline constexpr val_pass_t __attribute__((always_inline))
-    get_val_n(const uint32_t n) const {
-        return this->nodes[n].val;
+    static inline uint64_t __attribute__((always_inline))
+    empty_or_erased_64(const __m128i * const tags) {
+        return ((uint64_t)empty_or_erased(tags)) |
+               (((uint64_t)empty_or_erased(tags + 2)) << 16) |
+               (((uint64_t)empty_or_erased(tags + 4)) << 32) |
+               (((uint64_t)empty_or_erased(tags + 6)) << 48);
     }
 
+    static inline void __attribute__((always_inline))
+    reset(void * const tags) {
+        for (uint32_t i = 0; i < 2 * FHT_MM_LINE; ++i) {
+            _mm_store_si128(((__m128i *)tags) + i,
+                            _mm_set1_epi16(WIDE_INVALID_MASK));
+        }
+    }
 
-    inline constexpr const K * __attribute__((always_inline))
-    get_key_n_ptr(const uint32_t n) const {
-        return (const K *)(&(this->nodes[n].key));
+    // no unsigned 16 bit min before SSE4.1. Clears bit 14 of negative tags
+    // instead
+    static inline void __attribute__((always_inline))
+    clear_erased(void * const tags) {
+        for (uint32_t i = 0; i < 2 * FHT_MM_LINE; ++i) {
+            __m128i * const line = ((__m128i *)tags) + i;
+            const __m128i   v    = _mm_load_si128(line);
+            _mm_store_si128(
+                line,
+                _mm_andnot_si128(
+                    _mm_and_si128(_mm_srai_epi16(v, 15),
+                                  _mm_set1_epi16((int16_t)(WIDE_INVALID_MASK ^
+                                                          WIDE_ERASED_MASK))),
+                    v));
+        }
     }
 
-    inline constexpr const V * __attribute__((always_inline))
-    get_val_n_ptr(const uint32_t n) const {
-        return (const V *)(&(this->nodes[n].val));
+    static inline uint64_t __attribute__((always_inline))
+    tzcnt_64(const uint64_t v) {
+        return fht_tag_ops<fht_isa_sse2>::tzcnt_64(v);
     }
 };
 
-//////////////////////////////////////////////////////////////////////
-// would be nice to implement in 4 bytes so iterator + bool fits in
-// register
-template<typename K, typename V>
-struct fht_iterator_t {
+template<>
+struct fht_tag_ops<fht_isa_avx2, int16_t> {
+    static inline __m256i FHT_ISA_INLINE(FHT_AVX2_TARGET)
+    load(const __m128i * const tags, const uint32_t n) {
+        return _mm256_load_si256(((const __m256i *)tags) + n);
+    }
+
+    // sign of each 16 bit lane. packs works within 128 bit lanes so the
+    // quarters have to be put back in order
+    static inline uint32_t FHT_ISA_INLINE(FHT_AVX2_TARGET)
+    movemask(const __m256i a, const __m256i b) {
+        return (uint32_t)_mm256_movemask_epi8(
+            _mm256_permute4x64_epi64(_mm256_packs_epi16(a, b), 0xD8));
+    }
 
-    const int8_t * cur_tag;
+    static inline uint32_t FHT_ISA_INLINE(FHT_AVX2_TARGET)
+    movemask(const __m256i a) {
+        return (uint32_t)_mm_movemask_epi8(
+            _mm_packs_epi16(_mm256_castsi256_si128(a),
+                            _mm256_extracti128_si256(a, 1)));
+    }
 
-    fht_iterator_t(const int8_t * const init_tag_pos) {
-        this->cur_tag = init_tag_pos;
+    static inline uint32_t FHT_ISA_INLINE(FHT_AVX2_TARGET)
+    match(const __m128i * const line, const int16_t tag) {
+        return movemask(
+            _mm256_cmpeq_epi16(load(line, 0), _mm256_set1_epi16(tag)));
     }
 
+    static inline uint32_t FHT_ISA_INLINE(FHT_AVX2_TARGET)
+    empty(const __m128i * const line) {
+        return match(line, WIDE_INVALID_MASK);
+    }
 
-    fht_iterator_t(const int8_t * init_tag_pos, const uint64_t end) {
-        // initialization of new iterator (not from find but from begin) so that
-        // it starts at a valid slot
-        while (((uint64_t)init_tag_pos) < end &&
-               (*init_tag_pos) & INVALID_MASK) {
-            if (__builtin_expect(
-                    ((uint64_t)(init_tag_pos) % FHT_TAGS_PER_CLINE) ==
-                        (FHT_TAGS_PER_CLINE - 1),
-                    0)) {
-                init_tag_pos += (sizeof(fht_chunk<K, V>) - FHT_TAGS_PER_CLINE);
-            }
-            ++init_tag_pos;
-        }
-        this->cur_tag = init_tag_pos;
+    static inline uint32_t FHT_ISA_INLINE(FHT_AVX2_TARGET)
+    empty_or_erased(const __m128i * const line) {
+        return movemask(load(line, 0));
     }
 
+    static inline uint64_t FHT_ISA_INLINE(FHT_AVX2_TARGET)
+    match_64(const __m128i * const tags, const int16_t tag) {
+        const __m256i vtag = _mm256_set1_epi16(tag);
+        return ((uint64_t)movemask(_mm256_cmpeq_epi16(vtag, load(tags, 0)),
+                                   _mm256_cmpeq_epi16(vtag, load(tags, 1)))) |
+               (((uint64_t)movemask(_mm256_cmpeq_epi16(vtag, load(tags, 2)),
+                                    _mm256_cmpeq_epi16(vtag, load(tags, 3))))
+                << 32);
+    }
 
-    fht_iterator_t &
-    operator++() {
-        do {
-            if (__builtin_expect(
-                    ((uint64_t)(this->cur_tag) % FHT_TAGS_PER_CLINE) ==
-                        (FHT_TAGS_PER_CLINE - 1),
-                    0)) {
-                this->cur_tag += (sizeof(fht_chunk<K, V>) - FHT_TAGS_PER_CLINE);
-            }
-            this->cur_tag++;
-        } while ((*(this->cur_tag)) & INVALID_MASK);
-        return *this;
+    static inline uint64_t FHT_ISA_INLINE(FHT_AVX2_TARGET)
+    empty_64(const __m128i * const tags) {
+        return match_64(tags, WIDE_INVALID_MASK);
     }
 
-    inline fht_iterator_t &
-    operator++(int) {
-        ++(this);
-        return *this;
+    static inline uint64_t FHT_ISA_INLINE(FHT_AVX2_TARGET)
+    empty_or_erased_64(const __m128i * const tags) {
+        return ((uint64_t)movemask(load(tags, 0), load(tags, 1))) |
+               (((uint64_t)movemask(load(tags, 2), load(tags, 3))) << 32);
     }
 
-    inline fht_iterator_t &
-    operator+=(uint32_t n) {
-        while (n) {
-            this ++;
+    static inline void FHT_ISA_INLINE(FHT_AVX2_TARGET)
+    reset(void * const tags) {
+        for (uint32_t i = 0; i < 4; ++i) {
+            ((__m256i *)tags)[i] = _mm256_set1_epi16(WIDE_INVALID_MASK);
         }
     }
 
-    fht_iterator_t &
-    operator--() {
-        do {
-            if (__builtin_expect(
-                    ((uint64_t)(this->cur_tag) % FHT_TAGS_PER_CLINE) == 0,
-                    0)) {
-                this->cur_tag -= sizeof(typename fht_chunk<K, V>::node_t);
-            }
-            this->cur_tag--;
-        } while ((*(this->cur_tag)) & INVALID_MASK);
-        return *this;
+    static inline void FHT_ISA_INLINE(FHT_AVX2_TARGET)
+    clear_erased(void * const tags) {
+        __m256i * const quarters = (__m256i *)tags;
+        const __m256i   invalid  = _mm256_set1_epi16(WIDE_INVALID_MASK);
+        for (uint32_t i = 0; i < 4; ++i) {
+            quarters[i] = _mm256_min_epu16(quarters[i], invalid);
+        }
     }
 
-    inline fht_iterator_t &
-    operator--(int) {
-        --(*this);
-        return *this;
+    static inline uint64_t __attribute__((always_inline))
+    tzcnt_64(const uint64_t v) {
+        return fht_tag_ops<fht_isa_avx2>::tzcnt_64(v);
     }
+};
 
-    inline fht_iterator_t &
-    operator-=(uint32_t n) {
-        while (n) {
-            this --;
+// line kernels are the AVX2 ones
+template<>
+struct fht_tag_ops<fht_isa_avx512, int16_t>
+    : fht_tag_ops<fht_isa_avx2, int16_t> {
+    static inline __m512i FHT_ISA_INLINE(FHT_AVX512_TARGET)
+    load(const __m128i * const tags, const uint32_t n) {
+        return _mm512_load_si512((const void *)(((const __m512i *)tags) + n));
+    }
+
+    static inline uint64_t FHT_ISA_INLINE(FHT_AVX512_TARGET)
+    match_64(const __m128i * const tags, const int16_t tag) {
+        const __m512i vtag = _mm512_set1_epi16(tag);
+        return ((uint64_t)_mm512_cmpeq_epi16_mask(vtag, load(tags, 0))) |
+               (((uint64_t)_mm512_cmpeq_epi16_mask(vtag, load(tags, 1)))
+                << 32);
+    }
+
+    static inline uint64_t FHT_ISA_INLINE(FHT_AVX512_TARGET)
+    empty_64(const __m128i * const tags) {
+        return match_64(tags, WIDE_INVALID_MASK);
+    }
+
+    static inline uint64_t FHT_ISA_INLINE(FHT_AVX512_TARGET)
+    empty_or_erased_64(const __m128i * const tags) {
+        return ((uint64_t)_mm512_movepi16_mask(load(tags, 0))) |
+               (((uint64_t)_mm512_movepi16_mask(load(tags, 1))) << 32);
+    }
+
+    static inline void FHT_ISA_INLINE(FHT_AVX512_TARGET)
+    reset(void * const tags) {
+        _mm512_store_si512(tags, _mm512_set1_epi16(WIDE_INVALID_MASK));
+        _mm512_store_si512(((__m512i *)tags) + 1,
+                           _mm512_set1_epi16(WIDE_INVALID_MASK));
+    }
+
+    static inline void FHT_ISA_INLINE(FHT_AVX512_TARGET)
+    clear_erased(void * const tags) {
+        for (uint32_t i = 0; i < 2; ++i) {
+            __m512i * const half = ((__m512i *)tags) + i;
+            _mm512_store_si512(
+                half,
+                _mm512_min_epu16(_mm512_load_si512(half),
+                                 _mm512_set1_epi16(WIDE_INVALID_MASK)));
         }
     }
+};
 
-    inline constexpr const std::pair<K, V> *
-    to_address() const {
-        // basically if we are using std::pair go to the actual pair,
-        // std::pair<K, V> is basically just and extension of it with K / V
-        // getting functionality
-        return ((const std::pair<K, V> *)(((uint64_t)(this->cur_tag +
-                                                      FHT_TAGS_PER_CLINE)) &
-                                          (~(FHT_TAGS_PER_CLINE - 1)))) +
-               (((uint64_t)(this->cur_tag)) & (FHT_TAGS_PER_CLINE - 1));
+// SWAR with 4 tags per word
+static const uint64_t FHT_SWAR16_LO   = 0x0001000100010001ULL;
+static const uint64_t FHT_SWAR16_HI   = 0x8000800080008000ULL;
+static const uint64_t FHT_SWAR16_PACK = 0x1000200040008000ULL;
+
+template<>
+struct fht_tag_ops<fht_isa_swar, int16_t> : fht_tag_ops<fht_isa_swar> {
+    // high bit of lane n -> bit n
+    static inline uint32_t __attribute__((always_inline))
+    pack(const uint64_t hi_bits) {
+        return (uint32_t)(((hi_bits >> 15) * FHT_SWAR16_PACK) >> 60);
     }
 
-    inline const std::pair<K, V> & operator*() const {
-        return *(this->to_address());
+    static inline uint64_t __attribute__((always_inline))
+    zero_lanes(const uint64_t w) {
+        return ~(((w & ~FHT_SWAR16_HI) + ~FHT_SWAR16_HI) | w) & FHT_SWAR16_HI;
     }
 
+    static inline uint32_t __attribute__((always_inline))
+    match_word(const uint64_t w, const int16_t tag) {
+        return pack(zero_lanes(w ^ (FHT_SWAR16_LO * (uint16_t)tag)));
+    }
 
-    inline const std::pair<K, V> * operator->() const {
-        return this->to_address();
+    static inline uint32_t __attribute__((always_inline))
+    match(const __m128i * const line, const int16_t tag) {
+        uint32_t m = 0;
+        for (uint32_t i = 0; i < 4; ++i) {
+            m |= match_word(load(line, i), tag) << (4 * i);
+        }
+        return m;
     }
 
+    static inline uint32_t __attribute__((always_inline))
+    empty(const __m128i * const line) {
+        return match(line, WIDE_INVALID_MASK);
+    }
 
-    inline friend bool
-    operator==(const fht_iterator_t & it_a, const fht_iterator_t & it_b) {
-        return ((uint64_t)(it_a.cur_tag)) == ((uint64_t)(it_b.cur_tag));
+    static inline uint32_t __attribute__((always_inline))
+    empty_or_erased(const __m128i * const line) {
+        uint32_t m = 0;
+        for (uint32_t i = 0; i < 4; ++i) {
+            m |= pack(load(line, i) & FHT_SWAR16_HI) << (4 * i);
+        }
+        return m;
     }
 
-    inline friend bool
-    operator!=(const fht_iterator_t & it_a, const fht_iterator_t & it_b) {
-        return ((uint64_t)(it_a.cur_tag)) != ((uint64_t)(it_b.cur_tag));
+    static inline uint64_t __attribute__((always_inline))
+    match_64(const __m128i * const tags, const int16_t tag) {
+        uint64_t m = 0;
+        for (uint32_t i = 0; i < 2 * FHT_SWAR_LINE; ++i) {
+            m |= ((uint64_t)match_word(load(tags, i), tag)) << (4 * i);
+        }
+        return m;
     }
 
-    inline friend bool
-    operator<(const fht_iterator_t & it_a, const fht_iterator_t & it_b) {
-        return ((uint64_t)(it_a.cur_tag)) < ((uint64_t)(it_b.cur_tag));
+    static inline uint64_t __attribute__((always_inline))
+    empty_64(const __m128i * const tags) {
+        return match_64(tags, WIDE_INVALID_MASK);
     }
 
-    inline friend bool
-    operator>(const fht_iterator_t & it_a, const fht_iterator_t & it_b) {
-        return ((uint64_t)(it_a.cur_tag)) > ((uint64_t)(it_b.cur_tag));
+    static inline uint64_t __attribute__((always_inline))
+    empty_or_erased_64(const __m128i * const tags) {
+        uint64_t m = 0;
+        for (uint32_t i = 0; i < 2 * FHT_SWAR_LINE; ++i) {
+            m |= ((uint64_t)pack(load(tags, i) & FHT_SWAR16_HI)) << (4 * i);
+        }
+        return m;
     }
 
-    inline friend bool
-    operator<=(const fht_iterator_t & it_a, const fht_iterator_t & it_b) {
-        return ((uint64_t)(it_a.cur_tag)) <= ((uint64_t)(it_b.cur_tag));
+    static inline void __attribute__((always_inline))
+    reset(void * const tags) {
+        for (uint32_t i = 0; i < 2 * FHT_SWAR_LINE; ++i) {
+            store(tags, i, FHT_SWAR16_HI);
+        }
     }
 
-    inline friend bool
-    operator>=(const fht_iterator_t & it_a, const fht_iterator_t & it_b) {
-        return ((uint64_t)(it_a.cur_tag)) >= ((uint64_t)(it_b.cur_tag));
+    static inline void __attribute__((always_inline))
+    clear_erased(void * const tags) {
+        for (uint32_t i = 0; i < 2 * FHT_SWAR_LINE; ++i) {
+            const uint64_t w = load(tags, i);
+            store(tags, i, w & ~((w & FHT_SWAR16_HI) >> 1));
+        }
     }
 };
 
-//////////////////////////////////////////////////////////////////////
-// Table class
-template<typename K,
-         typename V,
-         typename Hasher    = DEFAULT_HASH_64<K>,
-         typename Allocator = DEFAULT_ALLOC<K, V>>
-struct fht_table {
+// calls f(Isa(), args...) with everything in it built for Isa. Without
+// FHT_DISPATCH_ISA the table code already is so this is just the call. With
+// it f gets flattened into a copy built for Isa (which is what lets the
+// kernels inline). Hot ops pass key / hash as args instead of capturing them
+// so they stay in registers across the call. run_cold is for rare paths
+// (resizing) out of hot ones so they aren't flattened into every add() /
+// erase()
+template<typename Isa>
+struct fht_isa_run {
+    template<typename... Args, typename F>
+    static inline auto __attribute__((always_inline))
+    run(F f, Args... args) -> decltype(f(Isa(), args...)) {
+        return f(Isa(), args...);
+    }
 
+    template<typename F>
+    static inline auto
+    run_cold(F f) -> decltype(f(Isa())) {
+        return f(Isa());
+    }
+};
 
-    // log of table size
-    uint32_t log_incr;
-    uint32_t npairs;
+#ifdef FHT_DISPATCH_ISA
+template<>
+struct fht_isa_run<fht_isa_avx2> {
+    template<typename... Args, typename F>
+    static auto __attribute__((target(FHT_AVX2_TARGET), flatten))
+    run(F f, Args... args) -> decltype(f(fht_isa_avx2(), args...)) {
+        return f(fht_isa_avx2(), args...);
+    }
 
-    // chunk array
-    fht_chunk<K, V> * chunks;
+    template<typename F>
+    static auto __attribute__((target(FHT_AVX2_TARGET), flatten, noinline))
+    run_cold(F f) -> decltype(f(fht_isa_avx2())) {
+        return f(fht_isa_avx2());
+    }
+};
 
-    // helper classes
-    Hasher    hash;
-    Allocator alloc_mmap;
+template<>
+struct fht_isa_run<fht_isa_avx512> {
+    template<typename... Args, typename F>
+    static auto __attribute__((target(FHT_AVX512_TARGET), flatten))
+    run(F f, Args... args) -> decltype(f(fht_isa_avx512(), args...)) {
+        return f(fht_isa_avx512(), args...);
+    }
 
-    //////////////////////////////////////////////////////////////////////
-    template<typename _K = K, typename _Hasher = Hasher>
-    using _hash_type_t = typename std::result_of<_Hasher(K)>::type;
-    typedef _hash_type_t<K, Hasher> hash_type_t;
+    template<typename F>
+    static auto __attribute__((target(FHT_AVX512_TARGET), flatten, noinline))
+    run_cold(F f) -> decltype(f(fht_isa_avx512())) {
+        return f(fht_isa_avx512());
+    }
+};
+#endif
 
-    using key_pass_t = typename fht_chunk<K, V>::key_pass_t;
-    using val_pass_t = typename fht_chunk<K, V>::val_pass_t;
+// entry point of table ops. Calls f with the kernels for this cpu. Args is
+// given explicitly so reference args (key_pass_t of big keys) aren't copied
+template<typename... Args, typename F>
+static inline auto __attribute__((always_inline))
+fht_isa_dispatch(F f, Args... args) -> decltype(f(fht_isa_native(), args...)) {
+#ifdef FHT_DISPATCH_ISA
+    if (FHT_CPU_ISA == FHT_ISA_AVX512) {
+        return fht_isa_run<fht_isa_avx512>::template run<Args...>(f, args...);
+    }
+    if (FHT_CPU_ISA == FHT_ISA_AVX2) {
+        return fht_isa_run<fht_isa_avx2>::template run<Args...>(f, args...);
+    }
+    return fht_isa_run<fht_isa_sse2>::template run<Args...>(f, args...);
+#else
+    return f(fht_isa_native(), args...);
+#endif
+}
 
+// line masks are rotated so bit 0 is the first slot of line start_idx. That
+// way probe order is just bit order. start_idx isn't masked to a line so n
+// can be >= 64
+static inline constexpr uint64_t __attribute__((always_inline))
+fht_rotr_64(const uint64_t v, const uint32_t n) {
+    return (v >> (n & 63)) | (v << ((-n) & 63));
+}
 
-    typedef fht_iterator_t<K, V> fht_iterator;
-    //////////////////////////////////////////////////////////////////////
-    fht_table(const uint64_t init_size) {
+// masks of 128 slot chunks
+__extension__ typedef unsigned __int128 fht_mask_128;
+
+// kernels for all N tags of a chunk (see fht_chunk_slots) and the mask type
+// they give (bit n is slot n). 64 is the _64 kernels as is, 128 two of them
+// and 16 / 32 the line kernels. rotr is fht_rotr_64 for N bits and first is
+// tzcnt of a mask that isn't 0
+template<typename Isa, typename Tag, uint32_t N>
+struct fht_slot_ops {
+    typedef fht_tag_ops<Isa, Tag> ops;
+    typedef uint64_t               mask_t;
+
+    static constexpr uint32_t lines = N / FHT_MM_IDX_MULT;
+    static constexpr mask_t   all   = (((mask_t)1) << N) - 1;
+
+    static inline mask_t __attribute__((always_inline))
+    match(const __m128i * const tags, const Tag tag) {
+        mask_t m = 0;
+        for (uint32_t i = 0; i < lines; ++i) {
+            m |= ((mask_t)ops::match(tags + sizeof(Tag) * i, tag))
+                 << (FHT_MM_IDX_MULT * i);
+        }
+        return m;
+    }
 
-        // ensure init_size is above min
-        const uint64_t _init_size = init_size > FHT_DEFAULT_INIT_SIZE
-                                        ? roundup_next_p2(init_size)
-                                        : FHT_DEFAULT_INIT_SIZE;
+    static inline mask_t __attribute__((always_inline))
+    empty(const __m128i * const tags) {
+        mask_t m = 0;
+        for (uint32_t i = 0; i < lines; ++i) {
+            m |= ((mask_t)ops::empty(tags + sizeof(Tag) * i))
+                 << (FHT_MM_IDX_MULT * i);
+        }
+        return m;
+    }
 
-        const uint32_t _log_init_size = (const uint32_t)log_b2(_init_size);
-        //    int *  test = Allocator::new (NULL) int;
+    static inline mask_t __attribute__((always_inline))
+    empty_or_erased(const __m128i * const tags) {
+        mask_t m = 0;
+        for (uint32_t i = 0; i < lines; ++i) {
+            m |= ((mask_t)ops::empty_or_erased(tags + sizeof(Tag) * i))
+                 << (FHT_MM_IDX_MULT * i);
+        }
+        return m;
+    }
 
-        // alloc chunks
-        this->chunks =
-            this->alloc_mmap.allocate((_init_size / FHT_TAGS_PER_CLINE));
+    // less than a _64 kernel's worth, plain stores vectorize fine
+    static inline void __attribute__((always_inline))
+    reset(void * const tags) {
+        for (uint32_t i = 0; i < N; ++i) {
+            ((Tag * const)tags)[i] = fht_tags<Tag>::invalid;
+        }
+    }
 
-        for (uint32_t i = 0; i < (_init_size / FHT_TAGS_PER_CLINE); ++i) {
-            for (uint32_t j = 0; j < FHT_MM_LINE; ++j) {
-                ((__m256i * const)(this->chunks + i))[0] = FHT_RESET_VEC;
-                ((__m256i * const)(this->chunks + i))[1] = FHT_RESET_VEC;
+    static inline void __attribute__((always_inline))
+    clear_erased(void * const tags) {
+        for (uint32_t i = 0; i < N; ++i) {
+            if (((Tag * const)tags)[i] == fht_tags<Tag>::erased) {
+                ((Tag * const)tags)[i] = fht_tags<Tag>::invalid;
             }
         }
-        this->log_incr = _log_init_size;
-        this->npairs   = 0;
     }
-    fht_table() : fht_table(FHT_DEFAULT_INIT_SIZE) {}
 
+    static inline constexpr mask_t __attribute__((always_inline))
+    rotr(const mask_t v, const uint32_t n) {
+        return ((v >> (n & (N - 1))) | (v << (N - (n & (N - 1))))) & all;
+    }
 
-    ~fht_table() {
-        this->alloc_mmap.deallocate(
-            this->chunks,
-            (((1UL) << (this->log_incr)) / FHT_TAGS_PER_CLINE));
+    static inline uint64_t __attribute__((always_inline))
+    tzcnt(const mask_t v) {
+        return ops::tzcnt_64(v);
     }
 
+    static inline uint64_t __attribute__((always_inline))
+    first(const mask_t v) {
+        uint64_t idx;
+        __asm__("tzcnt %1, %0" : "=r"((idx)) : "rm"((v)));
+        return idx;
+    }
+};
 
-    //////////////////////////////////////////////////////////////////////
-    // very basic info
-    inline constexpr bool
-    empty() const {
-        return !(this->npairs);
+template<typename Isa, typename Tag>
+struct fht_slot_ops<Isa, Tag, 64> {
+    typedef fht_tag_ops<Isa, Tag> ops;
+    typedef uint64_t               mask_t;
+
+    static constexpr mask_t all = ~((mask_t)0);
+
+    static inline mask_t __attribute__((always_inline))
+    match(const __m128i * const tags, const Tag tag) {
+        return ops::match_64(tags, tag);
     }
-    inline constexpr uint64_t
-    size() const {
-        return this->npairs;
+
+    static inline mask_t __attribute__((always_inline))
+    empty(const __m128i * const tags) {
+        return ops::empty_64(tags);
     }
-    inline constexpr uint64_t
-    max_size() const {
-        return (1UL) << this->log_size;
+
+    static inline mask_t __attribute__((always_inline))
+    empty_or_erased(const __m128i * const tags) {
+        return ops::empty_or_erased_64(tags);
     }
 
-    inline constexpr double
-    load_factor() const {
-        return ((double)this->size()) / ((double)this->max_size());
+    static inline void __attribute__((always_inline))
+    reset(void * const tags) {
+        ops::reset(tags);
     }
 
-    // aint gunna do anything about this
-    inline constexpr double
-    max_load_factor() const {
-        return 1.0;
+    static inline void __attribute__((always_inline))
+    clear_erased(void * const tags) {
+        ops::clear_erased(tags);
     }
-    //////////////////////////////////////////////////////////////////////
 
-    //////////////////////////////////////////////////////////////////////
-    // rehashing
-    // rehashing
-    template<typename _K         = K,
-             typename _V         = V,
-             typename _Hasher    = Hasher,
-             typename _Allocator = Allocator>
-    typename std::enable_if<
-        std::is_same<_Allocator, INPLACE_MMAP_ALLOC<_K, _V>>::value,
-        void>::type
-    rehash() {
+    static inline constexpr mask_t __attribute__((always_inline))
+    rotr(const mask_t v, const uint32_t n) {
+        return fht_rotr_64(v, n);
+    }
 
-        // incr table log
-        const uint32_t          _new_log_incr = ++(this->log_incr);
-        fht_chunk<K, V> * const old_chunks    = this->chunks;
+    static inline uint64_t __attribute__((always_inline))
+    tzcnt(const mask_t v) {
+        return ops::tzcnt_64(v);
+    }
 
+    static inline uint64_t __attribute__((always_inline))
+    first(const mask_t v) {
+        uint64_t idx;
+        __asm__("tzcnt %1, %0" : "=r"((idx)) : "rm"((v)));
+        return idx;
+    }
+};
 
-        const uint32_t _num_chunks =
-            ((1u) << (_new_log_incr - 1)) / FHT_TAGS_PER_CLINE;
+template<typename Isa, typename Tag>
+struct fht_slot_ops<Isa, Tag, 128> {
+    typedef fht_tag_ops<Isa, Tag> ops;
+    typedef fht_mask_128           mask_t;
 
+    static constexpr mask_t all = ~((mask_t)0);
 
-        // allocate new chunk array
-        fht_chunk<K, V> * const new_chunks =
-            this->alloc_mmap.allocate(_num_chunks);
+    // __m128i before the second 64 tags
+    static constexpr uint32_t half = FHT_MM_LINE * sizeof(Tag);
 
+    static inline constexpr mask_t __attribute__((always_inline))
+    join(const uint64_t lo, const uint64_t hi) {
+        return ((mask_t)lo) | (((mask_t)hi) << 64);
+    }
 
-        uint32_t to_move = 0;
-        uint32_t new_starts;
-        uint32_t old_start_good_slots;
-        // iterate through all chunks and re-place nodes
-        for (uint32_t i = 0; i < _num_chunks; ++i) {
-            new_starts           = 0;
-            old_start_good_slots = 0;
+    static inline mask_t __attribute__((always_inline))
+    match(const __m128i * const tags, const Tag tag) {
+        return join(ops::match_64(tags, tag), ops::match_64(tags + half, tag));
+    }
 
-            uint32_t old_start_pos[FHT_MM_LINE]     = { 0 };
-            uint64_t old_start_to_move[FHT_MM_LINE] = { 0 };
+    static inline mask_t __attribute__((always_inline))
+    empty(const __m128i * const tags) {
+        return join(ops::empty_64(tags), ops::empty_64(tags + half));
+    }
 
+    static inline mask_t __attribute__((always_inline))
+    empty_or_erased(const __m128i * const tags) {
+        return join(ops::empty_or_erased_64(tags),
+                    ops::empty_or_erased_64(tags + half));
+    }
 
-            fht_chunk<K, V> * const old_chunk = old_chunks + i;
-            fht_chunk<K, V> * const new_chunk = new_chunks + i;
+    static inline void __attribute__((always_inline))
+    reset(void * const tags) {
+        ops::reset(tags);
+        ops::reset((void * const)(((__m128i * const)tags) + half));
+    }
 
-            // all intents and purposes not an important optimization but faster
-            // way to reset deleted
-            __m256i * const set_tags = (__m256i * const)(old_chunk->tags);
+    static inline void __attribute__((always_inline))
+    clear_erased(void * const tags) {
+        ops::clear_erased(tags);
+        ops::clear_erased((void * const)(((__m128i * const)tags) + half));
+    }
 
-            // turn all deleted tags -> INVALID (reset basically)
-            set_tags[0] = _mm256_min_epu8(set_tags[0], FHT_RESET_VEC);
-            set_tags[1] = _mm256_min_epu8(set_tags[1], FHT_RESET_VEC);
+    static inline constexpr mask_t __attribute__((always_inline))
+    rotr(const mask_t v, const uint32_t n) {
+        return (v >> (n & 127)) | (v << ((-n) & 127));
+    }
 
-            uint64_t j_idx,
-                iter_mask =
-                    ~((((uint64_t)_mm256_movemask_epi8(set_tags[1])) << 32) |
-                      (((uint32_t)_mm256_movemask_epi8(set_tags[0])) &
-                       (0xffffffffU)));
+    static inline uint64_t __attribute__((always_inline))
+    tzcnt(const mask_t v) {
+        return ((uint64_t)v) ? ops::tzcnt_64((uint64_t)v)
+                             : 64 + ops::tzcnt_64((uint64_t)(v >> 64));
+    }
 
-            while (iter_mask) {
-                __asm__("tzcnt %1, %0" : "=r"((j_idx)) : "rm"((iter_mask)));
-                iter_mask ^= ((1UL) << j_idx);
+    static inline uint64_t __attribute__((always_inline))
+    first(const mask_t v) {
+        return ((uint64_t)v)
+                   ? (uint64_t)__builtin_ctzll((uint64_t)v)
+                   : 64 + (uint64_t)__builtin_ctzll((uint64_t)(v >> 64));
+    }
+};
 
+//////////////////////////////////////////////////////////////////////
+// manipulation of resize of hash_val
+#define FHT_TO_MASK(n) ((((hash_type_t)1) << ((n))) - 1)
 
-                // if node is invalid or deleted skip it. Can't just bvec iter
-                // here because need to reset to invalid
+// get nths bith
 
-                const hash_type_t raw_slot =
-                    this->hash(old_chunk->get_key_n((const uint32_t)j_idx));
-                const uint32_t start_idx = FHT_GEN_START_IDX(raw_slot);
+#define FHT_GET_NTH_BIT(X, n)                                                  \
+    ((((X) >> (fht_tags<tag_t>::content_bits - FHT_LOG_CHUNK_SLOTS)) >>        \
+      ((n))) &                                                                 \
+     0x1)
 
-                if (FHT_GET_NTH_BIT(raw_slot, _new_log_incr - 1)) {
-                    const int8_t tag =
-                        old_chunk->get_tag_n((const uint32_t)j_idx);
-                    old_chunk->set_tag_n((const uint32_t)j_idx, INVALID_MASK);
+#define FHT_HASH_TO_IDX(hash_val, tbl_log)                                     \
+    ((uint32_t)(((((hash_val) >>                                               \
+                   (fht_tags<tag_t>::content_bits - FHT_LOG_CHUNK_SLOTS)) &    \
+                  FHT_TO_MASK(tbl_log)) /                                      \
+                 FHT_CHUNK_SLOTS)))
+
+// chunk geometry of the table (its Slots param)
+#define FHT_CHUNK_SLOTS     (Slots)
+#define FHT_LOG_CHUNK_SLOTS ((uint32_t)__builtin_ctz(FHT_CHUNK_SLOTS))
+#define FHT_CHUNK_LINES     (FHT_CHUNK_SLOTS / FHT_MM_IDX_MULT)
+#define FHT_CHUNK_LINE_MASK (FHT_CHUNK_LINES - 1)
+
+// smallest table. At least one chunk
+#define FHT_MIN_SIZE                                                           \
+    (FHT_DEFAULT_INIT_SIZE > FHT_CHUNK_SLOTS ? FHT_DEFAULT_INIT_SIZE           \
+                                             : FHT_CHUNK_SLOTS)
+
+// tag pointers (what find / add give) to the chunk / slot they are for
+#define FHT_TAG_BYTES_MASK (fht_tag_bytes<K, V, Slots>() - 1)
+#define FHT_TAG_PTR_TO_IDX(tag_ptr)                                            \
+    (((tag_ptr)&FHT_TAG_BYTES_MASK) / sizeof(tag_t))
+
+#define FHT_GEN_TAG(hash_val) ((tag_t)((hash_val)&fht_tags<tag_t>::content))
+#define FHT_GEN_START_IDX(hash_val)                                            \
+    (const uint32_t)((hash_val) >> (8 * sizeof(hash_type_t) - 3))
 
-                    // place new node w.o duplicate check
-                    for (uint32_t new_j = 0; new_j < FHT_MM_LINE; ++new_j) {
-                        const uint32_t outer_idx =
-                            (new_j + start_idx) & FHT_MM_LINE_MASK;
-                        const uint32_t inner_idx =
-                            (new_starts >> (8 * outer_idx)) & 0xff;
+// number of chunks and mask for chunk idx for table of size 2 ^ tbl_log
+#define FHT_NUM_CHUNKS(tbl_log)                                                \
+    ((uint32_t)(((1UL) << (tbl_log)) / FHT_CHUNK_SLOTS))
+#define FHT_CHUNK_MASK(tbl_log)  ((const uint32_t)(FHT_NUM_CHUNKS(tbl_log) - 1))
 
-                        if (__builtin_expect(inner_idx != FHT_MM_IDX_MULT, 1)) {
-                            const uint32_t true_idx =
-                                FHT_MM_IDX_MULT * outer_idx + inner_idx;
+// overflow probe sequence for chunks. k is incremented before each step so the
+// distance from the home chunk goes through the triangular numbers (1, 3, 6,
+// 10...) which with a power of 2 number of chunks will visit every chunk
+#define FHT_NEXT_CHUNK(chunk_idx, k, chunk_mask)                               \
+    (((chunk_idx) + (k)) & (chunk_mask))
 
-                            ((int8_t * const)new_chunk->tags)[true_idx] = tag;
-                            NEW(K,
-                                *(new_chunk->get_key_n_ptr(true_idx)),
-                                std::move(*(old_chunk->get_key_n_ptr(
-                                    (const uint32_t)j_idx))));
-                            NEW(V,
-                                *(new_chunk->get_val_n_ptr(true_idx)),
-                                std::move(*(old_chunk->get_val_n_ptr(
-                                    (const uint32_t)j_idx))));
+//////////////////////////////////////////////////////////////////////
 
 
-                            new_starts += ((1u) << (8 * outer_idx));
-                            break;
-                        }
-                    }
-                }
-                else {
-                    // unplaceable slots
-                    old_start_pos[j_idx / FHT_MM_IDX_MULT] |=
-                        ((1u) << (j_idx & FHT_MM_IDX_MASK));
-                    if ((j_idx / FHT_MM_IDX_MULT) !=
-                        (start_idx & FHT_MM_LINE_MASK)) {
-                        old_start_to_move[start_idx & FHT_MM_LINE_MASK] |=
-                            ((1UL) << j_idx);
-                        to_move |= ((1u) << (start_idx & FHT_MM_LINE_MASK));
-                    }
-                    else {
-                        old_start_good_slots +=
-                            ((1u) << (8 * (start_idx & FHT_MM_LINE_MASK)));
-                    }
-                }
-            }
+//////////////////////////////////////////////////////////////////////
+// forward declaration of default helper struct
+// near their implementations below are some alternatives ive written
 
-            for (uint32_t j = 0; j < FHT_MM_LINE; ++j) {
-                const uint32_t inner_idx = (new_starts >> (8 * j)) & 0xff;
-                for (uint32_t _j = inner_idx; _j < FHT_MM_IDX_MULT; ++_j) {
-                    new_chunk->set_tag_n(j * FHT_MM_IDX_MULT + _j,
-                                         INVALID_MASK);
-                }
-            }
+// Must define:
+// const uint32_t operator()(K) or const uint32_t operator()(K const &)
+template<typename K>
+struct DEFAULT_HASH_32;
 
-            uint64_t to_move_idx;
-            uint32_t to_place_idx;
-            while (to_move) {
-                uint32_t j;
-                __asm__("tzcnt %1, %0" : "=r"((j)) : "rm"((to_move)));
-                // has space and has items to move to it
-                while (old_start_pos[j] != 0xffff && old_start_to_move[j]) {
+// const uint64_t operator()(K) or const uint64_t operator()(K const &)
+template<typename K>
+struct DEFAULT_HASH_64;
 
-                    __asm__("tzcnt %1, %0"
-                            : "=r"((to_move_idx))
-                            : "rm"((old_start_to_move[j])));
+// DEFAULT_HASH_64 that fills all 64 bits of the hash (see fht_full_hash)
+template<typename K>
+struct FULL_HASH_64;
 
-                    __asm__("tzcnt %1, %0"
-                            : "=r"((to_place_idx))
-                            : "rm"((~old_start_pos[j])));
+// default chunk geometry of a K / V pair (see its definition below)
+template<typename K, typename V>
+struct fht_chunk_slots;
 
-                    old_start_to_move[j] ^= ((1UL) << to_move_idx);
+// allocators are for chunks of Slots slots. A table rebinds the one it is
+// given to its own Slots (see fht_alloc_slots) so DEFAULT_ALLOC<K, V> works
+// for any of them
 
-                    const uint32_t true_idx =
-                        FHT_MM_IDX_MULT * j + to_place_idx;
+// remaps each time table resizes
+template<typename K,
+         typename V,
+         uint32_t Slots = fht_chunk_slots<K, V>::value>
+struct DEFAULT_MMAP_ALLOC;
 
-                    old_chunk->set_tag_n(
-                        true_idx,
-                        old_chunk->get_tag_n((const uint32_t)to_move_idx));
+template<typename K,
+         typename V,
+         uint32_t Slots = fht_chunk_slots<K, V>::value>
+struct DEFAULT_ALLOC;
 
+// this will perform significantly better if the copy time on either keys or
+// values is large (it tries to avoid at least a portion of the copying step in
+// resize)
+template<typename K,
+         typename V,
+         uint32_t Slots = fht_chunk_slots<K, V>::value>
+struct INPLACE_MMAP_ALLOC;
 
-                    NEW(K,
-                        *(old_chunk->get_key_n_ptr(true_idx)),
-                        std::move(*(old_chunk->get_key_n_ptr(
-                            (const uint32_t)to_move_idx))));
+// Allocator for chunks of Slots slots. Allocators that aren't templated on K,
+// V and their chunk's slots have to be for the table's already
+template<typename Allocator, uint32_t Slots>
+struct fht_alloc_slots {
+    typedef Allocator type;
+};
 
+template<template<typename, typename, uint32_t> class Allocator,
+         typename K,
+         typename V,
+         uint32_t From,
+         uint32_t Slots>
+struct fht_alloc_slots<Allocator<K, V, From>, Slots> {
+    typedef Allocator<K, V, Slots> type;
+};
+
+//////////////////////////////////////////////////////////////////////
+// helpers
+
+// intentionally not specify for inline as this is far from critical path and
+// compiler knows better if its going to bloat executable
+static uint64_t __attribute__((const)) log_b2(uint64_t n) {
+    uint64_t s, t;
+    t = (n > 0xffffffffUL) * (32);
+    n >>= t;
+    t = (n > 0xffffUL) * (16);
+    n >>= t;
+    s = (n > 0xffUL) * (8);
+    n >>= s, t |= s;
+    s = (n > 0xfUL) * (4);
+    n >>= s, t |= s;
+    s = (n > 0x3UL) * (2);
+    n >>= s, t |= s;
+    return (t | (n / 2));
+}
+
+// intentionally not specify for inline as this is far from critical path and
+// compiler knows better if its going to bloat executable
+static uint64_t __attribute__((const)) roundup_next_p2(uint64_t v) {
+    v--;
+    v |= v >> 1;
+    v |= v >> 2;
+    v |= v >> 4;
+    v |= v >> 8;
+    v |= v >> 16;
+    v |= v >> 32;
+    v++;
+    return v;
+}
+
+// these get optimized to popcnt. For resize
+static inline uint32_t
+bitcount_32(uint32_t v) {
+    uint32_t c;
+    c = v - ((v >> 1) & 0x55555555);
+    c = ((c >> 2) & 0x33333333) + (c & 0x33333333);
+    c = ((c >> 4) + c) & 0x0F0F0F0F;
+    c = ((c >> 8) + c) & 0x00FF00FF;
+    c = ((c >> 16) + c) & 0x0000FFFF;
+    return c;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Really just typedef structs
+template<typename K, typename V>
+struct fht_node {
+    K key;
+    V val;
+};
+
+// specialize (to std::integral_constant<uint32_t, n>) for a K / V pair to
+// change how many slots its chunks have. n is 16, 32, 64 or 128. Fewer slots
+// means less to probe and less rehashed per chunk but a full chunk overflows
+// sooner. Default is one tag per byte of a cache line. This is only the
+// default of a table's Slots param so one table can also be given its own
+template<typename K, typename V>
+struct fht_chunk_slots
+    : std::integral_constant<uint32_t, (uint32_t)FHT_TAGS_PER_CLINE> {};
+
+// specialize to std::true_type for a K / V pair to keep each node's hash in
+// its chunk (after the nodes). Costs 8 bytes per slot but resizing never has
+// to hash a key again and key compares check the hash first. Worth it when
+// hashing / comparing keys is expensive (i.e long strings)
+template<typename K, typename V>
+struct fht_store_hash : std::false_type {};
+
+// specialize to std::true_type for a K / V pair to keep keys and values in
+// separate arrays in each chunk instead of as nodes. Probing then only touches
+// key cache lines which helps a lot when V is large compared to K. Iterators
+// give a pair of references (fht_kv_ref) instead of a std::pair pointer
+template<typename K, typename V>
+struct fht_separate_kv : std::false_type {};
+
+// keys / values of a chunk. Combined nodes are laid out the same as
+// std::pair<K, V> which is what the iterator gives
+template<typename K,
+         typename V,
+         uint32_t Slots,
+         bool = fht_separate_kv<K, V>::value>
+struct fht_chunk_kv {
+    fht_node<K, V> nodes[Slots];
+
+    inline constexpr const K & __attribute__((always_inline))
+    key(const uint32_t n) const {
+        return this->nodes[n].key;
+    }
+
+    inline constexpr const V & __attribute__((always_inline))
+    val(const uint32_t n) const {
+        return this->nodes[n].val;
+    }
+
+    inline constexpr K & __attribute__((always_inline)) key(const uint32_t n) {
+        return this->nodes[n].key;
+    }
+
+    inline constexpr V & __attribute__((always_inline)) val(const uint32_t n) {
+        return this->nodes[n].val;
+    }
+};
+
+template<typename K, typename V, uint32_t Slots>
+struct fht_chunk_kv<K, V, Slots, true> {
+    K keys[Slots];
+    V vals[Slots];
+
+    inline constexpr const K & __attribute__((always_inline))
+    key(const uint32_t n) const {
+        return this->keys[n];
+    }
+
+    inline constexpr const V & __attribute__((always_inline))
+    val(const uint32_t n) const {
+        return this->vals[n];
+    }
+
+    inline constexpr K & __attribute__((always_inline)) key(const uint32_t n) {
+        return this->keys[n];
+    }
+
+    inline constexpr V & __attribute__((always_inline)) val(const uint32_t n) {
+        return this->vals[n];
+    }
+};
+
+// keys / values of a chunk and, if fht_store_hash says so, their hashes
+template<typename K,
+         typename V,
+         uint32_t Slots,
+         bool = fht_store_hash<K, V>::value>
+struct fht_chunk_body {
+    fht_chunk_kv<K, V, Slots> kv;
+};
+
+template<typename K, typename V, uint32_t Slots>
+struct fht_chunk_body<K, V, Slots, true> {
+    fht_chunk_kv<K, V, Slots> kv;
+    uint64_t                  hashes[Slots];
+};
+
+// specialize to std::true_type for a K / V pair to keep chunk bodies (keys /
+// values / hashes) out of the chunk array. Each chunk is then just its tag
+// line and a line with a pointer to its body so misses only ever touch the
+// tag lines instead of one line every sizeof(body) bytes. Hits / adds pay
+// for reading the pointer. The allocators put the bodies after the chunks
+template<typename K, typename V>
+struct fht_dense_tags : std::false_type {};
+
+// specialize to std::true_type for a K / V pair to use 16 bit tags. They keep
+// 15 bits of the hash instead of 7 so probing a full chunk compares ~0.002
+// keys that aren't the one being looked for instead of ~0.5. Worth it when a
+// key compare is a cache miss (i.e long strings). A chunk's tags take twice
+// the bytes and the table needs a hasher that fills 64 bits (see
+// fht_full_hash)
+template<typename K, typename V>
+struct fht_wide_tags : std::false_type {};
+
+// specialize to std::true_type for a hasher that fills all 64 bits of what it
+// returns. The chunk idx comes from the bits above the tags so with wide tags
+// a hasher that only fills 32 of them (DEFAULT_HASH_64 does for 8 byte keys /
+// strings) runs out of chunk idx bits past 2^17 chunks and the table keeps
+// growing into chunks it can't index
+template<typename Hasher>
+struct fht_full_hash : std::false_type {};
+
+template<typename K>
+struct fht_full_hash<FULL_HASH_64<K>> : std::true_type {};
+
+// hasher of a K / V table when none is given
+template<typename K, typename V>
+using fht_default_hash =
+    typename std::conditional<fht_wide_tags<K, V>::value,
+                              FULL_HASH_64<K>,
+                              DEFAULT_HASH_64<K>>::type;
+
+template<typename K, typename V>
+using fht_tag_t = typename std::
+    conditional<fht_wide_tags<K, V>::value, int16_t, int8_t>::type;
+
+// bytes of tags per chunk. Chunks are aligned to it so the iterator can get
+// from a tag to its chunk
+template<typename K,
+         typename V,
+         uint32_t Slots = fht_chunk_slots<K, V>::value>
+static constexpr uint64_t
+fht_tag_bytes() {
+    return Slots * sizeof(fht_tag_t<K, V>);
+}
+
+// tag lines of a chunk and where its body is
+template<typename K,
+         typename V,
+         uint32_t Slots,
+         bool = fht_dense_tags<K, V>::value>
+struct alignas(fht_tag_bytes<K, V, Slots>()) fht_chunk_lines {
+    typedef fht_chunk_body<K, V, Slots> body_t;
+
+    __m128i tags[fht_tag_bytes<K, V, Slots>() / sizeof(__m128i)];
+    body_t  body;
+
+    inline constexpr const body_t * __attribute__((always_inline))
+    get_body() const {
+        return &(this->body);
+    }
+
+    inline constexpr body_t * __attribute__((always_inline)) get_body() {
+        return &(this->body);
+    }
+};
+
+// padded to twice the tags so every chunk's tags stay aligned
+template<typename K, typename V, uint32_t Slots>
+struct alignas(fht_tag_bytes<K, V, Slots>())
+    fht_chunk_lines<K, V, Slots, true> {
+    typedef fht_chunk_body<K, V, Slots> body_t;
+
+    __m128i  tags[fht_tag_bytes<K, V, Slots>() / sizeof(__m128i)];
+    body_t * body;
+    uint8_t  pad[fht_tag_bytes<K, V, Slots>() - sizeof(body_t *)];
+
+    inline constexpr body_t * __attribute__((always_inline)) get_body() const {
+        return this->body;
+    }
+};
+
+// when the table grows. Table size has to stay a power of 2 (chunk idx is
+// just masked out of the hash and rehash splits chunk i into i and i |
+// num_chunks) so growing by less than 2x isn't an option. Instead huge tables
+// can be set to fill up more before they double which gets most of the same
+// memory savings
+struct fht_growth_policy {
+    // load factor table doubles at
+    double max_load;
+
+    // tables with at least this many slots double at huge_max_load instead
+    uint64_t huge_size;
+    double   huge_max_load;
+
+    // erase halves the table when load drops below this (0 never shrinks).
+    // Has to be less than half of either max load so a shrunk table isn't
+    // right back at the point where it grows
+    double min_load;
+
+    // erase purges tombstones when more than this fraction of slots are
+    // tombstones (0 never purges automatically)
+    double max_erased;
+
+    // if > 0 table grows incrementally: each add / erase moves this many
+    // chunks to the new array instead of one add() doing the whole rehash.
+    // Ignored by INPLACE_MMAP_ALLOC (old and new array are the same memory)
+    uint32_t migrate_chunks;
+
+    // if > 1 rehash() / reserve() split the chunks across this many threads
+    // (each old chunk only moves nodes to new chunks no other old chunk
+    // does). Hasher has to be callable from all of them at once
+    uint32_t rehash_threads;
+};
+
+static const fht_growth_policy FHT_DEFAULT_GROWTH_POLICY = {
+    FHT_MAX_LOAD_FACTOR,
+    (~(0UL)),
+    FHT_MAX_LOAD_FACTOR,
+    0.0,
+    FHT_MAX_ERASED_RATIO,
+    0,
+    0
+};
+
+// threads worth splitting n chunks across. At most max_threads and each gets
+// at least FHT_PARALLEL_MIN_CHUNKS
+static inline uint32_t
+fht_parallel_threads(const uint64_t n, const uint32_t max_threads) {
+    const uint64_t most = n / FHT_PARALLEL_MIN_CHUNKS;
+    if (most <= 1 || max_threads <= 1) {
+        return 1;
+    }
+    return (uint32_t)(most < max_threads ? most : max_threads);
+}
+
+// splits [0, n) into nthreads contiguous ranges and calls fn(t, begin, end)
+// for range t on its own thread (range 0 on this one). Returns once all are
+// done
+template<typename Fn>
+static void
+fht_parallel_ranges(const uint64_t n, const uint32_t nthreads, Fn && fn) {
+    std::vector<std::thread> threads;
+    threads.reserve(nthreads);
+    for (uint32_t t = 1; t < nthreads; ++t) {
+        threads.emplace_back([&fn, n, nthreads, t]() {
+            fn(t, (n * t) / nthreads, (n * (t + 1)) / nthreads);
+        });
+    }
+    fn(0, 0, n / nthreads);
+    for (uint32_t t = 0; t < threads.size(); ++t) {
+        threads[t].join();
+    }
+}
+
+// string bytes that aren't in a std::string (i.e a slice of some buffer).
+// Lets std::string keyed tables be searched without building a std::string
+struct fht_str_ref {
+    const char * str;
+    uint32_t     len;
+};
+
+static inline bool
+operator==(const std::string & key, const fht_str_ref other) {
+    return key.length() == other.len &&
+           !memcmp(key.data(), other.str, other.len);
+}
+
+
+// chunk containing cache line of tags and the keys / values (either combined
+// nodes or separate arrays, see fht_separate_kv). Either way each chunk
+// contains bytes per cache line number of key value pairs (on most 64 bit
+// machines this will mean 64 Key value pairs)
+template<typename K,
+         typename V,
+         uint32_t Slots = fht_chunk_slots<K, V>::value>
+struct fht_chunk : fht_chunk_lines<K, V, Slots> {
+
+
+    // determine best way to pass K/V depending on size. Generally passing
+    // values machine word size is ill advised
+    template<typename T>
+    using pass_type_t =
+        typename std::conditional<(std::is_arithmetic<T>::value ||
+                                   std::is_pointer<T>::value),
+                                  const T,
+                                  const T &>::type;
+
+
+    // typedefs to fht_table can access these variables
+    typedef pass_type_t<K> key_pass_t;
+    typedef pass_type_t<V> val_pass_t;
+    typedef fht_node<K, V> node_t;
+
+    typedef fht_tag_t<K, V> tag_t;
+    template<typename Isa>
+    using tag_ops_t = fht_tag_ops<Isa, tag_t>;
+    template<typename Isa>
+    using slot_ops_t = fht_slot_ops<Isa, tag_t, Slots>;
+
+    // masks of the whole chunk's slots
+    typedef typename slot_ops_t<fht_isa_native>::mask_t mask_t;
+
+    static_assert(Slots == 16 || Slots == 32 || Slots == 64 || Slots == 128,
+                  "chunks have 16, 32, 64 or 128 slots");
+
+    // line idx (16 tags) as the line kernels take it
+    inline constexpr const __m128i * __attribute__((always_inline))
+    tag_line(const uint32_t idx) const {
+        return this->tags + sizeof(tag_t) * idx;
+    }
+
+    // tag kernels (see fht_tag_ops), isa is which instruction set's
+    template<typename Isa>
+    inline uint32_t __attribute__((always_inline))
+    get_empty_or_erased(const uint32_t idx, const Isa) const {
+        return tag_ops_t<Isa>::empty_or_erased(this->tag_line(idx));
+    }
+
+    template<typename Isa>
+    inline uint32_t __attribute__((always_inline))
+    get_empty(const uint32_t idx, const Isa) const {
+        return tag_ops_t<Isa>::empty(this->tag_line(idx));
+    }
+
+    template<typename Isa>
+    inline uint32_t __attribute__((always_inline))
+    get_tag_matches(const tag_t tag, const uint32_t idx, const Isa) const {
+        return tag_ops_t<Isa>::match(this->tag_line(idx), tag);
+    }
+
+    // whole chunk versions (see fht_slot_ops) rotated to start at line
+    // start_idx (bit 0 is slot FHT_MM_IDX_MULT * start_idx)
+    template<typename Isa>
+    inline mask_t __attribute__((always_inline))
+    get_tag_matches_all(const tag_t    tag,
+                        const uint32_t start_idx,
+                        const Isa) const {
+        return slot_ops_t<Isa>::rotr(slot_ops_t<Isa>::match(this->tags, tag),
+                                     FHT_MM_IDX_MULT * start_idx);
+    }
+
+    // not rotated, mostly just tested for != 0 (see empty_line_end)
+    template<typename Isa>
+    inline mask_t __attribute__((always_inline))
+    get_empty_all(const Isa) const {
+        return slot_ops_t<Isa>::empty(this->tags);
+    }
+
+    template<typename Isa>
+    inline mask_t __attribute__((always_inline))
+    get_empty_all(const uint32_t start_idx, const Isa) const {
+        return slot_ops_t<Isa>::rotr(slot_ops_t<Isa>::empty(this->tags),
+                                     FHT_MM_IDX_MULT * start_idx);
+    }
+
+    template<typename Isa>
+    inline mask_t __attribute__((always_inline))
+    get_empty_or_erased_all(const uint32_t start_idx, const Isa) const {
+        return slot_ops_t<Isa>::rotr(
+            slot_ops_t<Isa>::empty_or_erased(this->tags),
+            FHT_MM_IDX_MULT * start_idx);
+    }
+
+    // slots with a node, not rotated
+    template<typename Isa>
+    inline mask_t __attribute__((always_inline))
+    get_full_all(const Isa) const {
+        return (~slot_ops_t<Isa>::empty_or_erased(this->tags)) &
+               slot_ops_t<Isa>::all;
+    }
+
+    // (rotated) end of the first line with an empty slot in probe order. Only
+    // slots before it can have the key being probed for. >= slots if there is
+    // no empty slot. Checked per match instead of masking the matches so that
+    // it stays out of the way of the first key compare (and isn't computed at
+    // all for chunks without a match)
+    template<typename Isa>
+    static inline uint64_t __attribute__((always_inline))
+    empty_line_end(const mask_t   empty_mask,
+                   const uint32_t start_idx,
+                   const Isa) {
+        return (slot_ops_t<Isa>::tzcnt(slot_ops_t<Isa>::rotr(
+                    empty_mask,
+                    FHT_MM_IDX_MULT * start_idx)) |
+                (FHT_MM_IDX_MULT - 1)) +
+               1;
+    }
+
+    // first slot of a mask that isn't 0
+    template<typename Isa>
+    static inline uint64_t __attribute__((always_inline))
+    first_slot(const mask_t mask, const Isa) {
+        return slot_ops_t<Isa>::first(mask);
+    }
+
+    // all tags to invalid
+    template<typename Isa>
+    inline void __attribute__((always_inline))
+    reset_tags(const Isa) {
+        slot_ops_t<Isa>::reset((void *)(this->tags));
+    }
+
+    // erased tags to invalid
+    template<typename Isa>
+    inline void __attribute__((always_inline))
+    clear_erased_tags(const Isa) {
+        slot_ops_t<Isa>::clear_erased((void *)(this->tags));
+    }
+
+    inline constexpr uint32_t __attribute__((always_inline))
+    is_erased_n(const uint32_t n) const {
+        return this->get_tag_n(n) == fht_tags<tag_t>::erased;
+    }
+
+    inline void constexpr __attribute__((always_inline))
+    erase_tag_n(const uint32_t n) {
+        this->set_tag_n(n, fht_tags<tag_t>::erased);
+    }
+
+    inline void constexpr __attribute__((always_inline))
+    invalidate_tag_n(const uint32_t n) {
+        this->set_tag_n(n, fht_tags<tag_t>::invalid);
+    }
+
+    // empty or erased
+    inline constexpr uint32_t __attribute__((always_inline))
+    resize_skip_n(const uint32_t n) const {
+        return this->get_tag_n(n) < 0;
+    }
+
+    // this unerases
+    inline constexpr void __attribute__((always_inline))
+    set_tag_n(const uint32_t n, const tag_t new_tag) {
+        ((tag_t *)this->tags)[n] = new_tag;
+    }
+
+
+    // the following exist for key/val in a far more complicated format
+    inline constexpr tag_t __attribute__((always_inline))
+    get_tag_n(const uint32_t n) const {
+        return ((const tag_t * const)this->tags)[n];
+    }
+
+
+    inline constexpr key_pass_t __attribute__((always_inline))
+    get_key_n(const uint32_t n) const {
+        return this->get_body()->kv.key(n);
+    }
+
+    inline constexpr uint32_t __attribute__((always_inline))
+    compare_key_n(const uint32_t n, key_pass_t other_key) const {
+        return this->get_body()->kv.key(n) == other_key;
+    }
+
+    // for lookups by some other type that compares with K (fht_str_ref)
+    template<typename PK>
+    inline constexpr uint32_t __attribute__((always_inline))
+    compare_key_n(const uint32_t n, const PK & other_key) const {
+        return this->get_body()->kv.key(n) == other_key;
+    }
+
+
+    inline constexpr val_pass_t __attribute__((always_inline))
+    get_val_n(const uint32_t n) const {
+        return this->get_body()->kv.val(n);
+    }
+
+
+    inline constexpr const K * __attribute__((always_inline))
+    get_key_n_ptr(const uint32_t n) const {
+        return (const K *)(&(this->get_body()->kv.key(n)));
+    }
+
+    inline constexpr const V * __attribute__((always_inline))
+    get_val_n_ptr(const uint32_t n) const {
+        return (const V *)(&(this->get_body()->kv.val(n)));
+    }
+
+    // for moving nodes out of a chunk (rehash / shrink / purge)
+    inline constexpr K * __attribute__((always_inline))
+    get_key_n_ptr(const uint32_t n) {
+        return &(this->get_body()->kv.key(n));
+    }
+
+    inline constexpr V * __attribute__((always_inline))
+    get_val_n_ptr(const uint32_t n) {
+        return &(this->get_body()->kv.val(n));
+    }
+
+    // prefetch of keys before the tags have been checked. Not with
+    // fht_dense_tags, getting the key address there means reading the body
+    // pointer which is the line a miss is supposed to skip
+    template<typename _K = K, typename _V = V>
+    inline constexpr
+        typename std::enable_if<!fht_dense_tags<_K, _V>::value, void>::type
+        __attribute__((always_inline)) prefetch_key_n(const uint32_t n) const {
+        prefetch<K>((const void * const)(this->get_key_n_ptr(n)));
+    }
+
+    template<typename _K = K, typename _V = V>
+    inline constexpr
+        typename std::enable_if<fht_dense_tags<_K, _V>::value, void>::type
+        __attribute__((always_inline)) prefetch_key_n(const uint32_t) const {}
+
+    // stored hash stuff. Without fht_store_hash these do nothing and should
+    // never be asked for a hash
+    template<typename _K = K, typename _V = V>
+    inline constexpr
+        typename std::enable_if<fht_store_hash<_K, _V>::value, uint64_t>::type
+        __attribute__((always_inline)) get_hash_n(const uint32_t n) const {
+        return this->get_body()->hashes[n];
+    }
+
+    template<typename _K = K, typename _V = V>
+    inline constexpr
+        typename std::enable_if<fht_store_hash<_K, _V>::value, void>::type
+        __attribute__((always_inline))
+        set_hash_n(const uint32_t n, const uint64_t raw_slot) {
+        this->get_body()->hashes[n] = raw_slot;
+    }
+
+    template<typename _K = K, typename _V = V>
+    inline constexpr
+        typename std::enable_if<!fht_store_hash<_K, _V>::value, void>::type
+        __attribute__((always_inline))
+        set_hash_n(const uint32_t /* n */, const uint64_t /* raw_slot */) {}
+
+    // node src is being moved to node dst
+    template<typename _K = K, typename _V = V>
+    inline constexpr
+        typename std::enable_if<fht_store_hash<_K, _V>::value, void>::type
+        __attribute__((always_inline))
+        move_hash_n(const uint32_t dst, const uint32_t src) {
+        this->get_body()->hashes[dst] = this->get_body()->hashes[src];
+    }
+
+    template<typename _K = K, typename _V = V>
+    inline constexpr
+        typename std::enable_if<!fht_store_hash<_K, _V>::value, void>::type
+        __attribute__((always_inline))
+        move_hash_n(const uint32_t /* dst */, const uint32_t /* src */) {}
+
+    // compare that can skip the key if the stored hash doesn't match. Not for
+    // arithmetic keys which are cheaper to compare than the hash is to load
+    template<typename PK, typename _K = K, typename _V = V>
+    inline constexpr typename std::enable_if<
+        fht_store_hash<_K, _V>::value && !std::is_arithmetic<_K>::value,
+        uint32_t>::type __attribute__((always_inline))
+        compare_hashed_key_n(const uint32_t n,
+                             const PK &     other_key,
+                             const uint64_t raw_slot) const {
+        return this->get_body()->hashes[n] == raw_slot &&
+               this->compare_key_n(n, other_key);
+    }
+
+    template<typename PK, typename _K = K, typename _V = V>
+    inline constexpr typename std::enable_if<
+        !fht_store_hash<_K, _V>::value || std::is_arithmetic<_K>::value,
+        uint32_t>::type __attribute__((always_inline))
+        compare_hashed_key_n(const uint32_t n,
+                             const PK &     other_key,
+                             const uint64_t /* raw_slot */) const {
+        return this->compare_key_n(n, other_key);
+    }
+};
+
+//////////////////////////////////////////////////////////////////////
+// what iterators give with fht_separate_kv. Key and value aren't next to
+// each other so there is no std::pair to point at. Acts as its own pointer
+// so it->first / it->second / (*it).first still work
+template<typename K, typename V>
+struct fht_kv_ref {
+    const K & first;
+    const V & second;
+
+    inline constexpr const fht_kv_ref * operator->() const {
+        return this;
+    }
+
+    inline constexpr const fht_kv_ref & operator*() const {
+        return *this;
+    }
+};
+
+// would be nice to implement in 4 bytes so iterator + bool fits in
+// register
+template<typename K,
+         typename V,
+         uint32_t Slots = fht_chunk_slots<K, V>::value>
+struct fht_iterator_t {
+
+    typedef typename std::conditional<fht_separate_kv<K, V>::value,
+                                      fht_kv_ref<K, V>,
+                                      const std::pair<K, V> *>::type pointer;
+    typedef typename std::conditional<fht_separate_kv<K, V>::value,
+                                      fht_kv_ref<K, V>,
+                                      const std::pair<K, V> &>::type
+        reference;
+
+    typedef fht_tag_t<K, V> tag_t;
+
+    // last tag of a chunk to first tag of the next
+    static constexpr uint64_t tag_bytes  = fht_tag_bytes<K, V, Slots>();
+    static constexpr uint64_t chunk_skip =
+        (sizeof(fht_chunk<K, V, Slots>) - tag_bytes) / sizeof(tag_t);
+
+    const tag_t * cur_tag;
+
+    fht_iterator_t(const tag_t * const init_tag_pos) {
+        this->cur_tag = init_tag_pos;
+    }
+
+
+    fht_iterator_t(const tag_t * init_tag_pos, const uint64_t end) {
+        // initialization of new iterator (not from find but from begin) so that
+        // it starts at a valid slot
+        while (((uint64_t)init_tag_pos) < end && (*init_tag_pos) < 0) {
+            if (__builtin_expect(((uint64_t)(init_tag_pos) % tag_bytes) ==
+                                     (tag_bytes - sizeof(tag_t)),
+                                 0)) {
+                init_tag_pos += chunk_skip;
+            }
+            ++init_tag_pos;
+        }
+        this->cur_tag = init_tag_pos;
+    }
+
+
+    fht_iterator_t &
+    operator++() {
+        do {
+            if (__builtin_expect(((uint64_t)(this->cur_tag) % tag_bytes) ==
+                                     (tag_bytes - sizeof(tag_t)),
+                                 0)) {
+                this->cur_tag += chunk_skip;
+            }
+            this->cur_tag++;
+        } while ((*(this->cur_tag)) < 0);
+        return *this;
+    }
+
+    inline fht_iterator_t &
+    operator++(int) {
+        ++(this);
+        return *this;
+    }
+
+    inline fht_iterator_t &
+    operator+=(uint32_t n) {
+        while (n) {
+            this ++;
+        }
+    }
+
+    fht_iterator_t &
+    operator--() {
+        do {
+            if (__builtin_expect(((uint64_t)(this->cur_tag) % tag_bytes) == 0,
+                                 0)) {
+                this->cur_tag -= chunk_skip;
+            }
+            this->cur_tag--;
+        } while ((*(this->cur_tag)) < 0);
+        return *this;
+    }
+
+    inline fht_iterator_t &
+    operator--(int) {
+        --(*this);
+        return *this;
+    }
+
+    inline fht_iterator_t &
+    operator-=(uint32_t n) {
+        while (n) {
+            this --;
+        }
+    }
+
+    template<typename _K = K, typename _V = V>
+    inline constexpr
+        typename std::enable_if<!fht_separate_kv<_K, _V>::value, pointer>::type
+        to_address() const {
+        // basically if we are using std::pair go to the actual pair,
+        // std::pair<K, V> is basically just and extension of it with K / V
+        // getting functionality. Goes through the chunk as the nodes aren't
+        // necessarily right after the tags (fht_dense_tags)
+        const fht_chunk<K, V, Slots> * const chunk =
+            (const fht_chunk<K, V, Slots> *)(((uint64_t)(this->cur_tag)) &
+                                      (~(tag_bytes - 1)));
+        return (const std::pair<K, V> *)(chunk->get_key_n_ptr(
+            (const uint32_t)((((uint64_t)(this->cur_tag)) & (tag_bytes - 1)) /
+                             sizeof(tag_t))));
+    }
+
+    // separate keys / values need the chunk to find both
+    template<typename _K = K, typename _V = V>
+    inline constexpr
+        typename std::enable_if<fht_separate_kv<_K, _V>::value, pointer>::type
+        to_address() const {
+        const fht_chunk<K, V, Slots> * const chunk =
+            (const fht_chunk<K, V, Slots> *)(((uint64_t)(this->cur_tag)) &
+                                      (~(tag_bytes - 1)));
+        const uint32_t n = (const uint32_t)(
+            (((uint64_t)(this->cur_tag)) & (tag_bytes - 1)) / sizeof(tag_t));
+        return { *(chunk->get_key_n_ptr(n)), *(chunk->get_val_n_ptr(n)) };
+    }
+
+    inline reference operator*() const {
+        return *(this->to_address());
+    }
+
+
+    inline pointer operator->() const {
+        return this->to_address();
+    }
+
+
+    inline friend bool
+    operator==(const fht_iterator_t & it_a, const fht_iterator_t & it_b) {
+        return ((uint64_t)(it_a.cur_tag)) == ((uint64_t)(it_b.cur_tag));
+    }
+
+    inline friend bool
+    operator!=(const fht_iterator_t & it_a, const fht_iterator_t & it_b) {
+        return ((uint64_t)(it_a.cur_tag)) != ((uint64_t)(it_b.cur_tag));
+    }
+
+    inline friend bool
+    operator<(const fht_iterator_t & it_a, const fht_iterator_t & it_b) {
+        return ((uint64_t)(it_a.cur_tag)) < ((uint64_t)(it_b.cur_tag));
+    }
+
+    inline friend bool
+    operator>(const fht_iterator_t & it_a, const fht_iterator_t & it_b) {
+        return ((uint64_t)(it_a.cur_tag)) > ((uint64_t)(it_b.cur_tag));
+    }
+
+    inline friend bool
+    operator<=(const fht_iterator_t & it_a, const fht_iterator_t & it_b) {
+        return ((uint64_t)(it_a.cur_tag)) <= ((uint64_t)(it_b.cur_tag));
+    }
+
+    inline friend bool
+    operator>=(const fht_iterator_t & it_a, const fht_iterator_t & it_b) {
+        return ((uint64_t)(it_a.cur_tag)) >= ((uint64_t)(it_b.cur_tag));
+    }
+};
+
+// pairs in chunks [begin_chunk, end_chunk) of a table (see
+// fht_table::chunk_range). begin() / end() iterate like the table does so
+// ranges that split up a table cover each pair once. for_each() goes through
+// each chunk's occupancy mask instead of tag by tag
+template<typename K,
+         typename V,
+         uint32_t Slots = fht_chunk_slots<K, V>::value>
+struct fht_chunk_range {
+    typedef fht_iterator_t<K, V, Slots> fht_iterator;
+    typedef fht_tag_t<K, V>             tag_t;
+
+    const fht_chunk<K, V, Slots> * chunks;
+    uint32_t                       begin_chunk;
+    uint32_t                       end_chunk;
+
+    // first chunk past the table (where its iterators stop)
+    const fht_chunk<K, V, Slots> * chunks_end;
+
+    inline fht_iterator
+    begin() const {
+        return fht_iterator((const tag_t *)(this->chunks + this->begin_chunk),
+                            (const uint64_t)this->chunks_end);
+    }
+
+    inline fht_iterator
+    end() const {
+        return fht_iterator((const tag_t *)(this->chunks + this->end_chunk),
+                            (const uint64_t)this->chunks_end);
+    }
+
+    // fn(key, val) for every pair in the range
+    template<typename Fn>
+    void
+    for_each(Fn fn) const {
+        fht_isa_dispatch([&](auto isa) { this->_for_each(fn, isa); });
+    }
+
+    template<typename Fn, typename Isa>
+    void
+    _for_each(Fn & fn, const Isa isa) const {
+        for (uint32_t i = this->begin_chunk; i < this->end_chunk; ++i) {
+            const fht_chunk<K, V, Slots> * const chunk = this->chunks + i;
+
+            typename fht_chunk<K, V, Slots>::mask_t full =
+                chunk->get_full_all(isa);
+            while (full) {
+                const uint32_t j =
+                    (const uint32_t)chunk->first_slot(full, isa);
+                fn(*(chunk->get_key_n_ptr(j)), *(chunk->get_val_n_ptr(j)));
+                full &= full - 1;
+            }
+        }
+    }
+};
+
+//////////////////////////////////////////////////////////////////////
+// Table class
+template<typename K,
+         typename V,
+         typename Hasher    = fht_default_hash<K, V>,
+         typename Allocator = DEFAULT_ALLOC<K, V>,
+         uint32_t Slots     = fht_chunk_slots<K, V>::value>
+struct fht_table {
+
+
+    // log of table size
+    uint32_t log_incr;
+    uint32_t npairs;
+
+    // npairs at which table will grow / shrink. Incremental growth starts at
+    // grow_npairs so the new array is ready before max_npairs
+    uint64_t          max_npairs;
+    uint64_t          grow_npairs;
+    uint64_t          min_npairs;
+
+    // tombstones in the table and how many before they get purged
+    uint64_t          nerased;
+    uint64_t          max_nerased;
+    fht_growth_policy growth;
+
+    // chunk array
+    fht_chunk<K, V, Slots> * chunks;
+
+    // incremental growth. While next_chunks is set its tags are being reset
+    // (everything still uses chunks). Then it becomes chunks and old chunks
+    // below resize_idx have been moved into it
+    fht_chunk<K, V, Slots> * next_chunks;
+    fht_chunk<K, V, Slots> * migrating_chunks;
+    uint32_t          migrating_log_incr;
+    uint32_t          resize_idx;
+
+    // helper classes. Allocator is rebound to chunks of Slots slots
+    typedef typename fht_alloc_slots<Allocator, Slots>::type allocator_t;
+    Hasher                                                   hash;
+    allocator_t                                              alloc_mmap;
+
+    //////////////////////////////////////////////////////////////////////
+    template<typename _K = K, typename _Hasher = Hasher>
+    using _hash_type_t = typename std::result_of<_Hasher(K)>::type;
+    typedef _hash_type_t<K, Hasher> hash_type_t;
+
+    using key_pass_t = typename fht_chunk<K, V, Slots>::key_pass_t;
+    using val_pass_t = typename fht_chunk<K, V, Slots>::val_pass_t;
+
+    // tags keep content_bits of the hash and the chunk idx comes from the
+    // bits above them so 16 bit tags need all 64 bits of the hash (see
+    // fht_full_hash)
+    typedef fht_tag_t<K, V> tag_t;
+    static_assert(!fht_wide_tags<K, V>::value || fht_full_hash<Hasher>::value,
+                  "fht_wide_tags needs a hasher that fills 64 bits");
+
+    // slot masks of a whole chunk
+    typedef typename fht_chunk<K, V, Slots>::mask_t mask_t;
+
+
+    typedef fht_iterator_t<K, V, Slots> fht_iterator;
+    //////////////////////////////////////////////////////////////////////
+    fht_table(const uint64_t init_size) {
+
+        // ensure init_size is above min
+        const uint64_t _init_size = init_size > FHT_MIN_SIZE
+                                        ? roundup_next_p2(init_size)
+                                        : FHT_MIN_SIZE;
+
+        const uint32_t _log_init_size = (const uint32_t)log_b2(_init_size);
+        //    int *  test = Allocator::new (NULL) int;
+
+        // alloc chunks
+        this->chunks =
+            this->alloc_mmap.allocate((_init_size / FHT_CHUNK_SLOTS));
+
+        fht_isa_dispatch([&](auto isa) {
+            for (uint32_t i = 0; i < (_init_size / FHT_CHUNK_SLOTS); ++i) {
+                this->chunks[i].reset_tags(isa);
+            }
+        });
+        this->log_incr           = _log_init_size;
+        this->npairs             = 0;
+        this->nerased            = 0;
+        this->growth             = FHT_DEFAULT_GROWTH_POLICY;
+        this->next_chunks        = NULL;
+        this->migrating_chunks   = NULL;
+        this->migrating_log_incr = 0;
+        this->resize_idx         = 0;
+        this->set_max_npairs();
+    }
+    fht_table() : fht_table(FHT_DEFAULT_INIT_SIZE) {}
+
+
+    ~fht_table() {
+        this->_drop_resize();
+        this->alloc_mmap.deallocate(
+            this->chunks,
+            (((1UL) << (this->log_incr)) / FHT_CHUNK_SLOTS));
+    }
+
+
+    //////////////////////////////////////////////////////////////////////
+    // very basic info
+    inline constexpr bool
+    empty() const {
+        return !(this->npairs);
+    }
+    inline constexpr uint64_t
+    size() const {
+        return this->npairs;
+    }
+    inline constexpr uint64_t
+    max_size() const {
+        return (1UL) << this->log_incr;
+    }
+
+    inline constexpr double
+    load_factor() const {
+        return ((double)this->size()) / ((double)this->max_size());
+    }
+
+    inline constexpr double
+    max_load_factor() const {
+        return (((1UL) << this->log_incr) >= this->growth.huge_size)
+                   ? this->growth.huge_max_load
+                   : this->growth.max_load;
+    }
+
+    // will grow right away if table is already past new max load factor
+    void
+    max_load_factor(const double new_max_load) {
+        fht_growth_policy new_growth = this->growth;
+        new_growth.max_load          = new_max_load;
+        this->growth_policy(new_growth);
+    }
+
+    inline constexpr const fht_growth_policy &
+    growth_policy() const {
+        return this->growth;
+    }
+
+    void
+    growth_policy(const fht_growth_policy & new_growth) {
+        // past ~.97 overflow chains get long and at 1.0 there is nowhere to
+        // put nodes that overflow during rehash
+        assert(new_growth.max_load > 0.0 && new_growth.max_load < 1.0);
+        assert(new_growth.huge_max_load > 0.0 &&
+               new_growth.huge_max_load < 1.0);
+        assert(new_growth.min_load >= 0.0 &&
+               2.0 * new_growth.min_load < new_growth.max_load &&
+               2.0 * new_growth.min_load < new_growth.huge_max_load);
+        assert(new_growth.max_erased >= 0.0 && new_growth.max_erased < 1.0);
+
+        this->_finish_resize();
+        this->growth = new_growth;
+        this->set_max_npairs();
+        this->reserve(this->npairs);
+    }
+
+    // number of pairs a table of size 2 ^ tbl_log can hold before growing
+    inline constexpr uint64_t
+    max_npairs_at(const uint32_t tbl_log) const {
+        return (uint64_t)(((((1UL) << tbl_log) >= this->growth.huge_size)
+                               ? this->growth.huge_max_load
+                               : this->growth.max_load) *
+                          ((1UL) << tbl_log));
+    }
+
+    // only runs when the table changes size / policy. Kept out of line as
+    // every resize path calls it
+    void __attribute__((noinline))
+    set_max_npairs() {
+        this->max_npairs  = this->max_npairs_at(this->log_incr);
+        this->grow_npairs = this->max_npairs;
+
+        // start early enough that all tags of the new array are reset by the
+        // time max_npairs is reached (every add steps the resize)
+        if (this->_incremental() && !this->_resizing()) {
+            const uint64_t slack =
+                FHT_NUM_CHUNKS(this->log_incr + 1) /
+                    (FHT_RESET_CHUNKS_PER_MIGRATE *
+                     this->growth.migrate_chunks) +
+                1;
+            this->grow_npairs =
+                (this->max_npairs > slack) ? this->max_npairs - slack : 0;
+        }
+
+        // never shrink below the smallest table (or in the middle of growing)
+        this->min_npairs =
+            (this->max_size() > FHT_MIN_SIZE && !this->_resizing())
+                ? (uint64_t)(this->growth.min_load * (double)this->max_size())
+                : 0;
+
+        this->max_nerased =
+            (this->growth.max_erased > 0.0)
+                ? (uint64_t)(this->growth.max_erased *
+                             (double)this->max_size())
+                : (~(0UL));
+    }
+    //////////////////////////////////////////////////////////////////////
+
+    //////////////////////////////////////////////////////////////////////
+    // rehashing
+    void
+    rehash() {
+        fht_isa_dispatch([&](auto isa) { this->_rehash(isa); });
+    }
+
+    template<typename Isa,
+             typename _K         = K,
+             typename _V         = V,
+             typename _Hasher    = Hasher,
+             typename _Allocator = allocator_t>
+    typename std::enable_if<
+        std::is_same<_Allocator, INPLACE_MMAP_ALLOC<_K, _V, Slots>>::value,
+        void>::type
+    _rehash(const Isa isa) {
+
+        // incr table log
+        const uint32_t                 _new_log_incr = ++(this->log_incr);
+        fht_chunk<K, V, Slots> * const old_chunks    = this->chunks;
+
+
+        const uint32_t _num_chunks =
+            ((1u) << (_new_log_incr - 1)) / FHT_CHUNK_SLOTS;
+
+
+        // allocate new chunk array
+        fht_chunk<K, V, Slots> * const new_chunks =
+            this->alloc_mmap.allocate(_num_chunks);
+
+
+        // nodes that had overflowed from another chunk (per thread). These
+        // get placed after all chunks have been split
+        const uint32_t nthreads = this->_rehash_threads(_num_chunks);
+        std::vector<std::vector<std::pair<hash_type_t, fht_node<K, V>>>>
+            overflowed(nthreads);
+
+        this->_for_chunk_ranges(
+            _num_chunks,
+            nthreads,
+            isa,
+            [&](const uint32_t t,
+                const uint32_t begin,
+                const uint32_t end,
+                auto           _isa) {
+                this->_split_chunks_inplace(old_chunks,
+                                            new_chunks,
+                                            _new_log_incr,
+                                            begin,
+                                            end,
+                                            overflowed[t],
+                                            _isa);
+            });
+
+        this->nerased = 0;
+        this->set_max_npairs();
+
+        for (uint32_t t = 0; t < nthreads; ++t) {
+            this->_place_nodes(overflowed[t], isa);
+        }
+    }
+
+    // inplace rehash of chunks [begin, end). Nodes move to new chunk i or to
+    // another line of chunk i so ranges can be split in parallel
+    template<typename Isa>
+    void
+    _split_chunks_inplace(fht_chunk<K, V, Slots> * const old_chunks,
+                          fht_chunk<K, V, Slots> * const new_chunks,
+                          const uint32_t          _new_log_incr,
+                          const uint32_t          begin,
+                          const uint32_t          end,
+                          std::vector<std::pair<hash_type_t, fht_node<K, V>>> &
+                              overflowed,
+                          const Isa isa) const {
+        // per line counts are a byte each
+        uint32_t to_move = 0;
+        uint64_t new_starts;
+        uint64_t old_start_good_slots;
+        // iterate through all chunks and re-place nodes
+        for (uint32_t i = begin; i < end; ++i) {
+            new_starts           = 0;
+            old_start_good_slots = 0;
+
+            uint32_t old_start_pos[FHT_CHUNK_LINES]     = { 0 };
+            mask_t   old_start_to_move[FHT_CHUNK_LINES] = { 0 };
+
+
+            fht_chunk<K, V, Slots> * const old_chunk = old_chunks + i;
+            fht_chunk<K, V, Slots> * const new_chunk = new_chunks + i;
+
+            // turn all deleted tags -> INVALID (reset basically)
+            old_chunk->clear_erased_tags(isa);
+
+            uint64_t j_idx;
+            mask_t   iter_mask = old_chunk->get_full_all(isa);
+
+            while (iter_mask) {
+                j_idx = old_chunk->first_slot(iter_mask, isa);
+                iter_mask ^= (((mask_t)1) << j_idx);
+
+
+                // if node is invalid or deleted skip it. Can't just bvec iter
+                // here because need to reset to invalid
+
+                const hash_type_t raw_slot =
+                    this->_node_hash(old_chunk, (const uint32_t)j_idx);
+                const uint32_t start_idx = FHT_GEN_START_IDX(raw_slot);
+
+                // not in its home chunk, take it out so that it doesnt take up
+                // a slot during the split
+                if (__builtin_expect(
+                        FHT_HASH_TO_IDX(raw_slot, _new_log_incr - 1) != i,
+                        0)) {
+                    overflowed.push_back(
+                        std::pair<hash_type_t, fht_node<K, V>>(
+                            raw_slot,
+                            fht_node<K, V>{
+                                std::move(*(old_chunk->get_key_n_ptr(
+                                    (const uint32_t)j_idx))),
+                                std::move(*(old_chunk->get_val_n_ptr(
+                                    (const uint32_t)j_idx))) }));
+                    old_chunk->invalidate_tag_n((const uint32_t)j_idx);
+                    continue;
+                }
+
+                if (FHT_GET_NTH_BIT(raw_slot, _new_log_incr - 1)) {
+                    const tag_t tag =
+                        old_chunk->get_tag_n((const uint32_t)j_idx);
+                    old_chunk->invalidate_tag_n((const uint32_t)j_idx);
+
+                    // place new node w.o duplicate check
+                    for (uint32_t new_j = 0; new_j < FHT_CHUNK_LINES; ++new_j) {
+                        const uint32_t outer_idx =
+                            (new_j + start_idx) & FHT_CHUNK_LINE_MASK;
+                        const uint32_t inner_idx =
+                            (new_starts >> (8 * outer_idx)) & 0xff;
+
+                        if (__builtin_expect(inner_idx != FHT_MM_IDX_MULT, 1)) {
+                            const uint32_t true_idx =
+                                FHT_MM_IDX_MULT * outer_idx + inner_idx;
+
+                            new_chunk->set_tag_n(true_idx, tag);
+                            new_chunk->set_hash_n(true_idx, raw_slot);
+                            NEW(K,
+                                *(new_chunk->get_key_n_ptr(true_idx)),
+                                std::move(*(old_chunk->get_key_n_ptr(
+                                    (const uint32_t)j_idx))));
+                            NEW(V,
+                                *(new_chunk->get_val_n_ptr(true_idx)),
+                                std::move(*(old_chunk->get_val_n_ptr(
+                                    (const uint32_t)j_idx))));
+
+
+                            new_starts += ((1UL) << (8 * outer_idx));
+                            break;
+                        }
+                    }
+                }
+                else {
+                    // unplaceable slots
+                    old_start_pos[j_idx / FHT_MM_IDX_MULT] |=
+                        ((1u) << (j_idx & FHT_MM_IDX_MASK));
+                    if ((j_idx / FHT_MM_IDX_MULT) !=
+                        (start_idx & FHT_CHUNK_LINE_MASK)) {
+                        old_start_to_move[start_idx & FHT_CHUNK_LINE_MASK] |=
+                            (((mask_t)1) << j_idx);
+                        to_move |= ((1u) << (start_idx & FHT_CHUNK_LINE_MASK));
+                    }
+                    else {
+                        old_start_good_slots +=
+                            ((1UL) << (8 * (start_idx & FHT_CHUNK_LINE_MASK)));
+                    }
+                }
+            }
+
+            for (uint32_t j = 0; j < FHT_CHUNK_LINES; ++j) {
+                const uint32_t inner_idx = (new_starts >> (8 * j)) & 0xff;
+                for (uint32_t _j = inner_idx; _j < FHT_MM_IDX_MULT; ++_j) {
+                    new_chunk->invalidate_tag_n(j * FHT_MM_IDX_MULT + _j);
+                }
+            }
+
+            uint64_t to_move_idx;
+            uint32_t to_place_idx;
+            while (to_move) {
+                uint32_t j;
+                __asm__("tzcnt %1, %0" : "=r"((j)) : "rm"((to_move)));
+                // has space and has items to move to it
+                while (old_start_pos[j] != 0xffff && old_start_to_move[j]) {
+
+                    to_move_idx =
+                        old_chunk->first_slot(old_start_to_move[j], isa);
+
+                    __asm__("tzcnt %1, %0"
+                            : "=r"((to_place_idx))
+                            : "rm"((~old_start_pos[j])));
+
+                    old_start_to_move[j] ^= (((mask_t)1) << to_move_idx);
+
+                    const uint32_t true_idx =
+                        FHT_MM_IDX_MULT * j + to_place_idx;
+
+                    old_chunk->set_tag_n(
+                        true_idx,
+                        old_chunk->get_tag_n((const uint32_t)to_move_idx));
+                    old_chunk->move_hash_n(true_idx,
+                                           (const uint32_t)to_move_idx);
+
+
+                    NEW(K,
+                        *(old_chunk->get_key_n_ptr(true_idx)),
+                        std::move(*(old_chunk->get_key_n_ptr(
+                            (const uint32_t)to_move_idx))));
+
+                    NEW(V,
+                        *(old_chunk->get_val_n_ptr(true_idx)),
+                        std::move(*(old_chunk->get_val_n_ptr(
+                            (const uint32_t)to_move_idx))));
+
+
+                    old_chunk->invalidate_tag_n((const uint32_t)to_move_idx);
+
+                    old_start_good_slots += ((1UL) << (8 * j));
+                    old_start_pos[j] |= ((1u) << to_place_idx);
+                    old_start_pos[to_move_idx / FHT_MM_IDX_MULT] ^=
+                        ((1u) << (to_move_idx & FHT_MM_IDX_MASK));
+                }
+                // j is full of items that belong but more entries wants to be
+                // in j
+                if (__builtin_expect(old_start_to_move[j] &&
+                                         ((old_start_good_slots >> (8 * j)) &
+                                          0xff) == FHT_MM_IDX_MULT,
+                                     0)) {
+
+                    // move the indexes that this need to be placed (i.e if
+                    // any of the nodes that needed to be moved to j (now
+                    // j + 1) are already in j + 1 we can remove them from
+                    // to_move list
+                    old_start_to_move[(j + 1) & FHT_CHUNK_LINE_MASK] |=
+                        (~(((mask_t)0xffff)
+                           << (FHT_MM_IDX_MULT *
+                               ((j + 1) & FHT_CHUNK_LINE_MASK)))) &
+                        old_start_to_move[j];
+
+
+                    const uint32_t new_mask = (const uint32_t)(
+                        (old_start_to_move[j] >>
+                         (FHT_MM_IDX_MULT * ((j + 1) & FHT_CHUNK_LINE_MASK))) &
+                        0xffff);
+
+                    old_start_pos[(j + 1) & FHT_CHUNK_LINE_MASK] |= new_mask;
+                    old_start_good_slots +=
+                        ((uint64_t)bitcount_32(new_mask))
+                        << (8 * ((j + 1) & FHT_CHUNK_LINE_MASK));
+
+                    // if j + 1 was done set it back
+                    if (old_start_to_move[(j + 1) & FHT_CHUNK_LINE_MASK]) {
+                        to_move |= ((1u) << ((j + 1) & FHT_CHUNK_LINE_MASK));
+                    }
+                    old_start_to_move[j] = 0;
+                    to_move ^= ((1u) << j);
+                }
+                else if (__builtin_expect(!old_start_to_move[j], 1)) {
+                    to_move ^= ((1u) << j);
+                }
+                // j is full but not only of nodes that belong there and the
+                // nodes wanting j sit in lines that can't free up for them
+                // (i.e two lines that each hold a node wanting the other).
+                // Nothing can move so take the nodes wanting j out and place
+                // them after the split like the ones that overflowed
+                else {
+                    mask_t to_evict = old_start_to_move[j];
+                    while (to_evict) {
+                        const uint32_t evict_idx = (const uint32_t)
+                            old_chunk->first_slot(to_evict, isa);
+                        to_evict ^= (((mask_t)1) << evict_idx);
+
+                        overflowed.push_back(
+                            std::pair<hash_type_t, fht_node<K, V>>(
+                                this->_node_hash(old_chunk, evict_idx),
+                                fht_node<K, V>{
+                                    std::move(*(
+                                        old_chunk->get_key_n_ptr(evict_idx))),
+                                    std::move(*(old_chunk->get_val_n_ptr(
+                                        evict_idx))) }));
+                        old_chunk->invalidate_tag_n(evict_idx);
+                        old_start_pos[evict_idx / FHT_MM_IDX_MULT] ^=
+                            ((1u) << (evict_idx & FHT_MM_IDX_MASK));
+                    }
+                    old_start_to_move[j] = 0;
+                    to_move ^= ((1u) << j);
+                }
+            }
+        }
+    }
+
+    // standard rehash which copies all elements
+    template<typename Isa,
+             typename _K         = K,
+             typename _V         = V,
+             typename _Hasher    = Hasher,
+             typename _Allocator = allocator_t>
+    typename std::enable_if<
+        !(std::is_same<_Allocator, INPLACE_MMAP_ALLOC<_K, _V, Slots>>::value),
+        void>::type
+    _rehash(const Isa isa) {
+        // finishing a resize in progress is already growing one level
+        if (this->_resizing()) {
+            this->_finish_resize(isa);
+            return;
+        }
+
+        // incr table log
+        const uint32_t                 _new_log_incr = ++(this->log_incr);
+        fht_chunk<K, V, Slots> * const old_chunks    = this->chunks;
+
+
+        const uint32_t _num_chunks =
+            ((1u) << (_new_log_incr - 1)) / FHT_CHUNK_SLOTS;
+
+        // allocate new chunk array
+        fht_chunk<K, V, Slots> * const new_chunks =
+            this->alloc_mmap.allocate(2 * _num_chunks);
+
+        // set this while its definetly still in cache
+        this->chunks = new_chunks;
+
+        // nodes that had overflowed from another chunk (per thread). These
+        // get placed after all chunks have been split
+        const uint32_t nthreads = this->_rehash_threads(_num_chunks);
+        std::vector<std::vector<std::pair<hash_type_t, fht_node<K, V>>>>
+            overflowed(nthreads);
+
+        this->_for_chunk_ranges(
+            _num_chunks,
+            nthreads,
+            isa,
+            [&](const uint32_t t,
+                const uint32_t begin,
+                const uint32_t end,
+                auto) {
+                this->_split_chunks(old_chunks,
+                                    new_chunks,
+                                    _new_log_incr,
+                                    begin,
+                                    end,
+                                    overflowed[t]);
+            });
+
+        // deallocate old table
+        this->alloc_mmap.deallocate(
+            old_chunks,
+            (((1u) << (_new_log_incr - 1)) / FHT_CHUNK_SLOTS));
+
+        this->nerased = 0;
+        this->set_max_npairs();
+
+        for (uint32_t t = 0; t < nthreads; ++t) {
+            this->_place_nodes(overflowed[t], isa);
+        }
+    }
+
+    // standard rehash of old chunks [begin, end) into new chunks i and i |
+    // num_chunks. Touches no other chunks so ranges can be split in parallel
+    void
+    _split_chunks(fht_chunk<K, V, Slots> * const old_chunks,
+                  fht_chunk<K, V, Slots> * const new_chunks,
+                  const uint32_t          _new_log_incr,
+                  const uint32_t          begin,
+                  const uint32_t          end,
+                  std::vector<std::pair<hash_type_t, fht_node<K, V>>> &
+                      overflowed) const {
+        const uint32_t _num_chunks =
+            ((1u) << (_new_log_incr - 1)) / FHT_CHUNK_SLOTS;
+
+        for (uint32_t i = begin; i < end; ++i) {
+            uint8_t new_slot_idx[2][FHT_CHUNK_LINES] = { { 0 }, { 0 } };
+
+            fht_chunk<K, V, Slots> * const old_chunk = old_chunks + i;
+
+
+            // which one is optimal here really depends on the quality of the
+            // hash function.
+
+            for (uint32_t j_idx = 0; j_idx < FHT_CHUNK_SLOTS; j_idx++) {
+                if (old_chunk->resize_skip_n((const uint32_t)j_idx)) {
+                    continue;
+                }
+
+                const hash_type_t raw_slot =
+                    this->_node_hash(old_chunk, (const uint32_t)j_idx);
+
+                // not in its home chunk so cant go to i or i | _num_chunks
+                if (__builtin_expect(
+                        FHT_HASH_TO_IDX(raw_slot, _new_log_incr - 1) != i,
+                        0)) {
+                    overflowed.push_back(
+                        std::pair<hash_type_t, fht_node<K, V>>(
+                            raw_slot,
+                            fht_node<K, V>{
+                                std::move(*(old_chunk->get_key_n_ptr(
+                                    (const uint32_t)j_idx))),
+                                std::move(*(old_chunk->get_val_n_ptr(
+                                    (const uint32_t)j_idx))) }));
+                    continue;
+                }
+
+                const uint32_t start_idx = FHT_GEN_START_IDX(raw_slot);
+                const uint32_t nth_bit =
+                    FHT_GET_NTH_BIT(raw_slot, _new_log_incr - 1);
+
+                // 50 50 of hashing to same slot or slot + .5 * new table size
+                fht_chunk<K, V, Slots> * const new_chunk =
+                    new_chunks + (i | (nth_bit ? _num_chunks : 0));
+
+                // place new node w.o duplicate check
+                for (uint32_t new_j = 0; new_j < FHT_CHUNK_LINES; ++new_j) {
+                    const uint32_t outer_idx =
+                        (new_j + start_idx) & FHT_CHUNK_LINE_MASK;
+
+                    if (__builtin_expect(
+                            new_slot_idx[nth_bit][outer_idx] != FHT_MM_IDX_MULT,
+                            1)) {
+                        const uint32_t true_idx =
+                            FHT_MM_IDX_MULT * outer_idx +
+                            new_slot_idx[nth_bit][outer_idx];
+
+                        new_chunk->set_tag_n(
+                            true_idx,
+                            old_chunk->get_tag_n((const uint32_t)j_idx));
+                        new_chunk->set_hash_n(true_idx, raw_slot);
+                        NEW(K,
+                            *(new_chunk->get_key_n_ptr(true_idx)),
+                            std::move(*(old_chunk->get_key_n_ptr(
+                                (const uint32_t)j_idx))));
+                        NEW(V,
+                            *(new_chunk->get_val_n_ptr(true_idx)),
+                            std::move(*(old_chunk->get_val_n_ptr(
+                                (const uint32_t)j_idx))));
+
+                        new_slot_idx[nth_bit][outer_idx]++;
+                        break;
+                    }
+                }
+            }
+            // set remaining to INVALID_MASK
+            for (uint32_t j = 0; j < FHT_CHUNK_LINES; ++j) {
+                for (uint32_t _j = new_slot_idx[0][j]; _j < FHT_MM_IDX_MULT;
+                     ++_j) {
+                    new_chunks[i].invalidate_tag_n(FHT_MM_IDX_MULT * j + _j);
+                }
+            }
+            for (uint32_t j = 0; j < FHT_CHUNK_LINES; ++j) {
+                for (uint32_t _j = new_slot_idx[1][j]; _j < FHT_MM_IDX_MULT;
+                     ++_j) {
+                    new_chunks[i | _num_chunks].invalidate_tag_n(
+                        FHT_MM_IDX_MULT * j + _j);
+                }
+            }
+        }
+    }
+
+    // grow so that table has at least new_size slots. Unlike rehash() can go
+    // from any size to any larger size in one pass
+    void
+    rehash(const uint64_t new_size) {
+        fht_isa_dispatch([&](auto isa) { this->_rehash(new_size, isa); });
+    }
+
+    template<typename Isa>
+    void
+    _rehash(const uint64_t new_size, const Isa isa) {
+        this->_finish_resize(isa);
+        const uint32_t new_log_incr = (const uint32_t)log_b2(
+            new_size > FHT_MIN_SIZE ? roundup_next_p2(new_size) : FHT_MIN_SIZE);
+        if (new_log_incr <= this->log_incr) {
+            return;
+        }
+        else if (new_log_incr == this->log_incr + 1) {
+            this->_rehash(isa);
+        }
+        else {
+            this->_grow_to(new_log_incr, isa);
+        }
+    }
+
+    // grow so that n pairs fit without passing the max load factor (so adding
+    // n pairs will never rehash mid way through)
+    void
+    reserve(const uint64_t n) {
+        this->rehash((1UL) << this->_log_incr_for(n));
+    }
+
+    // shrink to the smallest table that fits current pairs. Invalidates
+    // iterators
+    void
+    shrink_to_fit() {
+        fht_isa_dispatch([&](auto isa) {
+            this->_finish_resize(isa);
+            const uint32_t new_log_incr = this->_log_incr_for(this->npairs);
+            if (new_log_incr < this->log_incr) {
+                this->_shrink_to(new_log_incr, isa);
+            }
+        });
+    }
+
+    // turns tombstones back into empty slots without resizing. A node can
+    // only be hidden by an earlier line in its probe sequence gaining an
+    // empty slot so in chunks that change (have tombstones or lose an
+    // overflowed node) nodes not in their first line get placed again. All
+    // overflowed nodes are placed last. Invalidates iterators
+    void
+    purge_tombstones() {
+        fht_isa_dispatch([&](auto isa) { this->_purge_tombstones(isa); });
+    }
+
+    template<typename Isa>
+    void
+    _purge_tombstones(const Isa isa) {
+        this->_finish_resize(isa);
+        const uint32_t _num_chunks = FHT_NUM_CHUNKS(this->log_incr);
+
+        std::vector<std::pair<hash_type_t, fht_node<K, V>>> overflowed;
+        std::vector<std::pair<hash_type_t, fht_node<K, V>>> to_place;
+
+        hash_type_t raw_slots[FHT_CHUNK_SLOTS];
+        for (uint32_t i = 0; i < _num_chunks; ++i) {
+            fht_chunk<K, V, Slots> * const chunk = this->chunks + i;
+
+            uint64_t has_erased = 0;
+            mask_t   not_home   = 0;
+            for (uint32_t j_idx = 0; j_idx < FHT_CHUNK_SLOTS; j_idx++) {
+                if (chunk->resize_skip_n(j_idx)) {
+                    has_erased |= chunk->is_erased_n(j_idx);
+                    continue;
+                }
+                raw_slots[j_idx] = this->_node_hash(chunk, j_idx);
+                if (FHT_HASH_TO_IDX(raw_slots[j_idx], this->log_incr) != i) {
+                    not_home |= (((mask_t)1) << j_idx);
+                }
+            }
+            if (!(has_erased || not_home)) {
+                continue;
+            }
+
+            to_place.clear();
+            for (uint32_t j_idx = 0; j_idx < FHT_CHUNK_SLOTS; j_idx++) {
+                if (chunk->resize_skip_n(j_idx)) {
+                    chunk->invalidate_tag_n(j_idx);
+                    continue;
+                }
+                const uint32_t start_line =
+                    FHT_GEN_START_IDX(raw_slots[j_idx]) & FHT_CHUNK_LINE_MASK;
+                const uint32_t is_not_home =
+                    (const uint32_t)((not_home >> j_idx) & 0x1);
+
+                // nothing can hide a node in its first line
+                if ((!is_not_home) && (j_idx / FHT_MM_IDX_MULT) == start_line) {
+                    continue;
+                }
+                (is_not_home ? overflowed : to_place)
+                    .push_back(std::pair<hash_type_t, fht_node<K, V>>(
+                        raw_slots[j_idx],
+                        fht_node<K, V>{
+                            std::move(*(chunk->get_key_n_ptr(j_idx))),
+                            std::move(*(chunk->get_val_n_ptr(j_idx))) }));
+                chunk->invalidate_tag_n(j_idx);
+            }
+
+            // all came from this chunk so they stay in it
+            this->_place_nodes(to_place, isa);
+        }
+
+        this->nerased = 0;
+        this->_place_nodes(overflowed, isa);
+    }
+
+    // smallest table log that can hold n pairs under the max load factor
+    uint32_t
+    _log_incr_for(const uint64_t n) const {
+        uint32_t new_log_incr = (const uint32_t)log_b2(FHT_MIN_SIZE);
+        while (this->max_npairs_at(new_log_incr) < n) {
+            ++new_log_incr;
+        }
+        return new_log_incr;
+    }
+
+    // multi level version of the standard rehash. Old chunk i gets split
+    // into all new chunks i + k * old_num_chunks
+    template<typename Isa,
+             typename _K         = K,
+             typename _V         = V,
+             typename _Hasher    = Hasher,
+             typename _Allocator = allocator_t>
+    typename std::enable_if<
+        !(std::is_same<_Allocator, INPLACE_MMAP_ALLOC<_K, _V, Slots>>::value),
+        void>::type
+    _grow_to(const uint32_t new_log_incr, const Isa isa) {
+        const uint32_t                 old_log_incr = this->log_incr;
+        fht_chunk<K, V, Slots> * const old_chunks   = this->chunks;
+
+        const uint32_t _old_num_chunks = FHT_NUM_CHUNKS(old_log_incr);
+        const uint32_t _new_num_chunks = FHT_NUM_CHUNKS(new_log_incr);
+
+        fht_chunk<K, V, Slots> * const new_chunks =
+            this->alloc_mmap.allocate(_new_num_chunks);
+
+        this->chunks   = new_chunks;
+        this->log_incr = new_log_incr;
+
+        const uint32_t nthreads = this->_rehash_threads(_old_num_chunks);
+        std::vector<std::vector<std::pair<hash_type_t, fht_node<K, V>>>>
+            overflowed(nthreads);
+
+        this->_for_chunk_ranges(
+            _old_num_chunks,
+            nthreads,
+            isa,
+            [&](const uint32_t t,
+                const uint32_t begin,
+                const uint32_t end,
+                auto           _isa) {
+                this->_grow_chunks(old_chunks,
+                                   new_chunks,
+                                   old_log_incr,
+                                   begin,
+                                   end,
+                                   overflowed[t],
+                                   _isa);
+            });
+
+        this->alloc_mmap.deallocate(old_chunks, _old_num_chunks);
+
+        this->nerased = 0;
+        this->set_max_npairs();
+        for (uint32_t t = 0; t < nthreads; ++t) {
+            this->_place_nodes(overflowed[t], isa);
+        }
+    }
+
+    // multi level version of inplace rehash. New chunks are allocated right
+    // after the old ones so nodes that move go straight to their new chunk
+    // and the ones that stay in chunk i get placed again (some lines may now
+    // have empty slots which would hide them otherwise)
+    template<typename Isa,
+             typename _K         = K,
+             typename _V         = V,
+             typename _Hasher    = Hasher,
+             typename _Allocator = allocator_t>
+    typename std::enable_if<
+        std::is_same<_Allocator, INPLACE_MMAP_ALLOC<_K, _V, Slots>>::value,
+        void>::type
+    _grow_to(const uint32_t new_log_incr, const Isa isa) {
+        const uint32_t old_log_incr = this->log_incr;
+
+        const uint32_t _old_num_chunks = FHT_NUM_CHUNKS(old_log_incr);
+        const uint32_t _new_num_chunks = FHT_NUM_CHUNKS(new_log_incr);
+
+        fht_chunk<K, V, Slots> * const new_chunks =
+            this->alloc_mmap.allocate(_new_num_chunks - _old_num_chunks);
+
+        this->log_incr = new_log_incr;
+
+        const uint32_t nthreads = this->_rehash_threads(_old_num_chunks);
+        std::vector<std::vector<std::pair<hash_type_t, fht_node<K, V>>>>
+            overflowed(nthreads);
+
+        this->_for_chunk_ranges(
+            _old_num_chunks,
+            nthreads,
+            isa,
+            [&](const uint32_t t,
+                const uint32_t begin,
+                const uint32_t end,
+                auto           _isa) {
+                this->_grow_chunks_inplace(new_chunks,
+                                           old_log_incr,
+                                           begin,
+                                           end,
+                                           overflowed[t],
+                                           _isa);
+            });
+
+        this->nerased = 0;
+        this->set_max_npairs();
+        for (uint32_t t = 0; t < nthreads; ++t) {
+            this->_place_nodes(overflowed[t], isa);
+        }
+    }
+
+    // multi level rehash of old chunks [begin, end) into new chunks i + k *
+    // old_num_chunks. Touches no other chunks so ranges can be split in
+    // parallel
+    template<typename Isa>
+    void
+    _grow_chunks(fht_chunk<K, V, Slots> * const old_chunks,
+                 fht_chunk<K, V, Slots> * const new_chunks,
+                 const uint32_t          old_log_incr,
+                 const uint32_t          begin,
+                 const uint32_t          end,
+                 std::vector<std::pair<hash_type_t, fht_node<K, V>>> &
+                     overflowed,
+                 const Isa isa) {
+        const uint32_t _old_num_chunks = FHT_NUM_CHUNKS(old_log_incr);
+        const uint32_t _new_num_chunks = FHT_NUM_CHUNKS(this->log_incr);
+
+        for (uint32_t i = begin; i < end; ++i) {
+            // new chunks i + k * old_num_chunks only get nodes from old
+            // chunk i so reset them here too
+            for (uint32_t k = i; k < _new_num_chunks; k += _old_num_chunks) {
+                new_chunks[k].reset_tags(isa);
+            }
+
+            fht_chunk<K, V, Slots> * const old_chunk = old_chunks + i;
+            for (uint32_t j_idx = 0; j_idx < FHT_CHUNK_SLOTS; j_idx++) {
+                if (old_chunk->resize_skip_n(j_idx)) {
+                    continue;
+                }
+                const hash_type_t raw_slot =
+                    this->_node_hash(old_chunk, j_idx);
+
+                K * const old_key = old_chunk->get_key_n_ptr(j_idx);
+                V * const old_val = old_chunk->get_val_n_ptr(j_idx);
+                if (__builtin_expect(
+                        FHT_HASH_TO_IDX(raw_slot, old_log_incr) != i,
+                        0)) {
+                    overflowed.push_back(
+                        std::pair<hash_type_t, fht_node<K, V>>(
+                            raw_slot,
+                            fht_node<K, V>{ std::move(*old_key),
+                                            std::move(*old_val) }));
+                    continue;
+                }
+
+                // everything in the new chunk came from old chunk i so there
+                // is always room in the home chunk
+                this->_place_node(raw_slot, *old_key, *old_val, isa);
+            }
+        }
+    }
+
+    // multi level inplace rehash of chunks [begin, end). Nodes move to new
+    // chunks i + k * old_num_chunks or back into chunk i so ranges can be
+    // split in parallel
+    template<typename Isa>
+    void
+    _grow_chunks_inplace(fht_chunk<K, V, Slots> * const new_chunks,
+                         const uint32_t          old_log_incr,
+                         const uint32_t          begin,
+                         const uint32_t          end,
+                         std::vector<std::pair<hash_type_t, fht_node<K, V>>> &
+                             overflowed,
+                         const Isa isa) {
+        const uint32_t new_log_incr    = this->log_incr;
+        const uint32_t _old_num_chunks = FHT_NUM_CHUNKS(old_log_incr);
+        const uint32_t _new_num_chunks = FHT_NUM_CHUNKS(new_log_incr);
+
+        std::vector<std::pair<hash_type_t, fht_node<K, V>>> staying;
+        for (uint32_t i = begin; i < end; ++i) {
+            // new chunks i + k * old_num_chunks only get nodes from old
+            // chunk i so reset them here too
+            for (uint32_t k = i + _old_num_chunks; k < _new_num_chunks;
+                 k += _old_num_chunks) {
+                new_chunks[k - _old_num_chunks].reset_tags(isa);
+            }
+
+            fht_chunk<K, V, Slots> * const old_chunk = this->chunks + i;
+            staying.clear();
+            for (uint32_t j_idx = 0; j_idx < FHT_CHUNK_SLOTS; j_idx++) {
+                if (old_chunk->resize_skip_n(j_idx)) {
+                    continue;
+                }
+                const hash_type_t raw_slot =
+                    this->_node_hash(old_chunk, j_idx);
+
+                K * const old_key = old_chunk->get_key_n_ptr(j_idx);
+                V * const old_val = old_chunk->get_val_n_ptr(j_idx);
+                if (__builtin_expect(
+                        FHT_HASH_TO_IDX(raw_slot, old_log_incr) != i,
+                        0)) {
+                    overflowed.push_back(
+                        std::pair<hash_type_t, fht_node<K, V>>(
+                            raw_slot,
+                            fht_node<K, V>{ std::move(*old_key),
+                                            std::move(*old_val) }));
+                }
+                else if (FHT_HASH_TO_IDX(raw_slot, new_log_incr) == i) {
+                    staying.push_back(std::pair<hash_type_t, fht_node<K, V>>(
+                        raw_slot,
+                        fht_node<K, V>{ std::move(*old_key),
+                                        std::move(*old_val) }));
+                }
+                else {
+                    // new chunk only has nodes from old chunk i so always room
+                    this->_place_node(raw_slot, *old_key, *old_val, isa);
+                }
+            }
+
+            old_chunk->reset_tags(isa);
+            this->_place_nodes(staying, isa);
+        }
+    }
+
+    // reverse of _grow_to. New chunk i is merged from old chunks i + k *
+    // new_num_chunks (so for one level i and i | half like undoing the split
+    // in rehash()). Caller makes sure all pairs fit under the max load factor
+    template<typename Isa,
+             typename _K         = K,
+             typename _V         = V,
+             typename _Hasher    = Hasher,
+             typename _Allocator = allocator_t>
+    typename std::enable_if<
+        !(std::is_same<_Allocator, INPLACE_MMAP_ALLOC<_K, _V, Slots>>::value),
+        void>::type
+    _shrink_to(const uint32_t new_log_incr, const Isa isa) {
+        const uint32_t                 old_log_incr = this->log_incr;
+        fht_chunk<K, V, Slots> * const old_chunks   = this->chunks;
+
+        const uint32_t _old_num_chunks = FHT_NUM_CHUNKS(old_log_incr);
+        const uint32_t _new_num_chunks = FHT_NUM_CHUNKS(new_log_incr);
+
+        fht_chunk<K, V, Slots> * const new_chunks =
+            this->alloc_mmap.allocate(_new_num_chunks);
+        for (uint32_t i = 0; i < _new_num_chunks; ++i) {
+            new_chunks[i].reset_tags(isa);
+        }
+
+        this->chunks   = new_chunks;
+        this->log_incr = new_log_incr;
+
+        std::vector<std::pair<hash_type_t, fht_node<K, V>>> overflowed;
+
+        for (uint32_t i = 0; i < _new_num_chunks; ++i) {
+            uint32_t nplaced = 0;
+            for (uint32_t k = i; k < _old_num_chunks; k += _new_num_chunks) {
+                this->_merge_chunk(old_chunks + k,
+                                   k,
+                                   old_log_incr,
+                                   nplaced,
+                                   overflowed,
+                                   isa);
+            }
+        }
+
+        this->alloc_mmap.deallocate(old_chunks, _old_num_chunks);
+
+        this->nerased = 0;
+        this->set_max_npairs();
+        this->_place_nodes(overflowed, isa);
+    }
+
+    // inplace version keeps the first new_num_chunks chunks and gives the
+    // rest back to the allocator
+    template<typename Isa,
+             typename _K         = K,
+             typename _V         = V,
+             typename _Hasher    = Hasher,
+             typename _Allocator = allocator_t>
+    typename std::enable_if<
+        std::is_same<_Allocator, INPLACE_MMAP_ALLOC<_K, _V, Slots>>::value,
+        void>::type
+    _shrink_to(const uint32_t new_log_incr, const Isa isa) {
+        const uint32_t old_log_incr = this->log_incr;
+
+        const uint32_t _old_num_chunks = FHT_NUM_CHUNKS(old_log_incr);
+        const uint32_t _new_num_chunks = FHT_NUM_CHUNKS(new_log_incr);
+
+        this->log_incr = new_log_incr;
+
+        std::vector<std::pair<hash_type_t, fht_node<K, V>>> overflowed;
+        std::vector<std::pair<hash_type_t, fht_node<K, V>>> staying;
+
+        for (uint32_t i = 0; i < _new_num_chunks; ++i) {
+            fht_chunk<K, V, Slots> * const chunk = this->chunks + i;
+
+            // take out everything already in chunk i and place it again so
+            // there are no tombstones / half empty lines in the merged chunk
+            staying.clear();
+            for (uint32_t j_idx = 0; j_idx < FHT_CHUNK_SLOTS; j_idx++) {
+                if (chunk->resize_skip_n(j_idx)) {
+                    continue;
+                }
+                const hash_type_t raw_slot = this->_node_hash(chunk, j_idx);
+                std::vector<std::pair<hash_type_t, fht_node<K, V>>> & dst =
+                    (FHT_HASH_TO_IDX(raw_slot, old_log_incr) != i)
+                        ? overflowed
+                        : staying;
+                dst.push_back(std::pair<hash_type_t, fht_node<K, V>>(
+                    raw_slot,
+                    fht_node<K, V>{
+                        std::move(*(chunk->get_key_n_ptr(j_idx))),
+                        std::move(*(chunk->get_val_n_ptr(j_idx))) }));
+            }
+            chunk->reset_tags(isa);
+            this->_place_nodes(staying, isa);
+
+            uint32_t nplaced = (const uint32_t)staying.size();
+            for (uint32_t k = i + _new_num_chunks; k < _old_num_chunks;
+                 k += _new_num_chunks) {
+                this->_merge_chunk(this->chunks + k,
+                                   k,
+                                   old_log_incr,
+                                   nplaced,
+                                   overflowed,
+                                   isa);
+            }
+        }
+
+        this->alloc_mmap.deallocate(this->chunks + _new_num_chunks,
+                                    _old_num_chunks - _new_num_chunks);
+
+        this->nerased = 0;
+        this->set_max_npairs();
+        this->_place_nodes(overflowed, isa);
+    }
+
+    // moves nodes of old chunk idx into its (already shrunk) home chunk.
+    // Nodes that weren't home in the old table or don't fit once the home
+    // chunk has a full cache line of nodes get placed after the merge
+    template<typename Isa>
+    void
+    _merge_chunk(
+        fht_chunk<K, V, Slots> * const                        old_chunk,
+        const uint32_t                                        idx,
+        const uint32_t                                        old_log_incr,
+        uint32_t &                                            nplaced,
+        std::vector<std::pair<hash_type_t, fht_node<K, V>>> & overflowed,
+        const Isa                                             isa) {
+        for (uint32_t j_idx = 0; j_idx < FHT_CHUNK_SLOTS; j_idx++) {
+            if (old_chunk->resize_skip_n(j_idx)) {
+                continue;
+            }
+            const hash_type_t raw_slot = this->_node_hash(old_chunk, j_idx);
+
+            K * const old_key = old_chunk->get_key_n_ptr(j_idx);
+            V * const old_val = old_chunk->get_val_n_ptr(j_idx);
+            if (__builtin_expect(
+                    FHT_HASH_TO_IDX(raw_slot, old_log_incr) != idx ||
+                        nplaced == FHT_CHUNK_SLOTS,
+                    0)) {
+                overflowed.push_back(std::pair<hash_type_t, fht_node<K, V>>(
+                    raw_slot,
+                    fht_node<K, V>{ std::move(*old_key),
+                                    std::move(*old_val) }));
+                continue;
+            }
+
+            // home chunk has room so _add_no_dup wont leave it
+            this->_place_node(raw_slot, *old_key, *old_val, isa);
+            ++nplaced;
+        }
+    }
+
+    // places nodes that were taken out during rehash (i.e because they werent
+    // in their home chunk). Done after split so they can overflow anywhere in
+    // the new table
+    template<typename Isa>
+    void
+    _place_nodes(std::vector<std::pair<hash_type_t, fht_node<K, V>>> & nodes,
+                 const Isa                                             isa) {
+        for (uint32_t i = 0; i < nodes.size(); ++i) {
+            this->_place_node(nodes[i].first,
+                              nodes[i].second.key,
+                              nodes[i].second.val,
+                              isa);
+        }
+    }
+
+    // move key / val into the first free slot in their probe sequence (no
+    // duplicate check)
+    template<typename Isa>
+    void
+    _place_node(const hash_type_t raw_slot, K & key, V & val, const Isa isa) {
+        const uint64_t tag_ptr =
+            (const uint64_t)this->_add_no_dup(raw_slot, isa);
+        fht_chunk<K, V, Slots> * const chunk =
+            (fht_chunk<K, V, Slots> * const)(tag_ptr & (~FHT_TAG_BYTES_MASK));
+        const uint32_t idx =
+            (const uint32_t)(FHT_TAG_PTR_TO_IDX(tag_ptr));
+
+        chunk->set_hash_n(idx, raw_slot);
+        NEW(K, *(chunk->get_key_n_ptr(idx)), std::move(key));
+        NEW(V, *(chunk->get_val_n_ptr(idx)), std::move(val));
+    }
+
+    // hash of node n in chunk. Stored one if K / V keep it (see
+    // fht_store_hash)
+    template<typename _K = K, typename _V = V>
+    inline typename std::enable_if<fht_store_hash<_K, _V>::value,
+                                   hash_type_t>::type
+    _node_hash(const fht_chunk<K, V, Slots> * const chunk,
+               const uint32_t                       n) const {
+        return (const hash_type_t)chunk->get_hash_n(n);
+    }
+
+    template<typename _K = K, typename _V = V>
+    inline typename std::enable_if<!fht_store_hash<_K, _V>::value,
+                                   hash_type_t>::type
+    _node_hash(const fht_chunk<K, V, Slots> * const chunk,
+               const uint32_t                       n) const {
+        return this->hash(chunk->get_key_n(n));
+    }
+
+    // threads a rehash of num_chunks old chunks is split across (see
+    // fht_growth_policy::rehash_threads)
+    inline uint32_t
+    _rehash_threads(const uint32_t num_chunks) const {
+        return fht_parallel_threads(num_chunks, this->growth.rehash_threads);
+    }
+
+    // calls fn(t, begin, end, isa) for nthreads ranges of [0, num_chunks), each
+    // on its own thread. Other threads get fn built for Isa the same way
+    // fht_isa_dispatch does it
+    template<typename Isa, typename Fn>
+    void
+    _for_chunk_ranges(const uint32_t num_chunks,
+                      const uint32_t nthreads,
+                      const Isa      isa,
+                      Fn             fn) const {
+        if (nthreads <= 1) {
+            fn(0, 0, num_chunks, isa);
+            return;
+        }
+        fht_parallel_ranges(
+            num_chunks,
+            nthreads,
+            [&](const uint32_t t, const uint64_t begin, const uint64_t end) {
+                fht_isa_run<Isa>::run_cold([&](auto _isa) {
+                    fn(t, (const uint32_t)begin, (const uint32_t)end, _isa);
+                });
+            });
+    }
+
+    //////////////////////////////////////////////////////////////////////
+    // incremental growth
+    inline constexpr bool
+    _incremental() const {
+        return this->growth.migrate_chunks &&
+               (!std::is_same<allocator_t,
+                              INPLACE_MMAP_ALLOC<K, V, Slots>>::value);
+    }
+
+    inline constexpr bool
+    _resizing() const {
+        return (((const uint64_t)this->next_chunks) |
+                ((const uint64_t)this->migrating_chunks)) != 0;
+    }
+
+    // called by add() at grow_npairs
+    template<typename Isa>
+    void
+    _grow(const Isa isa) {
+        if (this->_incremental() && !this->_resizing() &&
+            this->npairs < this->max_npairs) {
+            this->next_chunks = this->alloc_mmap.allocate(
+                FHT_NUM_CHUNKS(this->log_incr + 1));
+            this->resize_idx = 0;
+            this->set_max_npairs();
+        }
+        else {
+            this->_rehash(isa);
+        }
+    }
+
+    // bounded amount of work done by each add / erase while resizing
+    template<typename Isa>
+    void
+    _resize_step(const Isa isa) {
+        if (this->next_chunks != NULL) {
+            const uint32_t _new_num_chunks =
+                FHT_NUM_CHUNKS(this->log_incr + 1);
+            const uint64_t step_end =
+                this->resize_idx + FHT_RESET_CHUNKS_PER_MIGRATE *
+                                       (uint64_t)this->growth.migrate_chunks;
+            const uint32_t end = (const uint32_t)(
+                step_end < _new_num_chunks ? step_end : _new_num_chunks);
+            for (; this->resize_idx < end; ++this->resize_idx) {
+                this->next_chunks[this->resize_idx].reset_tags(isa);
+            }
+            if (this->resize_idx == _new_num_chunks) {
+                this->_start_migrate();
+            }
+        }
+        else {
+            const uint32_t _old_num_chunks =
+                FHT_NUM_CHUNKS(this->migrating_log_incr);
+            for (uint32_t i = 0; i < this->growth.migrate_chunks &&
+                                 this->resize_idx < _old_num_chunks;
+                 ++i) {
+                this->_migrate_chunk(this->resize_idx++, isa);
+            }
+            if (this->resize_idx == _old_num_chunks) {
+                this->_end_migrate();
+            }
+        }
+    }
+
+    // all new tags are reset, from here on adds go to the new array
+    void
+    _start_migrate() {
+        this->migrating_chunks   = this->chunks;
+        this->migrating_log_incr = this->log_incr;
+        this->chunks             = this->next_chunks;
+        this->next_chunks        = NULL;
+        this->log_incr           = this->log_incr + 1;
+        this->resize_idx         = 0;
+        this->set_max_npairs();
+    }
+
+    void
+    _end_migrate() {
+        this->alloc_mmap.deallocate(this->migrating_chunks,
+                                    FHT_NUM_CHUNKS(this->migrating_log_incr));
+        this->migrating_chunks = NULL;
+        this->set_max_npairs();
+    }
+
+    // old chunk idx is never probed again once its marked as migrated so its
+    // nodes can just be placed in the new array
+    template<typename Isa>
+    void
+    _migrate_chunk(const uint32_t idx, const Isa isa) {
+        fht_chunk<K, V, Slots> * const old_chunk = this->migrating_chunks + idx;
+        for (uint32_t j_idx = 0; j_idx < FHT_CHUNK_SLOTS; j_idx++) {
+            if (old_chunk->resize_skip_n(j_idx)) {
+                this->nerased -= old_chunk->is_erased_n(j_idx);
+                continue;
+            }
+            this->_place_node(this->_node_hash(old_chunk, j_idx),
+                              *(old_chunk->get_key_n_ptr(j_idx)),
+                              *(old_chunk->get_val_n_ptr(j_idx)),
+                              isa);
+        }
+    }
+
+    // for anything that needs the whole table in one array
+    void
+    _finish_resize() {
+        if (__builtin_expect(this->_resizing(), 0)) {
+            fht_isa_dispatch([&](auto isa) { this->_finish_resize(isa); });
+        }
+    }
+
+    template<typename Isa>
+    void
+    _finish_resize(const Isa isa) {
+        if (__builtin_expect(!this->_resizing(), 1)) {
+            return;
+        }
+        if (this->next_chunks != NULL) {
+            const uint32_t _new_num_chunks =
+                FHT_NUM_CHUNKS(this->log_incr + 1);
+            for (; this->resize_idx < _new_num_chunks; ++this->resize_idx) {
+                this->next_chunks[this->resize_idx].reset_tags(isa);
+            }
+            this->_start_migrate();
+        }
+        const uint32_t _old_num_chunks =
+            FHT_NUM_CHUNKS(this->migrating_log_incr);
+        while (this->resize_idx < _old_num_chunks) {
+            this->_migrate_chunk(this->resize_idx++, isa);
+        }
+        this->_end_migrate();
+    }
+
+    // throws away the array that isn't chunks (clear / destructor)
+    void
+    _drop_resize() {
+        if (this->next_chunks != NULL) {
+            this->alloc_mmap.deallocate(this->next_chunks,
+                                        FHT_NUM_CHUNKS(this->log_incr + 1));
+            this->next_chunks = NULL;
+        }
+        if (this->migrating_chunks != NULL) {
+            this->alloc_mmap.deallocate(
+                this->migrating_chunks,
+                FHT_NUM_CHUNKS(this->migrating_log_incr));
+            this->migrating_chunks = NULL;
+        }
+    }
+
+    // find in the array being migrated away from. Chunks below resize_idx
+    // have already been moved so they are skipped like full chunks
+    template<typename PK, typename Isa>
+    const tag_t *
+    _find_old(PK key, const hash_type_t raw_slot, const Isa isa) const {
+        const uint32_t chunk_mask = FHT_CHUNK_MASK(this->migrating_log_incr);
+        uint32_t       chunk_idx =
+            FHT_HASH_TO_IDX(raw_slot, this->migrating_log_incr);
+        const uint32_t start_idx = FHT_GEN_START_IDX(raw_slot);
+        const tag_t   tag       = FHT_GEN_TAG(raw_slot);
+
+        uint64_t idx;
+        for (uint32_t k = 0; k <= chunk_mask;) {
+            if (chunk_idx >= this->resize_idx) {
+                const fht_chunk<K, V, Slots> * const chunk =
+                    this->migrating_chunks + chunk_idx;
+                const mask_t empty_mask = chunk->get_empty_all(isa);
+                mask_t       slot_mask =
+                    chunk->get_tag_matches_all(tag, start_idx, isa);
+                while (slot_mask) {
+                    idx = chunk->first_slot(slot_mask, isa);
+                    if (idx >= chunk->empty_line_end(empty_mask,
+                                                     start_idx,
+                                                     isa)) {
+                        break;
+                    }
+                    const uint32_t true_idx = (const uint32_t)(
+                        (idx + FHT_MM_IDX_MULT * start_idx) &
+                        (FHT_CHUNK_SLOTS - 1));
+                    if (chunk->compare_hashed_key_n(true_idx, key, raw_slot)) {
+                        return ((const tag_t * const)chunk) + true_idx;
+                    }
+                    slot_mask &= slot_mask - 1;
+                }
+                if (empty_mask) {
+                    return NULL;
+                }
+            }
+            ++k;
+            chunk_idx = FHT_NEXT_CHUNK(chunk_idx, k, chunk_mask);
+        }
+        return NULL;
+    }
+
+    template<typename PK, typename Isa>
+    uint64_t
+    _erase_old(PK key, const hash_type_t raw_slot, const Isa isa) {
+        const uint64_t res =
+            (const uint64_t)this->template _find_old<PK>(key, raw_slot, isa);
+        if (res == 0) {
+            return FHT_NOT_ERASED;
+        }
+        fht_chunk<K, V, Slots> * const chunk =
+            (fht_chunk<K, V, Slots> * const)(res & (~FHT_TAG_BYTES_MASK));
+        const uint32_t idx = (const uint32_t)(FHT_TAG_PTR_TO_IDX(res));
+        if (chunk->get_empty(idx / FHT_MM_IDX_MULT, isa)) {
+            chunk->invalidate_tag_n(idx);
+        }
+        else {
+            chunk->erase_tag_n(idx);
+            ++this->nerased;
+        }
+        --this->npairs;
+        return FHT_ERASED;
+    }
+
+
+    //////////////////////////////////////////////////////////////////////
+    // add new key value pair stuff
+
+    // slightly different logic than emplace...
+    template<typename... Args>
+    inline std::pair<fht_iterator, bool>
+    insert_or_assign(key_pass_t new_key, Args &&... args) {
+        // slightly different logic than emplace...
+        const uint64_t                 res = (const uint64_t)add(new_key);
+        fht_chunk<K, V, Slots> * const temp_chunk =
+            (fht_chunk<K, V, Slots> * const)(
+                res & (~(((1UL) << 48) | FHT_TAG_BYTES_MASK)));
+
+        NEW(V,
+            *(temp_chunk->get_val_n_ptr(FHT_TAG_PTR_TO_IDX(res))),
+            std::forward<Args>(args)...);
+
+        return std::pair<fht_iterator, bool>(
+            fht_iterator((const tag_t * const)(res & (~((1UL) << 48)))),
+            (!(res & (((1UL) << 48)))));
+    }
+
+    template<typename... Args>
+    inline constexpr std::pair<fht_iterator, bool>
+    insert(key_pass_t new_key, Args &&... args) {
+        return emplace(new_key, std::forward<Args>(args)...);
+    }
+
+    //////////////////////////////////////////////////////////////////////
+    // Its probably a bad idea to use either of these inserts
+    inline constexpr std::pair<fht_iterator, bool>
+    insert(const std::pair<const K, V> & bad_pair) {
+        return insert(bad_pair.first, bad_pair.second);
+    }
+
+
+    inline void
+    insert(std::initializer_list<const std::pair<const K, V>> ilist) {
+
+        // supposedly this is a few assembly ops faster than:
+        // for(it = begin(); it != end(); ++it)
+        // but you really should never be using this.
+        for (auto p : ilist) {
+            emplace(p.first, p.second);
+        }
+    }
+    //////////////////////////////////////////////////////////////////////
+
+    // bulk insert of the pairs in [first, last) (random access). Like insert()
+    // keys already in the table keep their value. Grows once up front then
+    // adds keys ordered by home chunk so that each chunk gets filled while
+    // its lines are still in cache instead of every add() missing on some
+    // random chunk. Returns number of new keys
+    template<typename It>
+    uint64_t
+    insert_many(It first, It last) {
+        typedef typename std::iterator_traits<It>::difference_type diff_t;
+
+        const uint64_t n = (const uint64_t)(last - first);
+        this->reserve(this->npairs + n);
+
+        // (hash, index in batch) so that the sorted order carries the hash
+        // along with it
+        std::vector<std::pair<hash_type_t, uint64_t>> order, order_tmp;
+
+        uint64_t nadded = 0;
+        for (uint64_t start = 0; start < n; start += FHT_INSERT_BATCH) {
+            const uint64_t nbatch = (n - start) < FHT_INSERT_BATCH
+                                        ? (n - start)
+                                        : FHT_INSERT_BATCH;
+            const It batch_first = first + (const diff_t)start;
+
+            order.resize(nbatch);
+            order_tmp.resize(nbatch);
+            for (uint64_t i = 0; i < nbatch; ++i) {
+                order[i] = std::pair<hash_type_t, uint64_t>(
+                    this->hash(batch_first[(const diff_t)i].first),
+                    i);
+            }
+            this->_sort_by_chunk(order, order_tmp);
+
+            for (uint64_t i = 0; i < nbatch; ++i) {
+                if (i + FHT_INSERT_PREFETCH < nbatch) {
+                    const diff_t next =
+                        (const diff_t)order[i + FHT_INSERT_PREFETCH].second;
+                    __builtin_prefetch(&(batch_first[next]));
+                }
+                const diff_t   idx = (const diff_t)order[i].second;
+                const uint64_t res = (const uint64_t)this->add(
+                    batch_first[idx].first,
+                    order[i].first);
+                if (!(res & ((1UL) << 48))) {
+                    fht_chunk<K, V, Slots> * const temp_chunk =
+                        (fht_chunk<K, V, Slots> * const)(res &
+                                                  (~FHT_TAG_BYTES_MASK));
                     NEW(V,
-                        *(old_chunk->get_val_n_ptr(true_idx)),
-                        std::move(*(old_chunk->get_val_n_ptr(
-                            (const uint32_t)to_move_idx))));
+                        *(temp_chunk->get_val_n_ptr(
+                            FHT_TAG_PTR_TO_IDX(res))),
+                        batch_first[idx].second);
+                    ++nadded;
+                }
+            }
+        }
+        return nadded;
+    }
+
+    // insert_many() split across nthreads threads. Pairs are hashed and
+    // partitioned by home chunk in parallel, then each thread adds the ones
+    // whose home chunk is in its own range of chunks without any locking.
+    // Keys whose home chunk is full (so could be in / overflow into another
+    // thread's chunks) are added by this thread after. Hasher has to be
+    // callable from all of them at once. Returns number of new keys
+    template<typename It>
+    uint64_t
+    build_parallel(It first, It last, const uint32_t nthreads) {
+        typedef typename std::iterator_traits<It>::difference_type diff_t;
+
+        const uint64_t n = (const uint64_t)(last - first);
+        this->reserve(this->npairs + n);
+
+        const uint32_t _num_chunks = FHT_NUM_CHUNKS(this->log_incr);
+        const uint32_t nt = fht_parallel_threads(_num_chunks, nthreads);
+        if (nt <= 1) {
+            return this->insert_many(first, last);
+        }
+
+        // thread whose chunks the home chunk of hash is in (ranges are split
+        // the same way fht_parallel_ranges does)
+        auto owner = [&](const hash_type_t raw_slot) {
+            return (const uint32_t)(
+                ((FHT_HASH_TO_IDX(raw_slot, this->log_incr) + 1) * nt - 1) /
+                _num_chunks);
+        };
+
+        // hash and count per owner, then (hash, index) grouped by owner. Each
+        // input range's part of an owner's group is its own so the scatter
+        // doesn't need to synchronize either
+        std::vector<hash_type_t> hashes(n);
+        std::vector<uint64_t>    offsets(nt * nt, 0);
+        fht_parallel_ranges(
+            n,
+            nt,
+            [&](const uint32_t t, const uint64_t begin, const uint64_t end) {
+                for (uint64_t i = begin; i < end; ++i) {
+                    hashes[i] = this->hash(first[(const diff_t)i].first);
+                    ++offsets[nt * t + owner(hashes[i])];
+                }
+            });
+
+        std::vector<uint64_t> group_begin(nt + 1, 0);
+        uint64_t              sum = 0;
+        for (uint32_t o = 0; o < nt; ++o) {
+            group_begin[o] = sum;
+            for (uint32_t t = 0; t < nt; ++t) {
+                const uint64_t count = offsets[nt * t + o];
+                offsets[nt * t + o]  = sum;
+                sum += count;
+            }
+        }
+        group_begin[nt] = sum;
+
+        std::vector<std::pair<hash_type_t, uint64_t>> order(n);
+        fht_parallel_ranges(
+            n,
+            nt,
+            [&](const uint32_t t, const uint64_t begin, const uint64_t end) {
+                for (uint64_t i = begin; i < end; ++i) {
+                    order[offsets[nt * t + owner(hashes[i])]++] =
+                        std::pair<hash_type_t, uint64_t>(hashes[i], i);
+                }
+            });
+        std::vector<hash_type_t>().swap(hashes);
+
+        // per thread new keys / reused tombstones and keys left for after
+        std::vector<uint64_t>              nadded(nt, 0);
+        std::vector<uint64_t>              nreused(nt, 0);
+        std::vector<std::vector<uint64_t>> deferred(nt);
+        // one range of [0, nt) per thread so t is also the group
+        fht_isa_dispatch([&](auto isa) {
+            this->_for_chunk_ranges(
+                nt,
+                nt,
+                isa,
+                [&](const uint32_t t,
+                    const uint32_t,
+                    const uint32_t,
+                    auto _isa) {
+                    this->_build_group(first,
+                                       order,
+                                       group_begin[t],
+                                       group_begin[t + 1],
+                                       nadded[t],
+                                       nreused[t],
+                                       deferred[t],
+                                       _isa);
+                });
+        });
+
+        uint64_t total_added = 0;
+        for (uint32_t t = 0; t < nt; ++t) {
+            total_added += nadded[t];
+            this->npairs += (const uint32_t)nadded[t];
+            this->nerased -= nreused[t];
+        }
+        for (uint32_t t = 0; t < nt; ++t) {
+            for (uint64_t i = 0; i < deferred[t].size(); ++i) {
+                const diff_t idx = (const diff_t)deferred[t][i];
+                total_added += this->emplace(first[idx].first,
+                                             first[idx].second)
+                                   .second;
+            }
+        }
+        return total_added;
+    }
+
+    // adds order[begin, end) (all with home chunks in one thread's range)
+    // sorted by chunk in batches like insert_many(). Keys _add_home can't
+    // place go in deferred
+    template<typename It, typename Isa>
+    void
+    _build_group(It                                              first,
+                 std::vector<std::pair<hash_type_t, uint64_t>> & order,
+                 const uint64_t                                  begin,
+                 const uint64_t                                  end,
+                 uint64_t &                                      nadded,
+                 uint64_t &                                      nreused,
+                 std::vector<uint64_t> &                         deferred,
+                 const Isa                                       isa) {
+        typedef typename std::iterator_traits<It>::difference_type diff_t;
+
+        std::vector<std::pair<hash_type_t, uint64_t>> batch, batch_tmp;
+        for (uint64_t start = begin; start < end; start += FHT_INSERT_BATCH) {
+            const uint64_t nbatch = (end - start) < FHT_INSERT_BATCH
+                                        ? (end - start)
+                                        : FHT_INSERT_BATCH;
+            batch.assign(order.begin() + (const int64_t)start,
+                         order.begin() + (const int64_t)(start + nbatch));
+            batch_tmp.resize(nbatch);
+            this->_sort_by_chunk(batch, batch_tmp);
+
+            for (uint64_t i = 0; i < nbatch; ++i) {
+                if (i + FHT_INSERT_PREFETCH < nbatch) {
+                    const diff_t next =
+                        (const diff_t)batch[i + FHT_INSERT_PREFETCH].second;
+                    __builtin_prefetch(&(first[next]));
+                }
+                const diff_t   idx = (const diff_t)batch[i].second;
+                const uint64_t res = (const uint64_t)this->_add_home(
+                    first[idx].first,
+                    batch[i].first,
+                    nreused,
+                    isa);
+                if (res == 0) {
+                    deferred.push_back(batch[i].second);
+                }
+                else if (!(res & ((1UL) << 48))) {
+                    fht_chunk<K, V, Slots> * const temp_chunk =
+                        (fht_chunk<K, V, Slots> * const)(res &
+                                                  (~FHT_TAG_BYTES_MASK));
+                    NEW(V,
+                        *(temp_chunk->get_val_n_ptr(
+                            FHT_TAG_PTR_TO_IDX(res))),
+                        first[idx].second);
+                    ++nadded;
+                }
+            }
+        }
+    }
+
+    // counting sort of order by the top bits of home chunk index. Exact for
+    // tables with up to 2 ^ FHT_INSERT_RADIX_BITS chunks, for bigger ones it
+    // groups runs of neighbouring chunks which are small enough to stay in
+    // cache while they are filled (sorting on the rest costs more than it
+    // saves)
+    void
+    _sort_by_chunk(std::vector<std::pair<hash_type_t, uint64_t>> & order,
+                   std::vector<std::pair<hash_type_t, uint64_t>> & order_tmp)
+        const {
+        const uint32_t nbits = this->log_incr - FHT_LOG_CHUNK_SLOTS;
+        const uint32_t shift = nbits > FHT_INSERT_RADIX_BITS
+                                   ? nbits - FHT_INSERT_RADIX_BITS
+                                   : 0;
+
+        uint64_t counts[1 << FHT_INSERT_RADIX_BITS] = { 0 };
+        for (uint64_t i = 0; i < order.size(); ++i) {
+            ++counts[FHT_HASH_TO_IDX(order[i].first, this->log_incr) >> shift];
+        }
+        uint64_t sum = 0;
+        for (uint32_t i = 0; i < (1 << FHT_INSERT_RADIX_BITS); ++i) {
+            const uint64_t count = counts[i];
+            counts[i]            = sum;
+            sum += count;
+        }
+        for (uint64_t i = 0; i < order.size(); ++i) {
+            order_tmp[counts[FHT_HASH_TO_IDX(order[i].first, this->log_incr) >>
+                             shift]++] = order[i];
+        }
+        order.swap(order_tmp);
+    }
+
+
+    // at some point I will try and implement google's shit where they try
+    // and find a key argument in pair arguments
+    template<typename... Args>
+    inline constexpr std::pair<fht_iterator, bool>
+    emplace(Args &&... args) {
+        return insert(std::forward<Args>(args)...);
+    }
+
+    template<typename... Args>
+    inline std::pair<fht_iterator, bool>
+    emplace(key_pass_t new_key, Args &&... args) {
+        return this->_emplace(new_key,
+                              this->hash(new_key),
+                              std::forward<Args>(args)...);
+    }
+
+    // emplace for callers that already have the key's hash (i.e from
+    // sharding on it). raw_slot has to be exactly what Hasher gives for
+    // new_key, debug builds check
+    template<typename... Args>
+    inline std::pair<fht_iterator, bool>
+    insert_hashed(key_pass_t        new_key,
+                  const hash_type_t raw_slot,
+                  Args &&... args) {
+        assert(raw_slot == this->hash(new_key));
+        return this->_emplace(new_key, raw_slot, std::forward<Args>(args)...);
+    }
+
+    template<typename... Args>
+    inline std::pair<fht_iterator, bool>
+    _emplace(key_pass_t new_key, const hash_type_t raw_slot, Args &&... args) {
+        // for now going to force explicit key & value
+        const uint64_t res = (const uint64_t)add(new_key, raw_slot);
+        if (res & ((1UL) << 48)) {
+            return std::pair<fht_iterator, bool>(this->end(), false);
+        }
+        else {
+            fht_chunk<K, V, Slots> * const temp_chunk =
+                (fht_chunk<K, V, Slots> * const)(res & (~FHT_TAG_BYTES_MASK));
+            NEW(V,
+                *(temp_chunk->get_val_n_ptr(FHT_TAG_PTR_TO_IDX(res))),
+                std::forward<Args>(args)...);
+            return (
+                std::pair<fht_iterator, bool>(fht_iterator((const tag_t *)res),
+                                              true));
+        }
+    }
+
+    inline constexpr V & operator[](const K & key) {
+        return this->subscript_hashed(key, this->hash(key));
+    }
+
+    inline constexpr V & operator[](K && key) {
+        return this->subscript_hashed(key, this->hash(key));
+    }
+
+    // operator[] with the key's hash already computed (see insert_hashed())
+    inline V &
+    subscript_hashed(const K & key, const hash_type_t raw_slot) {
+        assert(raw_slot == this->hash(key));
+        const uint64_t res = (const uint64_t)add(key, raw_slot);
+        fht_chunk<K, V, Slots> * const temp_chunk =
+            (fht_chunk<K, V, Slots> * const)(
+                res & (~(((1UL) << 48) | FHT_TAG_BYTES_MASK)));
+
+        // new key so value needs to be constructed (rehash will move it)
+        if (!(res & ((1UL) << 48))) {
+            NEW(V,
+                *(temp_chunk->get_val_n_ptr(FHT_TAG_PTR_TO_IDX(res))), );
+        }
+        return *(
+            V *)(temp_chunk->get_val_n_ptr(FHT_TAG_PTR_TO_IDX(res)));
+    }
+
+    inline const tag_t *
+    add(const K & new_key) {
+        return this->add(new_key, this->hash(new_key));
+    }
+
+    // add with the key's hash already computed
+    inline const tag_t *
+    add(const K & new_key, const hash_type_t raw_slot) {
+        return fht_isa_dispatch<const K &, hash_type_t>(
+            [this](auto isa, const K & k, const hash_type_t h) {
+                return this->_add(k, h, isa);
+            },
+            new_key,
+            raw_slot);
+    }
+
+    template<typename Isa>
+    const tag_t *
+    _add(const K & new_key, const hash_type_t raw_slot, const Isa isa) {
+        // while growing key might still be in the old array
+        if (__builtin_expect(this->_resizing(), 0)) {
+            fht_isa_run<Isa>::run_cold(
+                [&](const Isa cold_isa) { this->_resize_step(cold_isa); });
+            if (this->migrating_chunks != NULL) {
+                const tag_t * const res =
+                    this->template _find_old<key_pass_t>(new_key,
+                                                         raw_slot,
+                                                         isa);
+                if (res != NULL) {
+                    return (const tag_t * const)(((const uint64_t)res) |
+                                                  ((1UL) << 48));
+                }
+            }
+        }
+
+        // get all derferncing of this out of the way
+        const uint32_t chunk_mask = FHT_CHUNK_MASK(this->log_incr);
+        uint32_t       chunk_idx  = FHT_HASH_TO_IDX(raw_slot, this->log_incr);
+
+        fht_chunk<K, V, Slots> * chunk = this->chunks + chunk_idx;
+        __builtin_prefetch(chunk);
+
+        // get tag and start_idx from raw_slot
+        const uint32_t start_idx = FHT_GEN_START_IDX(raw_slot);
+
+        chunk->prefetch_key_n(FHT_MM_IDX_MULT *
+                              (start_idx & FHT_CHUNK_LINE_MASK));
+
+        const tag_t tag = FHT_GEN_TAG(raw_slot);
+
+        // check for valid slot or duplicate. If a chunk has no line with an
+        // empty slot the key may have overflowed into the next chunk in the
+        // probe sequence so need to keep going
+        // the key goes in the first empty or erased slot in probe order but
+        // all lines up to the first one with an empty slot need to be checked
+        // for a duplicate first
+        fht_chunk<K, V, Slots> * erase_chunk = NULL;
+        uint64_t                 idx;
+        uint32_t                 erase_idx = 0;
+        for (uint32_t k = 0; k <= chunk_mask;) {
+            const mask_t empty_mask = chunk->get_empty_all(isa);
+            mask_t       slot_mask =
+                chunk->get_tag_matches_all(tag, start_idx, isa);
+
+            while (slot_mask) {
+                idx = chunk->first_slot(slot_mask, isa);
+                if (__builtin_expect(
+                        idx >= chunk->empty_line_end(empty_mask,
+                                                     start_idx,
+                                                     isa),
+                        0)) {
+                    break;
+                }
+                const uint32_t true_idx = (const uint32_t)(
+                    (idx + FHT_MM_IDX_MULT * start_idx) &
+                    (FHT_CHUNK_SLOTS - 1));
+
+                if (__builtin_expect(
+                        (chunk->compare_hashed_key_n(true_idx,
+                                                     new_key,
+                                                     raw_slot)),
+                        1)) {
+                    return (const tag_t * const)(
+                        ((const uint64_t)(((const tag_t *)chunk) + true_idx)) |
+                        ((1UL) << 48));
+                }
+                slot_mask &= slot_mask - 1;
+            }
+
+            // we always go here 1st loop (where most add calls find a slot)
+            // and if no deleted elements alwys go here as well
+            if (__builtin_expect(erase_chunk == NULL, 1)) {
+                const mask_t _slot_mask =
+                    chunk->get_empty_or_erased_all(start_idx, isa);
+                if (__builtin_expect(_slot_mask != 0, 1)) {
+                    idx = chunk->first_slot(_slot_mask, isa);
+                    erase_idx = (const uint32_t)(
+                        (idx + FHT_MM_IDX_MULT * start_idx) &
+                        (FHT_CHUNK_SLOTS - 1));
+                    erase_chunk = chunk;
+                }
+            }
+            if (__builtin_expect(empty_mask != 0, 1)) {
+                return this->_add_at(erase_chunk,
+                                     erase_idx,
+                                     raw_slot,
+                                     new_key,
+                                     isa);
+            }
+
+            // no free slot in any chunk close enough to the home chunk so grow
+            if (__builtin_expect(
+                    erase_chunk == NULL && k == FHT_MAX_OVERFLOW_CHUNKS,
+                    0)) {
+                break;
+            }
+
+            ++k;
+            chunk_idx = FHT_NEXT_CHUNK(chunk_idx, k, chunk_mask);
+            chunk     = this->chunks + chunk_idx;
+        }
+
+        if (erase_chunk != NULL) {
+            return this->_add_at(erase_chunk,
+                                 erase_idx,
+                                 raw_slot,
+                                 new_key,
+                                 isa);
+        }
+
+        // no valid slot found so rehash. Retry is in the cold call too so
+        // _add isn't recursive (which would stop it being flattened)
+        return fht_isa_run<Isa>::run_cold([&](const Isa cold_isa) {
+            this->_rehash(cold_isa);
+            return this->_add(new_key, raw_slot, cold_isa);
+        });
+    }
+
+    // places new key at slot idx of chunk unless the table has hit its max
+    // load factor in which case it grows first
+    template<typename Isa>
+    inline const tag_t *
+    _add_at(fht_chunk<K, V, Slots> * const chunk,
+            const uint32_t          idx,
+            const hash_type_t       raw_slot,
+            const K &               new_key,
+            const Isa) {
+        if (__builtin_expect(this->npairs >= this->grow_npairs, 0)) {
+            return fht_isa_run<Isa>::run_cold([&](const Isa cold_isa) {
+                this->_grow(cold_isa);
+                return this->_add(new_key, raw_slot, cold_isa);
+            });
+        }
+        ++this->npairs;
+        this->nerased -= chunk->is_erased_n(idx);
+        chunk->set_tag_n(idx, FHT_GEN_TAG(raw_slot));
+        chunk->set_hash_n(idx, raw_slot);
+        NEW(K, *(chunk->get_key_n_ptr(idx)), new_key);
+        return ((const tag_t * const)chunk) + idx;
+    }
+
+    // _add() that only looks at the home chunk and leaves npairs alone (adds
+    // 1 to nreused if it took a tombstone) so build_parallel() threads can
+    // use it on their own chunks. NULL if the home chunk has no empty slot,
+    // the key could then have overflowed out of it
+    template<typename Isa>
+    const tag_t *
+    _add_home(const K &         new_key,
+              const hash_type_t raw_slot,
+              uint64_t &        nreused,
+              const Isa         isa) {
+        fht_chunk<K, V, Slots> * const chunk =
+            this->chunks + FHT_HASH_TO_IDX(raw_slot, this->log_incr);
+        const uint32_t start_idx  = FHT_GEN_START_IDX(raw_slot);
+        const mask_t   empty_mask = chunk->get_empty_all(isa);
+        if (__builtin_expect(empty_mask == 0, 0)) {
+            return NULL;
+        }
+
+        const uint64_t line_end =
+            chunk->empty_line_end(empty_mask, start_idx, isa);
+        mask_t slot_mask =
+            chunk->get_tag_matches_all(FHT_GEN_TAG(raw_slot), start_idx, isa);
+        uint64_t idx;
+        while (slot_mask) {
+            idx = chunk->first_slot(slot_mask, isa);
+            if (idx >= line_end) {
+                break;
+            }
+            const uint32_t true_idx = (const uint32_t)(
+                (idx + FHT_MM_IDX_MULT * start_idx) & (FHT_CHUNK_SLOTS - 1));
+            if (chunk->compare_hashed_key_n(true_idx, new_key, raw_slot)) {
+                return (const tag_t * const)(
+                    ((const uint64_t)(((const tag_t *)chunk) + true_idx)) |
+                    ((1UL) << 48));
+            }
+            slot_mask &= slot_mask - 1;
+        }
+
+        // there is an empty slot so this finds one
+        idx = chunk->first_slot(chunk->get_empty_or_erased_all(start_idx, isa),
+                                isa);
+        const uint32_t true_idx = (const uint32_t)(
+            (idx + FHT_MM_IDX_MULT * start_idx) & (FHT_CHUNK_SLOTS - 1));
+        nreused += chunk->is_erased_n(true_idx);
+        chunk->set_tag_n(true_idx, FHT_GEN_TAG(raw_slot));
+        chunk->set_hash_n(true_idx, raw_slot);
+        NEW(K, *(chunk->get_key_n_ptr(true_idx)), new_key);
+        return ((const tag_t * const)chunk) + true_idx;
+    }
+
+    // one chunk at a time parts of the probe loops for callers that lock
+    // each chunk while they look at it (see fht_striped_table)
+
+    // slot key is in, FHT_CHUNK_SLOTS if it isn't in chunk. has_empty is set
+    // if chunk has an empty slot, if not the key may have overflowed past it
+    template<typename Isa>
+    inline uint32_t
+    _find_in_chunk(const fht_chunk<K, V, Slots> * const chunk,
+                   key_pass_t                    key,
+                   const hash_type_t             raw_slot,
+                   bool &                        has_empty,
+                   const Isa                     isa) const {
+        const uint32_t start_idx  = FHT_GEN_START_IDX(raw_slot);
+        const mask_t   empty_mask = chunk->get_empty_all(isa);
+        mask_t         slot_mask =
+            chunk->get_tag_matches_all(FHT_GEN_TAG(raw_slot), start_idx, isa);
+        has_empty = (empty_mask != 0);
+        while (slot_mask) {
+            const uint64_t idx = chunk->first_slot(slot_mask, isa);
+            if (idx >= chunk->empty_line_end(empty_mask, start_idx, isa)) {
+                break;
+            }
+            const uint32_t true_idx = (const uint32_t)(
+                (idx + FHT_MM_IDX_MULT * start_idx) & (FHT_CHUNK_SLOTS - 1));
+            if (chunk->compare_hashed_key_n(true_idx, key, raw_slot)) {
+                return true_idx;
+            }
+            slot_mask &= slot_mask - 1;
+        }
+        return FHT_CHUNK_SLOTS;
+    }
+
+    // first empty or erased slot of chunk in probe order, FHT_CHUNK_SLOTS if
+    // there isn't one
+    template<typename Isa>
+    inline uint32_t
+    _free_in_chunk(const fht_chunk<K, V, Slots> * const chunk,
+                   const hash_type_t             raw_slot,
+                   const Isa                     isa) const {
+        const uint32_t start_idx = FHT_GEN_START_IDX(raw_slot);
+        const mask_t   slot_mask =
+            chunk->get_empty_or_erased_all(start_idx, isa);
+        if (slot_mask == 0) {
+            return FHT_CHUNK_SLOTS;
+        }
+        return (const uint32_t)(
+            (chunk->first_slot(slot_mask, isa) + FHT_MM_IDX_MULT * start_idx) &
+            (FHT_CHUNK_SLOTS - 1));
+    }
+
+    // new key into free slot idx of chunk. Counts are up to the caller
+    inline void
+    _place_key(fht_chunk<K, V, Slots> * const chunk,
+               const uint32_t          idx,
+               const hash_type_t       raw_slot,
+               const K &               new_key) {
+        chunk->set_tag_n(idx, FHT_GEN_TAG(raw_slot));
+        chunk->set_hash_n(idx, raw_slot);
+        NEW(K, *(chunk->get_key_n_ptr(idx)), new_key);
+    }
+
+    // erases slot idx of chunk, true if it left a tombstone (see
+    // _erase_key). Counts are up to the caller
+    template<typename Isa>
+    inline bool
+    _erase_in_chunk(fht_chunk<K, V, Slots> * const chunk,
+                    const uint32_t          idx,
+                    const Isa               isa) {
+        if (chunk->get_empty(idx / FHT_MM_IDX_MULT, isa)) {
+            chunk->invalidate_tag_n(idx);
+            return false;
+        }
+        chunk->erase_tag_n(idx);
+        return true;
+    }
+
+    // finds a slot for a key that is known not to be in the table (i.e
+    // placing overflowed nodes during rehash), sets the tag and returns
+    // pointer to it
+    template<typename Isa>
+    tag_t *
+    _add_no_dup(const hash_type_t raw_slot, const Isa isa) {
+        const uint32_t chunk_mask = FHT_CHUNK_MASK(this->log_incr);
+        uint32_t       chunk_idx  = FHT_HASH_TO_IDX(raw_slot, this->log_incr);
+        const uint32_t start_idx  = FHT_GEN_START_IDX(raw_slot);
+
+        uint64_t idx;
+        for (uint32_t k = 0; k <= chunk_mask;) {
+            fht_chunk<K, V, Slots> * const chunk = this->chunks + chunk_idx;
+            const mask_t _slot_mask =
+                chunk->get_empty_or_erased_all(start_idx, isa);
+
+            if (__builtin_expect(_slot_mask != 0, 1)) {
+                idx = chunk->first_slot(_slot_mask, isa);
+                const uint32_t true_idx = (const uint32_t)(
+                    (idx + FHT_MM_IDX_MULT * start_idx) &
+                    (FHT_CHUNK_SLOTS - 1));
+                chunk->set_tag_n(true_idx, FHT_GEN_TAG(raw_slot));
+                return ((tag_t * const)chunk) + true_idx;
+            }
+            ++k;
+            chunk_idx = FHT_NEXT_CHUNK(chunk_idx, k, chunk_mask);
+        }
+        // table is full which max load factor should make impossible
+        assert(0);
+        return NULL;
+    }
+    //////////////////////////////////////////////////////////////////////
+    // stuff related to finding elements
+
+
+    const tag_t * __attribute__((pure)) _find(key_pass_t key) const {
+        return this->_find(key, this->hash(key));
+    }
+
+    const tag_t * __attribute__((pure))
+    _find(key_pass_t key, const hash_type_t raw_slot) const {
+        return fht_isa_dispatch<key_pass_t, hash_type_t>(
+            [this](auto isa, key_pass_t k, const hash_type_t h) {
+                return this->template _find_key<key_pass_t>(k, h, isa);
+            },
+            key,
+            raw_slot);
+    }
+
+    // PK is the type key is looked up as (key_pass_t or fht_str_ref)
+    template<typename PK, typename Isa>
+    const tag_t * __attribute__((pure))
+    _find_key(PK key, const hash_type_t raw_slot, const Isa isa) const {
+        // seperate version of find
+        const uint32_t chunk_mask = FHT_CHUNK_MASK(this->log_incr);
+        uint32_t       chunk_idx  = FHT_HASH_TO_IDX(raw_slot, this->log_incr);
+
+        fht_chunk<K, V, Slots> * chunk =
+            (fht_chunk<K, V, Slots> * const)((this->chunks) + chunk_idx);
+        __builtin_prefetch(chunk);
+
+        // by setting valid here we can remove delete check
+        const uint32_t start_idx = FHT_GEN_START_IDX(raw_slot);
+
+        chunk->prefetch_key_n(FHT_MM_IDX_MULT *
+                              (start_idx & FHT_CHUNK_LINE_MASK));
+
+        const tag_t tag = FHT_GEN_TAG(raw_slot);
+
+        // check for valid slot of duplicate. Masks are in probe order (lines
+        // from start_idx) and only lines up to the first one with an empty
+        // slot can have the key
+        uint64_t idx;
+        for (uint32_t k = 0; k <= chunk_mask;) {
+            const mask_t empty_mask = chunk->get_empty_all(isa);
+            mask_t       slot_mask =
+                chunk->get_tag_matches_all(tag, start_idx, isa);
+
+            while (slot_mask) {
+                idx = chunk->first_slot(slot_mask, isa);
+                if (__builtin_expect(
+                        idx >= chunk->empty_line_end(empty_mask,
+                                                     start_idx,
+                                                     isa),
+                        0)) {
+                    break;
+                }
+                const uint32_t true_idx = (const uint32_t)(
+                    (idx + FHT_MM_IDX_MULT * start_idx) &
+                    (FHT_CHUNK_SLOTS - 1));
+
+                if (__builtin_expect(
+                        (chunk->compare_hashed_key_n(true_idx, key, raw_slot)),
+                        1)) {
+                    return ((const tag_t * const)chunk) + true_idx;
+                }
+                slot_mask &= slot_mask - 1;
+            }
+            if (__builtin_expect(empty_mask != 0, 1)) {
+                return __builtin_expect(this->migrating_chunks == NULL, 1)
+                           ? NULL
+                           : this->template _find_old<PK>(key, raw_slot, isa);
+            }
+
+            // chunk is full so key may have overflowed
+            ++k;
+            chunk_idx = FHT_NEXT_CHUNK(chunk_idx, k, chunk_mask);
+            chunk =
+                (fht_chunk<K, V, Slots> * const)((this->chunks) + chunk_idx);
+        }
+        return __builtin_expect(this->migrating_chunks == NULL, 1)
+                   ? NULL
+                   : this->template _find_old<PK>(key, raw_slot, isa);
+    }
+
+
+    // resolves up to FHT_FIND_BATCH keys. All are hashed and their home
+    // chunks prefetched, then the node of each first tag match is
+    // prefetched, then they are looked up (by which point most of the misses
+    // should be done)
+    template<typename Isa>
+    void
+    _find_batch(const K * const      keys,
+                const uint32_t       nkeys,
+                const tag_t ** const res,
+                const Isa            isa) const {
+        hash_type_t raw_slots[FHT_FIND_BATCH];
+        for (uint32_t i = 0; i < nkeys; ++i) {
+            raw_slots[i] = this->hash(keys[i]);
+            const fht_chunk<K, V, Slots> * const chunk =
+                this->chunks + FHT_HASH_TO_IDX(raw_slots[i], this->log_incr);
+            __builtin_prefetch(chunk);
+        }
+        for (uint32_t i = 0; i < nkeys; ++i) {
+            fht_chunk<K, V, Slots> * const chunk =
+                (fht_chunk<K, V, Slots> * const)(this->chunks +
+                                          FHT_HASH_TO_IDX(raw_slots[i],
+                                                          this->log_incr));
+            const uint32_t outer_idx =
+                FHT_GEN_START_IDX(raw_slots[i]) & FHT_CHUNK_LINE_MASK;
+            const uint32_t slot_mask =
+                chunk->get_tag_matches(FHT_GEN_TAG(raw_slots[i]),
+                                       outer_idx,
+                                       isa);
+            if (slot_mask) {
+                uint32_t idx;
+                __asm__("tzcnt %1, %0" : "=r"((idx)) : "rm"((slot_mask)));
+                __builtin_prefetch(
+                    chunk->get_key_n_ptr(FHT_MM_IDX_MULT * outer_idx + idx));
+            }
+        }
+        for (uint32_t i = 0; i < nkeys; ++i) {
+            res[i] = this->template _find_key<key_pass_t>(keys[i],
+                                                          raw_slots[i],
+                                                          isa);
+        }
+    }
+
+    // batched find for lots of independent lookups. out[i] is find(keys[i])
+    void
+    find_many(const K * const      keys,
+              const uint64_t       n,
+              fht_iterator * const out) const {
+        fht_isa_dispatch([&](auto isa) {
+            const tag_t * res[FHT_FIND_BATCH];
+            for (uint64_t i = 0; i < n; i += FHT_FIND_BATCH) {
+                const uint32_t nkeys = (const uint32_t)(
+                    (n - i) < FHT_FIND_BATCH ? (n - i) : FHT_FIND_BATCH);
+                this->_find_batch(keys + i, nkeys, res, isa);
+                for (uint32_t j = 0; j < nkeys; ++j) {
+                    out[i + j] =
+                        (res[j] == NULL) ? this->end() : fht_iterator(res[j]);
+                }
+            }
+        });
+    }
+
+    // batched count, returns how many of keys are in the table
+    uint64_t
+    count_many(const K * const keys, const uint64_t n) const {
+        return fht_isa_dispatch([&](auto isa) {
+            const tag_t * res[FHT_FIND_BATCH];
+            uint64_t       found = 0;
+            for (uint64_t i = 0; i < n; i += FHT_FIND_BATCH) {
+                const uint32_t nkeys = (const uint32_t)(
+                    (n - i) < FHT_FIND_BATCH ? (n - i) : FHT_FIND_BATCH);
+                this->_find_batch(keys + i, nkeys, res, isa);
+                for (uint32_t j = 0; j < nkeys; ++j) {
+                    found += (res[j] != NULL);
+                }
+            }
+            return found;
+        });
+    }
+
+    inline constexpr fht_iterator
+    find(K && key) const {
+        const tag_t * const res = _find(std::move(key));
+        return (res == NULL) ? this->end() : fht_iterator(res);
+    }
+
+    inline constexpr fht_iterator
+    find(const K & key) const {
+        const tag_t * const res = _find(std::move(key));
+        return (res == NULL) ? this->end() : fht_iterator(res);
+    }
+
+    // find with the key's hash already computed (see insert_hashed())
+    inline fht_iterator
+    find_hashed(key_pass_t key, const hash_type_t raw_slot) const {
+        assert(raw_slot == this->hash(key));
+        const tag_t * const res = _find(key, raw_slot);
+        return (res == NULL) ? this->end() : fht_iterator(res);
+    }
+
+    inline constexpr uint64_t
+    count(const K & key) const {
+        return (_find(key) != NULL);
+    }
+
+    inline constexpr uint64_t
+    count(K && key) const {
+        return (_find(std::move(key)) != NULL);
+    }
+
+    inline constexpr bool
+    contains(const K & key) const {
+        return count(key);
+    }
+
+    inline constexpr bool
+    contains(K && key) const {
+        return count(std::move(key));
+    }
+
+    inline constexpr V &
+    at(const K & key) const {
+        const uint64_t          res = (const uint64_t)_find(key);
+        fht_chunk<K, V, Slots> * const chunk =
+            (fht_chunk<K, V, Slots> * const)(res & (~FHT_TAG_BYTES_MASK));
+        return *(chunk->get_val_n_ptr(FHT_TAG_PTR_TO_IDX(res)));
+    }
+
+    inline constexpr V &
+    at(K && key) const {
+        const uint64_t res = (const uint64_t)_find(std::move(key));
+        fht_chunk<K, V, Slots> * const chunk =
+            (fht_chunk<K, V, Slots> * const)(res & (~FHT_TAG_BYTES_MASK));
+        return *(chunk->get_val_n_ptr(FHT_TAG_PTR_TO_IDX(res)));
+    }
+
+    //////////////////////////////////////////////////////////////////////
+    // lookups in std::string keyed tables by bytes that aren't in a
+    // std::string (slice of a network buffer or whatever) so nothing gets
+    // allocated. Hash is the same as for the std::string so these find keys
+    // added the normal way. Hasher needs an operator()(const fht_str_ref)
+    // (the string hashers below have one)
+    const tag_t * __attribute__((pure))
+    _find_str(const char * const key, const uint32_t len) const {
+        static_assert(std::is_same<K, std::string>::value,
+                      "string lookups are only for std::string keys");
+        const fht_str_ref ref      = { key, len };
+        const hash_type_t raw_slot = this->hash(ref);
+        return fht_isa_dispatch([&](auto isa) {
+            return this->template _find_key<const fht_str_ref>(ref,
+                                                               raw_slot,
+                                                               isa);
+        });
+    }
+
+    inline fht_iterator
+    find(const char * const key, const uint32_t len) const {
+        const tag_t * const res = this->_find_str(key, len);
+        return (res == NULL) ? this->end() : fht_iterator(res);
+    }
+
+    inline uint64_t
+    count(const char * const key, const uint32_t len) const {
+        return (this->_find_str(key, len) != NULL);
+    }
+
+    inline bool
+    contains(const char * const key, const uint32_t len) const {
+        return this->count(key, len);
+    }
+
+    inline V &
+    at(const char * const key, const uint32_t len) const {
+        const uint64_t res = (const uint64_t)this->_find_str(key, len);
+        fht_chunk<K, V, Slots> * const chunk =
+            (fht_chunk<K, V, Slots> * const)(res & (~FHT_TAG_BYTES_MASK));
+        return *(chunk->get_val_n_ptr(FHT_TAG_PTR_TO_IDX(res)));
+    }
+
+    uint64_t
+    erase(const char * const key, const uint32_t len) {
+        static_assert(std::is_same<K, std::string>::value,
+                      "string lookups are only for std::string keys");
+        const fht_str_ref ref      = { key, len };
+        const hash_type_t raw_slot = this->hash(ref);
+        return fht_isa_dispatch([&](auto isa) {
+            return this->template _erase_key<const fht_str_ref>(ref,
+                                                                raw_slot,
+                                                                isa);
+        });
+    }
+
+#ifdef FHT_HAS_STRING_VIEW
+    // templated so that find("literal") still goes to find(const K &)
+    // instead of being ambiguous
+    template<typename SV>
+    using _if_string_view =
+        typename std::enable_if<std::is_same<SV, std::string_view>::value,
+                                int>::type;
+
+    template<typename SV, _if_string_view<SV> = 0>
+    inline fht_iterator
+    find(const SV key) const {
+        return this->find(key.data(), (const uint32_t)key.length());
+    }
+
+    template<typename SV, _if_string_view<SV> = 0>
+    inline uint64_t
+    count(const SV key) const {
+        return this->count(key.data(), (const uint32_t)key.length());
+    }
+
+    template<typename SV, _if_string_view<SV> = 0>
+    inline bool
+    contains(const SV key) const {
+        return this->contains(key.data(), (const uint32_t)key.length());
+    }
+
+    template<typename SV, _if_string_view<SV> = 0>
+    inline V &
+    at(const SV key) const {
+        return this->at(key.data(), (const uint32_t)key.length());
+    }
+
+    template<typename SV, _if_string_view<SV> = 0>
+    inline uint64_t
+    erase(const SV key) {
+        return this->erase(key.data(), (const uint32_t)key.length());
+    }
+#endif
+    //////////////////////////////////////////////////////////////////////
+
+
+    //////////////////////////////////////////////////////////////////////
+    // deleting stuff
+    uint64_t
+    erase(key_pass_t key) {
+        return this->erase_hashed(key, this->hash(key));
+    }
+
+    // erase with the key's hash already computed (see insert_hashed())
+    uint64_t
+    erase_hashed(key_pass_t key, const hash_type_t raw_slot) {
+        assert(raw_slot == this->hash(key));
+        return fht_isa_dispatch<key_pass_t, hash_type_t>(
+            [this](auto isa, key_pass_t k, const hash_type_t h) {
+                return this->template _erase_key<key_pass_t>(k, h, isa);
+            },
+            key,
+            raw_slot);
+    }
+
+    template<typename PK, typename Isa>
+    uint64_t
+    _erase_key(PK key, const hash_type_t raw_slot, const Isa isa) {
+        if (__builtin_expect(this->_resizing(), 0)) {
+            fht_isa_run<Isa>::run_cold(
+                [&](const Isa cold_isa) { this->_resize_step(cold_isa); });
+        }
+
+        const uint32_t chunk_mask = FHT_CHUNK_MASK(this->log_incr);
+        uint32_t       chunk_idx  = FHT_HASH_TO_IDX(raw_slot, this->log_incr);
+
+        fht_chunk<K, V, Slots> * chunk = this->chunks + chunk_idx;
+        __builtin_prefetch(chunk);
+
+        // by setting valid here we can remove delete check
+        const uint32_t start_idx = FHT_GEN_START_IDX(raw_slot);
+
+        chunk->prefetch_key_n(FHT_MM_IDX_MULT *
+                              (start_idx & FHT_CHUNK_LINE_MASK));
+
+        const tag_t tag = FHT_GEN_TAG(raw_slot);
+
+        // check for valid slot of duplicate
+        uint64_t idx;
+        for (uint32_t k = 0; k <= chunk_mask;) {
+            const mask_t empty_mask = chunk->get_empty_all(isa);
+            mask_t       slot_mask =
+                chunk->get_tag_matches_all(tag, start_idx, isa);
+
+            while (slot_mask) {
+                idx = chunk->first_slot(slot_mask, isa);
+                if (__builtin_expect(
+                        idx >= chunk->empty_line_end(empty_mask,
+                                                     start_idx,
+                                                     isa),
+                        0)) {
+                    break;
+                }
+                const uint32_t true_idx = (const uint32_t)(
+                    (idx + FHT_MM_IDX_MULT * start_idx) &
+                    (FHT_CHUNK_SLOTS - 1));
+                if (__builtin_expect(
+                        (chunk->compare_hashed_key_n(true_idx, key, raw_slot)),
+                        1)) {
+                    // if line is full need to leave tombstone so that
+                    // keys later in the probe sequence (next line or
+                    // overflowed to another chunk) can still be found
+                    if (__builtin_expect(
+                            chunk->get_empty(true_idx / FHT_MM_IDX_MULT, isa),
+                            1)) {
+                        chunk->invalidate_tag_n(true_idx);
+                    }
+                    else {
+                        chunk->erase_tag_n(true_idx);
+                        ++this->nerased;
+                    }
+                    --this->npairs;
+                    if (__builtin_expect(this->npairs < this->min_npairs, 0)) {
+                        fht_isa_run<Isa>::run_cold([&](const Isa cold_isa) {
+                            this->_shrink_to(this->log_incr - 1, cold_isa);
+                        });
+                    }
+                    else if (__builtin_expect(
+                                 this->nerased > this->max_nerased,
+                                 0)) {
+                        fht_isa_run<Isa>::run_cold([&](const Isa cold_isa) {
+                            this->_purge_tombstones(cold_isa);
+                        });
+                    }
+                    return FHT_ERASED;
+                }
+                slot_mask &= slot_mask - 1;
+            }
+
+            if (__builtin_expect(empty_mask != 0, 1)) {
+                return __builtin_expect(this->migrating_chunks == NULL, 1)
+                           ? FHT_NOT_ERASED
+                           : this->template _erase_old<PK>(key, raw_slot, isa);
+            }
+
+            // chunk is full so key may have overflowed
+            ++k;
+            chunk_idx = FHT_NEXT_CHUNK(chunk_idx, k, chunk_mask);
+            chunk     = this->chunks + chunk_idx;
+        }
+
+        return __builtin_expect(this->migrating_chunks == NULL, 1)
+                   ? FHT_NOT_ERASED
+                   : this->template _erase_old<PK>(key, raw_slot, isa);
+    }
+
+    inline constexpr uint64_t
+    erase(fht_iterator fht_it) {
+        return erase(fht_it->first);
+    }
+
+    void
+    clear() {
+        this->_drop_resize();
+        const uint32_t _num_chunks =
+            ((1u) << (this->log_incr)) / FHT_CHUNK_SLOTS;
+
+        fht_isa_dispatch([&](auto isa) {
+            for (uint32_t i = 0; i < _num_chunks; ++i) {
+                this->chunks[i].reset_tags(isa);
+            }
+        });
+        this->npairs  = 0;
+        this->nerased = 0;
+        this->set_max_npairs();
+    }
+
+
+    // chunks in the table (what chunk_range() takes)
+    inline constexpr uint32_t
+    num_chunks() const {
+        return FHT_NUM_CHUNKS(this->log_incr);
+    }
+
+    // pairs in chunks [begin_chunk, end_chunk) so a scan can be split up.
+    // Same as begin() about growing
+    inline fht_chunk_range<K, V, Slots>
+    chunk_range(const uint32_t begin_chunk, const uint32_t end_chunk) {
+        this->_finish_resize();
+        return ((const fht_table *)this)->chunk_range(begin_chunk, end_chunk);
+    }
+
+    inline fht_chunk_range<K, V, Slots> __attribute__((pure))
+    chunk_range(const uint32_t begin_chunk, const uint32_t end_chunk) const {
+        assert(this->migrating_chunks == NULL);
+        assert(begin_chunk <= end_chunk && end_chunk <= this->num_chunks());
+        return fht_chunk_range<K, V, Slots>{ this->chunks,
+                                             begin_chunk,
+                                             end_chunk,
+                                             this->chunks +
+                                                 this->num_chunks() };
+    }
+
+    // fn(key, val) for every pair with the chunks split across up to nthreads
+    // threads (see fht_parallel_threads). fn has to be callable from all of
+    // them at once and the table can't change until it returns
+    template<typename Fn>
+    void
+    parallel_for_each(Fn fn, const uint32_t nthreads) {
+        this->_finish_resize();
+        ((const fht_table *)this)->parallel_for_each(fn, nthreads);
+    }
+
+    template<typename Fn>
+    void
+    parallel_for_each(Fn fn, const uint32_t nthreads) const {
+        assert(this->migrating_chunks == NULL);
+        const uint32_t _num_chunks = this->num_chunks();
+        fht_isa_dispatch([&](auto isa) {
+            this->_for_chunk_ranges(
+                _num_chunks,
+                fht_parallel_threads(_num_chunks, nthreads),
+                isa,
+                [&](const uint32_t,
+                    const uint32_t begin,
+                    const uint32_t end,
+                    auto           _isa) {
+                    this->chunk_range(begin, end)._for_each(fn, _isa);
+                });
+        });
+    }
+
+    // iterating needs the whole table in one array so non const begin()
+    // finishes growing
+    inline fht_iterator
+    begin() {
+        this->_finish_resize();
+        return ((const fht_table *)this)->begin();
+    }
+
+    inline constexpr fht_iterator
+    begin() const {
+        assert(this->migrating_chunks == NULL);
+        if (this->empty()) {
+            return this->end();
+        }
+        else {
+            return fht_iterator((const tag_t *)this->chunks,
+                                (const uint64_t)(this->end().cur_tag));
+        }
+    }
+
+    inline constexpr fht_iterator
+    end() const {
+        return fht_iterator((const tag_t *)(
+            this->chunks + (((1UL) << (this->log_incr)) / FHT_CHUNK_SLOTS)));
+    }
+};
+
+//////////////////////////////////////////////////////////////////////
+// Sharded table for use from multiple threads. Keys go to one of Shards
+// independent fht_tables by the hash bits right below bit 29 (the default
+// hashers only fill the bottom 32 bits even if they return 64 and a 32 bit
+// hash has FHT_GEN_START_IDX's bits above that). Chunk idx comes from the
+// bits above the tag so until a shard has 2 ^ (29 - log(Shards) - tag bits)
+// chunks the two don't overlap and every shard gets to use all its chunks
+// (i.e 8 shards with 8 bit tags is 32m slots a shard). Each shard has a
+// reader / writer lock on its own cache line: lookups take it shared, adds /
+// erases take it exclusive (a shard grows while its lock is held). Hasher has
+// to be callable from all threads at once
+
+// what fht_sharded_table / fht_striped_table operator[] gives. Keeps the
+// shard / chunk locked until it goes away so dont hold on to one while using
+// the table for something else
+template<typename V, typename Lock = std::shared_timed_mutex>
+struct fht_locked_val {
+    std::unique_lock<Lock> lock;
+    V *                    val;
+
+    fht_locked_val(std::unique_lock<Lock> && _lock, V * const _val)
+        : lock(std::move(_lock)), val(_val) {}
+    fht_locked_val(fht_locked_val &&) = default;
+    fht_locked_val & operator=(const fht_locked_val &) = delete;
+
+    template<typename T>
+    inline fht_locked_val &
+    operator=(T && new_val) {
+        *(this->val) = std::forward<T>(new_val);
+        return *this;
+    }
+
+    inline V & operator*() const {
+        return *(this->val);
+    }
+
+    inline V * operator->() const {
+        return this->val;
+    }
+
+    inline operator V &() const {
+        return *(this->val);
+    }
+};
+
+template<typename K,
+         typename V,
+         uint32_t Shards,
+         typename Hasher    = fht_default_hash<K, V>,
+         typename Allocator = DEFAULT_ALLOC<K, V>,
+         uint32_t Slots     = fht_chunk_slots<K, V>::value>
+struct fht_sharded_table {
+    typedef fht_table<K, V, Hasher, Allocator, Slots> table_t;
+    typedef typename table_t::hash_type_t      hash_type_t;
+    typedef typename table_t::key_pass_t       key_pass_t;
+
+    static_assert(Shards && !(Shards & (Shards - 1)),
+                  "Shards has to be a power of 2");
+    static_assert(Shards <= 256, "too many shards");
+
+    struct alignas(L1_CACHE_LINE_SIZE) shard_t {
+        mutable std::shared_timed_mutex lock;
+        table_t                         table;
+
+        shard_t(const uint64_t init_size) : table(init_size) {}
+    };
+
+    Hasher    hash;
+    shard_t * shards;
+
+    //////////////////////////////////////////////////////////////////////
+    // init_size is for the whole table
+    fht_sharded_table(const uint64_t init_size) {
+        this->shards = (shard_t *)aligned_alloc(L1_CACHE_LINE_SIZE,
+                                                Shards * sizeof(shard_t));
+        for (uint32_t i = 0; i < Shards; ++i) {
+            NEW(shard_t, this->shards[i], init_size / Shards);
+        }
+    }
+    fht_sharded_table() : fht_sharded_table(FHT_DEFAULT_INIT_SIZE * Shards) {}
+
+    fht_sharded_table(const fht_sharded_table &) = delete;
+    fht_sharded_table & operator=(const fht_sharded_table &) = delete;
+
+    ~fht_sharded_table() {
+        for (uint32_t i = 0; i < Shards; ++i) {
+            this->shards[i].~shard_t();
+        }
+        free(this->shards);
+    }
+
+    // shard a hash goes to. A shard's table takes its chunk idx from as many
+    // bits above the tags as it needs so there is no range of hash bits the
+    // shards could take without costing a big shard chunk idx bits. Instead
+    // the multiply mixes all of the hash into its top bits
+    static inline constexpr uint32_t
+    shard_idx(const hash_type_t raw_slot) {
+        return Shards == 1
+                   ? 0
+                   : (uint32_t)((((uint64_t)raw_slot) * 0x9E3779B97F4A7C15UL) >>
+                                (64 - __builtin_ctz(Shards)));
+    }
+
+    inline shard_t &
+    _shard(const hash_type_t raw_slot) const {
+        return this->shards[shard_idx(raw_slot)];
+    }
+
+    //////////////////////////////////////////////////////////////////////
+    // everything past here locks the shard(s) it uses
+
+    // pairs in all the shards. Each is locked by itself so this isn't a
+    // snapshot if other threads are adding / erasing
+    uint64_t
+    size() const {
+        uint64_t total = 0;
+        for (uint32_t i = 0; i < Shards; ++i) {
+            std::shared_lock<std::shared_timed_mutex> lock(
+                this->shards[i].lock);
+            total += this->shards[i].table.size();
+        }
+        return total;
+    }
+
+    inline bool
+    empty() const {
+        return !(this->size());
+    }
+
+    void
+    reserve(const uint64_t n) {
+        for (uint32_t i = 0; i < Shards; ++i) {
+            std::unique_lock<std::shared_timed_mutex> lock(
+                this->shards[i].lock);
+            this->shards[i].table.reserve(n / Shards);
+        }
+    }
+
+    // true if key wasn't in the table
+    template<typename... Args>
+    inline bool
+    emplace(key_pass_t new_key, Args &&... args) {
+        const hash_type_t raw_slot = this->hash(new_key);
+        shard_t &         shard    = this->_shard(raw_slot);
+        std::unique_lock<std::shared_timed_mutex> lock(shard.lock);
+        return shard.table
+            .insert_hashed(new_key, raw_slot, std::forward<Args>(args)...)
+            .second;
+    }
+
+    // the shard stays locked until the result goes away
+    inline fht_locked_val<V> operator[](const K & key) {
+        const hash_type_t raw_slot = this->hash(key);
+        shard_t &         shard    = this->_shard(raw_slot);
+        std::unique_lock<std::shared_timed_mutex> lock(shard.lock);
+        V & val = shard.table.subscript_hashed(key, raw_slot);
+        return fht_locked_val<V>(std::move(lock), &val);
+    }
+
+    // copies key's value to val if its in the table. Other threads can
+    // change the table once this returns so no iterators / pointers
+    inline bool
+    find(key_pass_t key, V & val) const {
+        const hash_type_t raw_slot = this->hash(key);
+        const shard_t &   shard    = this->_shard(raw_slot);
+        std::shared_lock<std::shared_timed_mutex> lock(shard.lock);
+        const auto it = shard.table.find_hashed(key, raw_slot);
+        if (it == shard.table.end()) {
+            return false;
+        }
+        val = it->second;
+        return true;
+    }
+
+    inline uint64_t
+    count(key_pass_t key) const {
+        const hash_type_t raw_slot = this->hash(key);
+        const shard_t &   shard    = this->_shard(raw_slot);
+        std::shared_lock<std::shared_timed_mutex> lock(shard.lock);
+        return shard.table.find_hashed(key, raw_slot) != shard.table.end();
+    }
+
+    inline bool
+    contains(key_pass_t key) const {
+        return this->count(key);
+    }
+
+    inline uint64_t
+    erase(key_pass_t key) {
+        const hash_type_t raw_slot = this->hash(key);
+        shard_t &         shard    = this->_shard(raw_slot);
+        std::unique_lock<std::shared_timed_mutex> lock(shard.lock);
+        return shard.table.erase_hashed(key, raw_slot);
+    }
+};
+
+//////////////////////////////////////////////////////////////////////
+// Single table for use from multiple threads with a lock per group of chunks
+// (stripe) instead of per table. Each stripe is a cache line with two spin
+// locks:
+//  key_lock: held for all of an op on a key whose home chunk idx maps to the
+//      stripe (by its low bits). Ops on a key happen one at a time and
+//      nothing can grow the table under them
+//  chunk_lock: held while looking at / changing a chunk that maps to the
+//      stripe. A key can have overflowed past its home chunk so an op can go
+//      through a few of them but only ever holds one. Values are under their
+//      chunk's lock
+// key_lock is always taken first and one op holds at most one of each so
+// they can't deadlock. Growing / shrinking / purging tombstones takes every
+// lock (incremental growth is turned off). Hasher has to be callable from all
+// threads at once
+
+// one byte lock for fht_striped_table. Spins a bit then yields so whoever has
+// it gets to run when there are more threads than cores
+struct fht_spin_lock {
+    std::atomic<uint8_t> locked;
+
+    fht_spin_lock() : locked(0) {}
+
+    inline bool
+    try_lock() {
+        return !this->locked.exchange(1, std::memory_order_acquire);
+    }
+
+    inline void
+    lock() {
+        while (__builtin_expect(!this->try_lock(), 0)) {
+            for (uint32_t i = 0; this->locked.load(std::memory_order_relaxed);
+                 ++i) {
+                if (i < FHT_SPIN_PAUSES) {
+                    _mm_pause();
+                }
+                else {
+                    std::this_thread::yield();
+                }
+            }
+        }
+    }
+
+    inline void
+    unlock() {
+        this->locked.store(0, std::memory_order_release);
+    }
+};
+
+template<typename K,
+         typename V,
+         uint32_t Stripes,
+         typename Hasher    = fht_default_hash<K, V>,
+         typename Allocator = DEFAULT_ALLOC<K, V>,
+         uint32_t Slots     = fht_chunk_slots<K, V>::value>
+struct fht_striped_table {
+    typedef fht_table<K, V, Hasher, Allocator, Slots> table_t;
+    typedef typename table_t::hash_type_t      hash_type_t;
+    typedef typename table_t::key_pass_t       key_pass_t;
+    typedef typename table_t::tag_t            tag_t;
+    typedef std::unique_lock<fht_spin_lock>    lock_t;
+
+    static_assert(Stripes && !(Stripes & (Stripes - 1)),
+                  "Stripes has to be a power of 2");
+
+    struct alignas(L1_CACHE_LINE_SIZE) stripe_t {
+        fht_spin_lock key_lock;
+        fht_spin_lock chunk_lock;
+    };
+
+    table_t    table;
+    stripe_t * stripes;
+
+    //////////////////////////////////////////////////////////////////////
+    fht_striped_table(const uint64_t init_size) : table(init_size) {
+        fht_growth_policy growth = this->table.growth_policy();
+        growth.migrate_chunks    = 0;
+        this->table.growth_policy(growth);
+
+        this->stripes = (stripe_t *)aligned_alloc(L1_CACHE_LINE_SIZE,
+                                                  Stripes * sizeof(stripe_t));
+        for (uint32_t i = 0; i < Stripes; ++i) {
+            NEW(stripe_t, this->stripes[i], );
+        }
+    }
+    fht_striped_table() : fht_striped_table(FHT_DEFAULT_INIT_SIZE) {}
+
+    fht_striped_table(const fht_striped_table &) = delete;
+    fht_striped_table & operator=(const fht_striped_table &) = delete;
+
+    ~fht_striped_table() {
+        free(this->stripes);
+    }
+
+    inline stripe_t &
+    _key_stripe(const hash_type_t raw_slot) const {
+        return this->stripes[(uint32_t)(raw_slot >>
+                                        fht_tags<tag_t>::content_bits) &
+                             (Stripes - 1)];
+    }
+
+    inline stripe_t &
+    _chunk_stripe(const uint32_t chunk_idx) const {
+        return this->stripes[chunk_idx & (Stripes - 1)];
+    }
+
+    // fn() with every lock held so nothing else is using the table
+    template<typename Fn>
+    void
+    _with_all_locked(Fn fn) {
+        for (uint32_t i = 0; i < Stripes; ++i) {
+            this->stripes[i].key_lock.lock();
+        }
+        for (uint32_t i = 0; i < Stripes; ++i) {
+            this->stripes[i].chunk_lock.lock();
+        }
+        fn();
+        for (uint32_t i = 0; i < Stripes; ++i) {
+            this->stripes[i].chunk_lock.unlock();
+            this->stripes[i].key_lock.unlock();
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////
+    // whole table ops, these take every lock
+
+    // migrate_chunks is ignored
+    void
+    growth_policy(fht_growth_policy new_growth) {
+        new_growth.migrate_chunks = 0;
+        this->_with_all_locked(
+            [&]() { this->table.growth_policy(new_growth); });
+    }
+
+    void
+    rehash() {
+        this->_with_all_locked([&]() { this->table.rehash(); });
+    }
+
+    void
+    reserve(const uint64_t n) {
+        this->_with_all_locked([&]() { this->table.reserve(n); });
+    }
+
+    // npairs is only ever changed with atomic adds once the table is shared
+    inline uint64_t
+    size() const {
+        return __atomic_load_n(&(this->table.npairs), __ATOMIC_RELAXED);
+    }
 
+    inline bool
+    empty() const {
+        return !(this->size());
+    }
 
-                    old_chunk->set_tag_n((const uint32_t)to_move_idx,
-                                         INVALID_MASK);
+    //////////////////////////////////////////////////////////////////////
+    // point ops
 
-                    old_start_good_slots += ((1u) << (8 * j));
-                    old_start_pos[j] |= ((1u) << to_place_idx);
-                    old_start_pos[to_move_idx / FHT_MM_IDX_MULT] ^=
-                        ((1u) << (to_move_idx & FHT_MM_IDX_MASK));
+    // true if key wasn't in the table
+    template<typename... Args>
+    inline bool
+    emplace(key_pass_t new_key, Args &&... args) {
+        const hash_type_t raw_slot = this->table.hash(new_key);
+        return fht_isa_dispatch([&](auto isa) {
+            lock_t   chunk_lock;
+            uint32_t idx;
+            bool     added;
+            fht_chunk<K, V, Slots> * const chunk =
+                this->_add_locked(
+                    new_key, raw_slot, idx, added, chunk_lock, isa);
+            if (added) {
+                NEW(V,
+                    *(chunk->get_val_n_ptr(idx)),
+                    std::forward<Args>(args)...);
+            }
+            return added;
+        });
+    }
+
+    // the key's chunk stays locked until the result goes away
+    inline fht_locked_val<V, fht_spin_lock> operator[](const K & key) {
+        const hash_type_t raw_slot = this->table.hash(key);
+        return fht_isa_dispatch([&](auto isa) {
+            lock_t   chunk_lock;
+            uint32_t idx;
+            bool     added;
+            fht_chunk<K, V, Slots> * const chunk =
+                this->_add_locked(key, raw_slot, idx, added, chunk_lock, isa);
+            V * const val = (V *)(chunk->get_val_n_ptr(idx));
+            if (added) {
+                NEW(V, *val, );
+            }
+            return fht_locked_val<V, fht_spin_lock>(std::move(chunk_lock),
+                                                    val);
+        });
+    }
+
+    // copies key's value to val if its in the table
+    inline bool
+    find(key_pass_t key, V & val) const {
+        return fht_isa_dispatch<key_pass_t, hash_type_t>(
+            [this, &val](auto isa, key_pass_t k, const hash_type_t h) {
+                lock_t                        chunk_lock;
+                uint32_t                      idx;
+                const fht_chunk<K, V, Slots> * const chunk =
+                    this->_find_locked(k, h, idx, chunk_lock, isa);
+                if (chunk == NULL) {
+                    return false;
                 }
-                // j is full of items that belong but more entries wants to be
-                // in j
-                if (__builtin_expect(old_start_to_move[j] &&
-                                         ((old_start_good_slots >> (8 * j)) &
-                                          0xff) == FHT_MM_IDX_MULT,
-                                     0)) {
+                val = *(chunk->get_val_n_ptr(idx));
+                return true;
+            },
+            key,
+            this->table.hash(key));
+    }
 
-                    // move the indexes that this need to be placed (i.e if
-                    // any of the nodes that needed to be moved to j (now
-                    // j + 1) are already in j + 1 we can remove them from
-                    // to_move list
-                    old_start_to_move[(j + 1) & FHT_MM_LINE_MASK] |=
-                        (~((0xffffUL) << (FHT_MM_IDX_MULT *
-                                          ((j + 1) & FHT_MM_LINE_MASK)))) &
-                        old_start_to_move[j];
+    inline uint64_t
+    count(key_pass_t key) const {
+        return fht_isa_dispatch<key_pass_t, hash_type_t>(
+            [this](auto isa, key_pass_t k, const hash_type_t h) {
+                lock_t   chunk_lock;
+                uint32_t idx;
+                return (uint64_t)(
+                    this->_find_locked(k, h, idx, chunk_lock, isa) != NULL);
+            },
+            key,
+            this->table.hash(key));
+    }
 
+    inline bool
+    contains(key_pass_t key) const {
+        return this->count(key);
+    }
 
-                    const uint32_t new_mask =
-                        (old_start_to_move[j] >>
-                         (FHT_MM_IDX_MULT * ((j + 1) & FHT_MM_LINE_MASK))) &
-                        0xffff;
+    uint64_t
+    erase(key_pass_t key) {
+        return fht_isa_dispatch<key_pass_t, hash_type_t>(
+            [this](auto isa, key_pass_t k, const hash_type_t h) {
+                return this->_erase(k, h, isa);
+            },
+            key,
+            this->table.hash(key));
+    }
 
-                    old_start_pos[(j + 1) & FHT_MM_LINE_MASK] |= new_mask;
-                    old_start_good_slots +=
-                        bitcount_32(new_mask)
-                        << (8 * ((j + 1) & FHT_MM_LINE_MASK));
+    //////////////////////////////////////////////////////////////////////
+    // chunk (and slot) key is in with that chunk's lock held by chunk_lock.
+    // NULL if key isn't in the table
+    template<typename Isa>
+    fht_chunk<K, V, Slots> *
+    _find_locked(key_pass_t        key,
+                 const hash_type_t raw_slot,
+                 uint32_t &        idx,
+                 lock_t &          chunk_lock,
+                 const Isa         isa) const {
+        lock_t          key_lock(this->_key_stripe(raw_slot).key_lock);
+        const table_t & t          = this->table;
+        const uint32_t  chunk_mask = FHT_CHUNK_MASK(t.log_incr);
+        uint32_t        chunk_idx  = FHT_HASH_TO_IDX(raw_slot, t.log_incr);
+        for (uint32_t k = 0; k <= chunk_mask;) {
+            fht_chunk<K, V, Slots> * const chunk = t.chunks + chunk_idx;
+            chunk_lock = lock_t(this->_chunk_stripe(chunk_idx).chunk_lock);
+
+            bool has_empty;
+            idx = t._find_in_chunk(chunk, key, raw_slot, has_empty, isa);
+            if (idx != FHT_CHUNK_SLOTS) {
+                return chunk;
+            }
+            chunk_lock.unlock();
+            if (has_empty) {
+                break;
+            }
+            ++k;
+            chunk_idx = FHT_NEXT_CHUNK(chunk_idx, k, chunk_mask);
+        }
+        return NULL;
+    }
 
-                    // if j + 1 was done set it back
-                    if (old_start_to_move[(j + 1) & FHT_MM_LINE_MASK]) {
-                        to_move |= ((1u) << ((j + 1) & FHT_MM_LINE_MASK));
+    // _find_locked() that adds the key (without its value) if it isn't in
+    // the table. added is set if it wasn't
+    template<typename Isa>
+    fht_chunk<K, V, Slots> *
+    _add_locked(const K &         new_key,
+                const hash_type_t raw_slot,
+                uint32_t &        idx,
+                bool &            added,
+                lock_t &          chunk_lock,
+                const Isa         isa) {
+        for (;;) {
+            lock_t         key_lock(this->_key_stripe(raw_slot).key_lock);
+            table_t &      t        = this->table;
+            const uint32_t log_incr = t.log_incr;
+            if (__builtin_expect(this->size() >= t.grow_npairs, 0)) {
+                key_lock.unlock();
+                this->_grow(log_incr, isa);
+                continue;
+            }
+            const uint32_t chunk_mask = FHT_CHUNK_MASK(log_incr);
+            uint32_t       chunk_idx  = FHT_HASH_TO_IDX(raw_slot, log_incr);
+
+            // same probe as _add but what a chunk looked like can only be
+            // trusted while it is locked. So if the first free slot isn't in
+            // the chunk the duplicate check stopped at there is a 2nd pass
+            // from the chunk it was in (nothing else can add this key while
+            // key_lock is held)
+            uint32_t free_k = chunk_mask + 1, free_chunk_idx = 0, k;
+            for (k = 0; k <= chunk_mask;) {
+                fht_chunk<K, V, Slots> * const chunk = t.chunks + chunk_idx;
+                chunk_lock = lock_t(this->_chunk_stripe(chunk_idx).chunk_lock);
+
+                bool has_empty;
+                idx =
+                    t._find_in_chunk(chunk, new_key, raw_slot, has_empty, isa);
+                if (idx != FHT_CHUNK_SLOTS) {
+                    added = false;
+                    return chunk;
+                }
+                if (free_k > chunk_mask) {
+                    idx = t._free_in_chunk(chunk, raw_slot, isa);
+                    if (idx != FHT_CHUNK_SLOTS) {
+                        if (__builtin_expect(has_empty, 1)) {
+                            added = true;
+                            this->_place(chunk, idx, raw_slot, new_key);
+                            return chunk;
+                        }
+                        free_k         = k;
+                        free_chunk_idx = chunk_idx;
                     }
-                    old_start_to_move[j] = 0;
-                    to_move ^= ((1u) << j);
                 }
-                else if (__builtin_expect(!old_start_to_move[j], 1)) {
-                    to_move ^= ((1u) << j);
+                chunk_lock.unlock();
+                if (has_empty ||
+                    (free_k > chunk_mask && k == FHT_MAX_OVERFLOW_CHUNKS)) {
+                    break;
                 }
+                ++k;
+                chunk_idx = FHT_NEXT_CHUNK(chunk_idx, k, chunk_mask);
             }
+
+            // chunks between can have filled up since but then the key can
+            // still be found past them
+            const uint32_t last_k =
+                k > FHT_MAX_OVERFLOW_CHUNKS ? k : FHT_MAX_OVERFLOW_CHUNKS;
+            chunk_idx = free_chunk_idx;
+            for (k = free_k; k <= last_k && k <= chunk_mask;) {
+                fht_chunk<K, V, Slots> * const chunk = t.chunks + chunk_idx;
+                chunk_lock = lock_t(this->_chunk_stripe(chunk_idx).chunk_lock);
+
+                idx = t._free_in_chunk(chunk, raw_slot, isa);
+                if (idx != FHT_CHUNK_SLOTS) {
+                    added = true;
+                    this->_place(chunk, idx, raw_slot, new_key);
+                    return chunk;
+                }
+                chunk_lock.unlock();
+                ++k;
+                chunk_idx = FHT_NEXT_CHUNK(chunk_idx, k, chunk_mask);
+            }
+
+            // nowhere close enough to the home chunk to put it
+            key_lock.unlock();
+            this->_grow(log_incr, isa);
         }
     }
 
-    // standard rehash which copies all elements
-    template<typename _K         = K,
-             typename _V         = V,
-             typename _Hasher    = Hasher,
-             typename _Allocator = Allocator>
-    typename std::enable_if<
-        !(std::is_same<_Allocator, INPLACE_MMAP_ALLOC<_K, _V>>::value),
-        void>::type
-    rehash() {
-
-        // incr table log
-        const uint32_t                _new_log_incr = ++(this->log_incr);
-        const fht_chunk<K, V> * const old_chunks    = this->chunks;
+    inline void
+    _place(fht_chunk<K, V, Slots> * const chunk,
+           const uint32_t          idx,
+           const hash_type_t       raw_slot,
+           const K &               new_key) {
+        if (chunk->is_erased_n(idx)) {
+            __atomic_sub_fetch(&(this->table.nerased), 1, __ATOMIC_RELAXED);
+        }
+        this->table._place_key(chunk, idx, raw_slot, new_key);
+        __atomic_add_fetch(&(this->table.npairs), 1, __ATOMIC_RELAXED);
+    }
 
+    // unless another thread already did since log_incr was seen
+    template<typename Isa>
+    void
+    _grow(const uint32_t log_incr, const Isa) {
+        fht_isa_run<Isa>::run_cold([&](const Isa cold_isa) {
+            this->_with_all_locked([&]() {
+                if (this->table.log_incr == log_incr) {
+                    this->table._rehash(cold_isa);
+                }
+            });
+        });
+    }
 
-        const uint32_t _num_chunks =
-            ((1u) << (_new_log_incr - 1)) / FHT_TAGS_PER_CLINE;
+    template<typename Isa>
+    uint64_t
+    _erase(key_pass_t key, const hash_type_t raw_slot, const Isa isa) {
+        // checked while the chunk is still locked (a purge can be changing
+        // nerased otherwise)
+        bool shrink_or_purge;
+        {
+            lock_t                  chunk_lock;
+            uint32_t                idx;
+            table_t &               t = this->table;
+            fht_chunk<K, V, Slots> * const chunk =
+                this->_find_locked(key, raw_slot, idx, chunk_lock, isa);
+            if (chunk == NULL) {
+                return FHT_NOT_ERASED;
+            }
+            const uint64_t nerased =
+                t._erase_in_chunk(chunk, idx, isa)
+                    ? __atomic_add_fetch(&(t.nerased), 1, __ATOMIC_RELAXED)
+                    : __atomic_load_n(&(t.nerased), __ATOMIC_RELAXED);
+            const uint64_t npairs =
+                __atomic_sub_fetch(&(t.npairs), 1, __ATOMIC_RELAXED);
+            shrink_or_purge =
+                npairs < t.min_npairs || nerased > t.max_nerased;
+        }
 
-        // allocate new chunk array
-        fht_chunk<K, V> * const new_chunks =
-            this->alloc_mmap.allocate(2 * _num_chunks);
+        // same as _erase_key once nothing is locked
+        if (__builtin_expect(shrink_or_purge, 0)) {
+            fht_isa_run<Isa>::run_cold([&](const Isa cold_isa) {
+                this->_with_all_locked([&]() {
+                    table_t & t = this->table;
+                    if (t.npairs < t.min_npairs) {
+                        t._shrink_to(t.log_incr - 1, cold_isa);
+                    }
+                    else if (t.nerased > t.max_nerased) {
+                        t._purge_tombstones(cold_isa);
+                    }
+                });
+            });
+        }
+        return FHT_ERASED;
+    }
+};
 
-        // set this while its definetly still in cache
-        this->chunks = new_chunks;
+//////////////////////////////////////////////////////////////////////
+// Table with one writer and any number of readers where readers never lock
+// or write anything shared. Every chunk has a version (in an array next to
+// the chunks) the writer makes odd while it changes the chunk and even again
+// after. A reader copies what it needs out of a chunk and goes again if the
+// version was odd or changed (seqlock) so K and V have to be trivially
+// copyable (a reader can see half of a write, it just never uses it).
+// Growing builds a new table and versions and publishes them in one pointer.
+// The old ones can still be in use by readers so they are kept until
+// reclaim() / the destructor (readers don't say when they are done). So that
+// is bounded it only ever grows: erases never shrink the table or purge its
+// tombstones (adds reuse them and growing drops them). Each kept table is at
+// most half the next so together they never take more than the current one
+
+// readers read chunks while the writer changes them (and throw away what
+// they read if it did). Tell tsan that is on purpose
+#if defined(__SANITIZE_THREAD__)
+#define FHT_TSAN
+#elif defined(__has_feature)
+#if __has_feature(thread_sanitizer)
+#define FHT_TSAN
+#endif
+#endif
 
+#ifdef FHT_TSAN
+extern "C" void AnnotateIgnoreReadsBegin(const char * file, int line);
+extern "C" void AnnotateIgnoreReadsEnd(const char * file, int line);
+#define FHT_RACY_READS_BEGIN() AnnotateIgnoreReadsBegin(__FILE__, __LINE__)
+#define FHT_RACY_READS_END()   AnnotateIgnoreReadsEnd(__FILE__, __LINE__)
+#else
+#define FHT_RACY_READS_BEGIN()
+#define FHT_RACY_READS_END()
+#endif
 
-        // iterate through all chunks and re-place nodes
-        for (uint32_t i = 0; i < _num_chunks; ++i) {
-            uint8_t new_slot_idx[2][FHT_MM_LINE] = { { 0 }, { 0 } };
+template<typename K,
+         typename V,
+         typename Hasher = fht_default_hash<K, V>,
+         uint32_t Slots  = fht_chunk_slots<K, V>::value>
+struct fht_seqlock_table {
+    typedef fht_table<K, V, Hasher, DEFAULT_ALLOC<K, V>, Slots> table_t;
+    typedef typename table_t::hash_type_t                hash_type_t;
+    typedef typename table_t::key_pass_t                 key_pass_t;
+    typedef typename table_t::tag_t                      tag_t;
+
+    static_assert(std::is_trivially_copyable<K>::value &&
+                      std::is_trivially_copyable<V>::value,
+                  "readers can see half written keys / values");
+
+    // a table and its chunk versions. Nothing but the writer's adds /
+    // erases (under the versions) changes it once it is published. Versions
+    // are only made once the table is done changing size (see _rebuild)
+    struct snapshot_t {
+        table_t                 table;
+        std::atomic<uint32_t> * versions;
+
+        snapshot_t(const uint64_t init_size)
+            : table(init_size), versions(NULL) {}
+
+        void
+        init_versions() {
+            this->versions =
+                new std::atomic<uint32_t>[this->table.num_chunks()]();
+        }
+        ~snapshot_t() {
+            delete[] this->versions;
+        }
+    };
 
-            const fht_chunk<K, V> * const old_chunk = old_chunks + i;
+    std::atomic<snapshot_t *> cur;
+    std::vector<snapshot_t *> retired;
 
+    //////////////////////////////////////////////////////////////////////
+    fht_seqlock_table(const uint64_t init_size) {
+        snapshot_t * const s = new snapshot_t(init_size);
+        fht_growth_policy  growth = s->table.growth_policy();
+        growth.min_load           = 0.0;
+        growth.max_erased         = 0.0;
+        growth.migrate_chunks     = 0;
+        s->table.growth_policy(growth);
+        s->init_versions();
+        this->cur.store(s, std::memory_order_relaxed);
+    }
+    fht_seqlock_table() : fht_seqlock_table(FHT_DEFAULT_INIT_SIZE) {}
 
-            // which one is optimal here really depends on the quality of the
-            // hash function.
+    fht_seqlock_table(const fht_seqlock_table &) = delete;
+    fht_seqlock_table & operator=(const fht_seqlock_table &) = delete;
 
-            for (uint32_t j_idx = 0; j_idx < FHT_TAGS_PER_CLINE; j_idx++) {
-                if (old_chunk->resize_skip_n((const uint32_t)j_idx)) {
-                    continue;
-                }
+    ~fht_seqlock_table() {
+        this->reclaim();
+        delete this->cur.load(std::memory_order_relaxed);
+    }
 
-                const hash_type_t raw_slot =
-                    this->hash(old_chunk->get_key_n((const uint32_t)j_idx));
-                const uint32_t start_idx = FHT_GEN_START_IDX(raw_slot);
-                const uint32_t nth_bit =
-                    FHT_GET_NTH_BIT(raw_slot, _new_log_incr - 1);
+    inline uint64_t
+    size() const {
+        return __atomic_load_n(
+            &(this->cur.load(std::memory_order_acquire)->table.npairs),
+            __ATOMIC_RELAXED);
+    }
 
-                // 50 50 of hashing to same slot or slot + .5 * new table size
-                fht_chunk<K, V> * const new_chunk =
-                    new_chunks + (i | (nth_bit ? _num_chunks : 0));
+    inline bool
+    empty() const {
+        return !(this->size());
+    }
 
-                // place new node w.o duplicate check
-                for (uint32_t new_j = 0; new_j < FHT_MM_ITER_LINE; ++new_j) {
-                    const uint32_t outer_idx =
-                        (new_j + start_idx) & FHT_MM_LINE_MASK;
+    //////////////////////////////////////////////////////////////////////
+    // readers
+
+    // copies key's value to val if its in the table
+    inline bool
+    find(key_pass_t key, V & val) const {
+        const snapshot_t * const s = this->cur.load(std::memory_order_acquire);
+        return fht_isa_dispatch<key_pass_t, hash_type_t>(
+            [this, s, &val](auto isa, key_pass_t k, const hash_type_t h) {
+                return this->_find(s, k, h, &val, isa);
+            },
+            key,
+            s->table.hash(key));
+    }
 
-                    if (__builtin_expect(
-                            new_slot_idx[nth_bit][outer_idx] != FHT_MM_IDX_MULT,
-                            1)) {
-                        const uint32_t true_idx =
-                            FHT_MM_IDX_MULT * outer_idx +
-                            new_slot_idx[nth_bit][outer_idx];
+    inline uint64_t
+    count(key_pass_t key) const {
+        const snapshot_t * const s = this->cur.load(std::memory_order_acquire);
+        return fht_isa_dispatch<key_pass_t, hash_type_t>(
+            [this, s](auto isa, key_pass_t k, const hash_type_t h) {
+                return (uint64_t)this->_find(s, k, h, (V *)NULL, isa);
+            },
+            key,
+            s->table.hash(key));
+    }
 
-                        new_chunk->set_tag_n(
-                            true_idx,
-                            old_chunk->get_tag_n((const uint32_t)j_idx));
-                        NEW(K,
-                            *(new_chunk->get_key_n_ptr(true_idx)),
-                            std::move(*(old_chunk->get_key_n_ptr(
-                                (const uint32_t)j_idx))));
-                        NEW(V,
-                            *(new_chunk->get_val_n_ptr(true_idx)),
-                            std::move(*(old_chunk->get_val_n_ptr(
-                                (const uint32_t)j_idx))));
+    inline bool
+    contains(key_pass_t key) const {
+        return this->count(key);
+    }
 
-                        new_slot_idx[nth_bit][outer_idx]++;
-                        break;
+    template<typename Isa>
+    bool
+    _find(const snapshot_t * const s,
+          key_pass_t               key,
+          const hash_type_t        raw_slot,
+          V * const                val,
+          const Isa                isa) const {
+        const table_t & t          = s->table;
+        const uint32_t  chunk_mask = FHT_CHUNK_MASK(t.log_incr);
+        uint32_t        chunk_idx  = FHT_HASH_TO_IDX(raw_slot, t.log_incr);
+
+        // value is copied out before the version is checked again
+        typename std::aligned_storage<sizeof(V), alignof(V)>::type found_val;
+        for (uint32_t k = 0; k <= chunk_mask;) {
+            const fht_chunk<K, V, Slots> * const chunk = t.chunks + chunk_idx;
+            const std::atomic<uint32_t> &        version =
+                s->versions[chunk_idx];
+
+            bool     has_empty;
+            uint32_t idx;
+            for (uint32_t i = 0;; ++i) {
+                const uint32_t start_version =
+                    version.load(std::memory_order_acquire);
+                if (__builtin_expect(start_version & 1, 0)) {
+                    // same as fht_spin_lock in case the writer isn't running
+                    if (i < FHT_SPIN_PAUSES) {
+                        _mm_pause();
+                    }
+                    else {
+                        std::this_thread::yield();
                     }
+                    continue;
                 }
-            }
-            // set remaining to INVALID_MASK
-            for (uint32_t j = 0; j < FHT_MM_LINE; ++j) {
-                for (uint32_t _j = new_slot_idx[0][j]; _j < FHT_MM_IDX_MULT;
-                     ++_j) {
-                    new_chunks[i].set_tag_n(FHT_MM_IDX_MULT * j + _j,
-                                            INVALID_MASK);
+                FHT_RACY_READS_BEGIN();
+                idx = t._find_in_chunk(chunk, key, raw_slot, has_empty, isa);
+                if (idx != FHT_CHUNK_SLOTS && val != NULL) {
+                    memcpy(&found_val, chunk->get_val_n_ptr(idx), sizeof(V));
+                }
+                FHT_RACY_READS_END();
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (__builtin_expect(
+                        version.load(std::memory_order_relaxed) ==
+                            start_version,
+                        1)) {
+                    break;
                 }
             }
-            for (uint32_t j = 0; j < FHT_MM_LINE; ++j) {
-                for (uint32_t _j = new_slot_idx[1][j]; _j < FHT_MM_IDX_MULT;
-                     ++_j) {
-                    new_chunks[i | _num_chunks].set_tag_n(
-                        FHT_MM_IDX_MULT * j + _j,
-                        INVALID_MASK);
+            if (idx != FHT_CHUNK_SLOTS) {
+                if (val != NULL) {
+                    memcpy(val, &found_val, sizeof(V));
                 }
+                return true;
+            }
+            if (has_empty) {
+                return false;
             }
+            ++k;
+            chunk_idx = FHT_NEXT_CHUNK(chunk_idx, k, chunk_mask);
         }
-        // deallocate old table
-        this->alloc_mmap.deallocate(
-            (fht_chunk<K, V> * const)old_chunks,
-            (((1u) << (_new_log_incr - 1)) / FHT_TAGS_PER_CLINE));
+        return false;
     }
 
-
     //////////////////////////////////////////////////////////////////////
-    // add new key value pair stuff
+    // writer. Only one thread at a time
 
-    // slightly different logic than emplace...
+    // true if key wasn't in the table
     template<typename... Args>
-    inline std::pair<fht_iterator, bool>
-    insert_or_assign(key_pass_t new_key, Args &&... args) {
-        // slightly different logic than emplace...
-        const uint64_t          res        = (const uint64_t)add(new_key);
-        fht_chunk<K, V> * const temp_chunk = (fht_chunk<K, V> * const)(
-            res & (~(((1UL) << 48) | (FHT_TAGS_PER_CLINE - 1))));
+    bool
+    emplace(key_pass_t new_key, Args &&... args) {
+        const hash_type_t raw_slot = this->_writer_cur()->table.hash(new_key);
+        return fht_isa_dispatch([&](auto isa) {
+            uint32_t          chunk_idx, idx;
+            bool              added;
+            snapshot_t * const s =
+                this->_add(new_key, raw_slot, chunk_idx, idx, added, isa);
+            if (added) {
+                fht_chunk<K, V, Slots> * const chunk =
+                    s->table.chunks + chunk_idx;
+                this->_write_begin(s, chunk_idx);
+                this->_place(s, chunk, idx, raw_slot, new_key);
+                NEW(V,
+                    *(chunk->get_val_n_ptr(idx)),
+                    std::forward<Args>(args)...);
+                this->_write_end(s, chunk_idx);
+            }
+            return added;
+        });
+    }
 
-        NEW(V,
-            *(temp_chunk->get_val_n_ptr(res & (FHT_TAGS_PER_CLINE - 1))),
-            std::forward<Args>(args)...);
+    // sets key's value whether or not it was in the table. true if it wasn't
+    bool
+    insert_or_assign(key_pass_t new_key, const V & new_val) {
+        const hash_type_t raw_slot = this->_writer_cur()->table.hash(new_key);
+        return fht_isa_dispatch([&](auto isa) {
+            uint32_t          chunk_idx, idx;
+            bool              added;
+            snapshot_t * const s =
+                this->_add(new_key, raw_slot, chunk_idx, idx, added, isa);
+            fht_chunk<K, V, Slots> * const chunk = s->table.chunks + chunk_idx;
+            this->_write_begin(s, chunk_idx);
+            if (added) {
+                this->_place(s, chunk, idx, raw_slot, new_key);
+            }
+            NEW(V, *(chunk->get_val_n_ptr(idx)), new_val);
+            this->_write_end(s, chunk_idx);
+            return added;
+        });
+    }
 
-        return std::pair<fht_iterator, bool>(
-            fht_iterator((const int8_t * const)(res & (~((1UL) << 48)))),
-            (!(res & (((1UL) << 48)))));
+    uint64_t
+    erase(key_pass_t key) {
+        return fht_isa_dispatch<key_pass_t, hash_type_t>(
+            [this](auto isa, key_pass_t k, const hash_type_t h) {
+                return this->_erase(k, h, isa);
+            },
+            key,
+            this->_writer_cur()->table.hash(key));
     }
 
-    template<typename... Args>
-    inline constexpr std::pair<fht_iterator, bool>
-    insert(key_pass_t new_key, Args &&... args) {
-        return emplace(new_key, std::forward<Args>(args)...);
+    // frees tables replaced by growing. Only once every reader that could
+    // have started before the last one was published is done
+    void
+    reclaim() {
+        for (snapshot_t * const s : this->retired) {
+            delete s;
+        }
+        this->retired.clear();
     }
 
     //////////////////////////////////////////////////////////////////////
-    // Its probably a bad idea to use either of these inserts
-    inline constexpr std::pair<fht_iterator, bool>
-    insert(const std::pair<const K, V> & bad_pair) {
-        return insert(bad_pair.first, bad_pair.second);
+    inline snapshot_t *
+    _writer_cur() const {
+        // only the writer changes cur
+        return this->cur.load(std::memory_order_relaxed);
     }
 
+    inline void
+    _write_begin(snapshot_t * const s, const uint32_t chunk_idx) {
+        std::atomic<uint32_t> & version = s->versions[chunk_idx];
+        version.store(version.load(std::memory_order_relaxed) + 1,
+                      std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
 
     inline void
-    insert(std::initializer_list<const std::pair<const K, V>> ilist) {
+    _write_end(snapshot_t * const s, const uint32_t chunk_idx) {
+        std::atomic<uint32_t> & version = s->versions[chunk_idx];
+        version.store(version.load(std::memory_order_relaxed) + 1,
+                      std::memory_order_release);
+    }
 
-        // supposedly this is a few assembly ops faster than:
-        // for(it = begin(); it != end(); ++it)
-        // but you really should never be using this.
-        for (auto p : ilist) {
-            emplace(p.first, p.second);
+    // chunk (and slot) key is in, FHT_CHUNK_SLOTS if it isn't in the table.
+    // Writer only so no versions
+    template<typename Isa>
+    uint32_t
+    _find_slot(const snapshot_t * const s,
+               key_pass_t               key,
+               const hash_type_t        raw_slot,
+               uint32_t &               chunk_idx,
+               const Isa                isa) const {
+        const table_t & t          = s->table;
+        const uint32_t  chunk_mask = FHT_CHUNK_MASK(t.log_incr);
+        chunk_idx                  = FHT_HASH_TO_IDX(raw_slot, t.log_incr);
+        for (uint32_t k = 0; k <= chunk_mask;) {
+            bool           has_empty;
+            const uint32_t idx = t._find_in_chunk(t.chunks + chunk_idx,
+                                                  key,
+                                                  raw_slot,
+                                                  has_empty,
+                                                  isa);
+            if (idx != FHT_CHUNK_SLOTS || has_empty) {
+                return idx;
+            }
+            ++k;
+            chunk_idx = FHT_NEXT_CHUNK(chunk_idx, k, chunk_mask);
         }
+        return FHT_CHUNK_SLOTS;
     }
-    //////////////////////////////////////////////////////////////////////
 
+    // where key is or (if added is set) the free slot it goes in. Grows
+    // first if it has to so returns the table that is current after
+    template<typename Isa>
+    snapshot_t *
+    _add(const K &         new_key,
+         const hash_type_t raw_slot,
+         uint32_t &        chunk_idx,
+         uint32_t &        idx,
+         bool &            added,
+         const Isa         isa) {
+        for (;;) {
+            snapshot_t * const s = this->_writer_cur();
+            table_t &          t = s->table;
+            if (__builtin_expect(t.npairs >= t.grow_npairs, 0)) {
+                this->_rebuild(2 * t.max_size(), isa);
+                continue;
+            }
 
-    // at some point I will try and implement google's shit where they try
-    // and find a key argument in pair arguments
-    template<typename... Args>
-    inline constexpr std::pair<fht_iterator, bool>
-    emplace(Args &&... args) {
-        return insert(std::forward<Args>(args)...);
-    }
+            // same probe as _add. Single writer so the first free slot is
+            // still free once the duplicate check is done
+            const uint32_t chunk_mask = FHT_CHUNK_MASK(t.log_incr);
+            uint32_t       free_chunk_idx = 0, free_idx = FHT_CHUNK_SLOTS;
+            chunk_idx = FHT_HASH_TO_IDX(raw_slot, t.log_incr);
+            for (uint32_t k = 0; k <= chunk_mask;) {
+                const fht_chunk<K, V, Slots> * const chunk =
+                    t.chunks + chunk_idx;
+
+                bool has_empty;
+                idx =
+                    t._find_in_chunk(chunk, new_key, raw_slot, has_empty, isa);
+                if (idx != FHT_CHUNK_SLOTS) {
+                    added = false;
+                    return s;
+                }
+                if (free_idx == FHT_CHUNK_SLOTS) {
+                    free_idx       = t._free_in_chunk(chunk, raw_slot, isa);
+                    free_chunk_idx = chunk_idx;
+                }
+                if (has_empty || (free_idx == FHT_CHUNK_SLOTS &&
+                                  k == FHT_MAX_OVERFLOW_CHUNKS)) {
+                    break;
+                }
+                ++k;
+                chunk_idx = FHT_NEXT_CHUNK(chunk_idx, k, chunk_mask);
+            }
+            if (__builtin_expect(free_idx != FHT_CHUNK_SLOTS, 1)) {
+                added     = true;
+                chunk_idx = free_chunk_idx;
+                idx       = free_idx;
+                return s;
+            }
 
-    template<typename... Args>
-    inline std::pair<fht_iterator, bool>
-    emplace(key_pass_t new_key, Args &&... args) {
-        // for now going to force explicit key & value
-        const uint64_t res = (const uint64_t)add(new_key);
-        if (res & ((1UL) << 48)) {
-            return std::pair<fht_iterator, bool>(this->end(), false);
-        }
-        else {
-            fht_chunk<K, V> * const temp_chunk =
-                (fht_chunk<K, V> * const)(res & (~(FHT_TAGS_PER_CLINE - 1)));
-            NEW(V,
-                *(temp_chunk->get_val_n_ptr(res & ((FHT_TAGS_PER_CLINE - 1)))),
-                std::forward<Args>(args)...);
-            return (
-                std::pair<fht_iterator, bool>(fht_iterator((const int8_t *)res),
-                                              true));
+            // nowhere close enough to the home chunk to put it
+            this->_rebuild(2 * t.max_size(), isa);
         }
     }
 
-    inline constexpr V & operator[](const K & key) {
-        const uint64_t res = ((const uint64_t)add(key)) & (~(((1UL) << 48)));
-        fht_chunk<K, V> * const temp_chunk =
-            (fht_chunk<K, V> * const)(res & (~(FHT_TAGS_PER_CLINE - 1)));
-        return *(
-            V *)(temp_chunk->get_val_n_ptr(res & (FHT_TAGS_PER_CLINE - 1)));
-    }
-
-    inline constexpr V & operator[](K && key) {
-        const uint64_t res =
-            ((const uint64_t)add(std::move(key))) & (~(((1UL) << 48)));
-        fht_chunk<K, V> * const temp_chunk =
-            (fht_chunk<K, V> * const)(res & (~(FHT_TAGS_PER_CLINE - 1)));
-        return *(
-            V *)(temp_chunk->get_val_n_ptr(res & (FHT_TAGS_PER_CLINE - 1)));
+    inline void
+    _place(snapshot_t * const      s,
+           fht_chunk<K, V, Slots> * const chunk,
+           const uint32_t          idx,
+           const hash_type_t       raw_slot,
+           const K &               new_key) {
+        if (chunk->is_erased_n(idx)) {
+            __atomic_sub_fetch(&(s->table.nerased), 1, __ATOMIC_RELAXED);
+        }
+        s->table._place_key(chunk, idx, raw_slot, new_key);
+        __atomic_add_fetch(&(s->table.npairs), 1, __ATOMIC_RELAXED);
     }
 
-    const int8_t *
-    add(const K & new_key) {
-        // get all derferncing of this out of the way
-        const hash_type_t raw_slot = this->hash(new_key);
-
-        fht_chunk<K, V> * const chunk = (fht_chunk<K, V> * const)(
-            (this->chunks) + (FHT_HASH_TO_IDX(raw_slot, this->log_incr)));
-        __builtin_prefetch(chunk);
-
-        // get tag and start_idx from raw_slot
-        const uint32_t start_idx = FHT_GEN_START_IDX(raw_slot);
-
-        prefetch<K>((const void * const)(
-            chunk->get_key_n_ptr((FHT_MM_IDX_MULT * start_idx))));
-
-        const int8_t tag = FHT_GEN_TAG(raw_slot);
-
-        // check for valid slot or duplicate
-        uint32_t idx, slot_mask, erase_idx = FHT_TAGS_PER_CLINE;
-        for (uint32_t j = 0; j < FHT_MM_ITER_LINE; ++j) {
-            const uint32_t outer_idx = (j + start_idx) & FHT_MM_LINE_MASK;
-
-            slot_mask = chunk->get_tag_matches(tag, outer_idx);
-
-            if (slot_mask) {
-                node_prefetch<K>(slot_mask,
-                                 (const int8_t * const)(chunk->get_key_n_ptr(
-                                     (FHT_MM_IDX_MULT * outer_idx))));
-
-                do {
-                    __asm__("tzcnt %1, %0" : "=r"((idx)) : "rm"((slot_mask)));
-                    const uint32_t true_idx = FHT_MM_IDX_MULT * outer_idx + idx;
+    template<typename Isa>
+    uint64_t
+    _erase(key_pass_t key, const hash_type_t raw_slot, const Isa isa) {
+        snapshot_t * const s = this->_writer_cur();
+        table_t &          t = s->table;
+        uint32_t           chunk_idx;
+        const uint32_t idx = this->_find_slot(s, key, raw_slot, chunk_idx, isa);
+        if (idx == FHT_CHUNK_SLOTS) {
+            return FHT_NOT_ERASED;
+        }
 
-                    if (__builtin_expect(
-                            (chunk->compare_key_n(true_idx, new_key)),
-                            1)) {
-                        return (const int8_t * const)(
-                            ((((const uint64_t)chunk) + true_idx) |
-                             ((1UL) << 48)));
-                    }
+        this->_write_begin(s, chunk_idx);
+        if (t._erase_in_chunk(t.chunks + chunk_idx, idx, isa)) {
+            __atomic_add_fetch(&(t.nerased), 1, __ATOMIC_RELAXED);
+        }
+        this->_write_end(s, chunk_idx);
+        __atomic_sub_fetch(&(t.npairs), 1, __ATOMIC_RELAXED);
+        return FHT_ERASED;
+    }
 
-                    slot_mask ^= ((1u) << idx);
-                } while (slot_mask);
+    // copies everything into a new table of new_size slots and publishes it
+    template<typename Isa>
+    void
+    _rebuild(const uint64_t new_size, const Isa) {
+        fht_isa_run<Isa>::run_cold([&](const Isa) {
+            snapshot_t * const old = this->_writer_cur();
+            snapshot_t * const s   = new snapshot_t(new_size);
+            s->table.growth_policy(old->table.growth_policy());
+            // the fill can still grow the new table (i.e a chunk overflows)
+            // so its versions are sized after
+            for (auto it = old->table.begin(); it != old->table.end(); ++it) {
+                s->table.emplace(it->first, it->second);
             }
+            s->init_versions();
+            this->cur.store(s, std::memory_order_release);
+            this->retired.push_back(old);
+        });
+    }
+};
 
-            // we always go here 1st loop (where most add calls find a slot)
-            // and if no deleted elements alwys go here as well
-            if (__builtin_expect(erase_idx & FHT_TAGS_PER_CLINE, 1)) {
-                const uint32_t _slot_mask =
-                    chunk->get_empty_or_erased(outer_idx);
-                if (__builtin_expect(_slot_mask, 1)) {
-                    __asm__("tzcnt %1, %0" : "=r"((idx)) : "rm"((_slot_mask)));
-                    erase_idx = FHT_MM_IDX_MULT * outer_idx + idx;
-
-                    // some tunable param here would be useful
-                    if (__builtin_expect((!chunk->is_erased_n(erase_idx)) ||
-                                             chunk->get_empty(outer_idx),
-                                         1)) {
-
-                        chunk->set_tag_n(erase_idx, tag);
-                        NEW(K,
-                            *(chunk->get_key_n_ptr(erase_idx)),
-                            std::move(new_key));
-                        ++this->npairs;
-                        return ((const int8_t * const)chunk) + erase_idx;
-                    }
+//////////////////////////////////////////////////////////////////////
+// Insert only table for use from multiple threads where adds and finds take
+// no locks. An add claims the first empty slot of its probe by CAS'ing the
+// tag from INVALID_MASK to BUSY_MASK, writes the key and value and then
+// publishes the real tag (release, a find loads a matching tag again with
+// acquire before it looks at the key). Finds skip busy slots.
+// Slots only ever go empty -> busy -> key (or tombstone) so everything before
+// a claimed slot in its probe was already taken when it was claimed. That is
+// how adds of the same key at once are resolved: before publishing, an add
+// looks for the key in every slot before its own (waiting on busy ones) and
+// if it is there turns its slot into a tombstone instead. The earliest slot
+// wins and never waits on a later one. There is no erase, it would break
+// that. Growing (and reserve / rehash) still stops everything: each thread
+// has a stripe (cache line) counting the ops it has going, a grow tells new
+// ops to wait and then waits for those to drain. Counts are kept per stripe
+// too so with up to Stripes threads an op only writes to a shared line in
+// its chunk. Hasher has to be callable from all threads at once
+template<typename K,
+         typename V,
+         uint32_t Stripes,
+         typename Hasher    = fht_default_hash<K, V>,
+         typename Allocator = DEFAULT_ALLOC<K, V>,
+         uint32_t Slots     = fht_chunk_slots<K, V>::value>
+struct fht_cas_table {
+    typedef fht_table<K, V, Hasher, Allocator, Slots> table_t;
+    typedef typename table_t::hash_type_t      hash_type_t;
+    typedef typename table_t::key_pass_t       key_pass_t;
+    typedef typename table_t::tag_t            tag_t;
+    typedef typename table_t::mask_t           mask_t;
+
+    static_assert(Stripes && !(Stripes & (Stripes - 1)),
+                  "Stripes has to be a power of 2");
+
+    // npairs / nerased are what the stripe's threads added since the table's
+    // counts were last brought up to date (see _with_all_stopped)
+    struct alignas(L1_CACHE_LINE_SIZE) stripe_t {
+        std::atomic<uint32_t> nactive;
+        std::atomic<uint64_t> npairs;
+        std::atomic<uint64_t> nerased;
+
+        stripe_t() : nactive(0), npairs(0), nerased(0) {}
+    };
+
+    table_t               table;
+    stripe_t *            stripes;
+    std::atomic<uint32_t> stopping;
+    std::mutex            stop_lock;
+
+    // the calling thread has an op going from when this is made until it
+    // goes away. Waits out a stop that has already started
+    struct active_t {
+        stripe_t & stripe;
+
+        active_t(const fht_cas_table & t) : stripe(t._thread_stripe()) {
+            for (;;) {
+                this->stripe.nactive.fetch_add(1, std::memory_order_seq_cst);
+                if (__builtin_expect(
+                        !t.stopping.load(std::memory_order_seq_cst),
+                        1)) {
+                    return;
                 }
-            }
-            else if (chunk->get_empty(outer_idx)) {
-                chunk->set_tag_n(erase_idx, tag);
-                NEW(K, *(chunk->get_key_n_ptr(erase_idx)), std::move(new_key));
-
-                ++this->npairs;
-                return ((const int8_t * const)chunk) + erase_idx;
+                this->stripe.nactive.fetch_sub(1, std::memory_order_release);
+                _wait_while([&]() {
+                    return t.stopping.load(std::memory_order_acquire);
+                });
             }
         }
-        ++this->npairs;
-        if (erase_idx != FHT_TAGS_PER_CLINE) {
-            chunk->set_tag_n(erase_idx, tag);
-            NEW(K, *(chunk->get_key_n_ptr(erase_idx)), std::move(new_key));
-
-            return ((const int8_t * const)chunk) + erase_idx;
+        ~active_t() {
+            this->stripe.nactive.fetch_sub(1, std::memory_order_release);
         }
 
-        // no valid slot found so rehash
-        this->rehash();
+        active_t(const active_t &) = delete;
+        active_t & operator=(const active_t &) = delete;
+    };
 
-        fht_chunk<K, V> * const new_chunk = (fht_chunk<K, V> * const)(
-            this->chunks + FHT_HASH_TO_IDX(raw_slot, this->log_incr));
-
-
-        // after rehash add without duplication check
-        for (uint32_t j = 0; j < FHT_MM_ITER_LINE; ++j) {
-            const uint32_t outer_idx  = (j + start_idx) & FHT_MM_LINE_MASK;
-            const uint32_t _slot_mask = new_chunk->get_empty(outer_idx);
+    //////////////////////////////////////////////////////////////////////
+    fht_cas_table(const uint64_t init_size) : table(init_size), stopping(0) {
+        fht_growth_policy growth = this->table.growth_policy();
+        growth.migrate_chunks    = 0;
+        this->table.growth_policy(growth);
+
+        this->stripes = (stripe_t *)aligned_alloc(L1_CACHE_LINE_SIZE,
+                                                  Stripes * sizeof(stripe_t));
+        for (uint32_t i = 0; i < Stripes; ++i) {
+            NEW(stripe_t, this->stripes[i], );
+        }
+    }
+    fht_cas_table() : fht_cas_table(FHT_DEFAULT_INIT_SIZE) {}
 
-            if (__builtin_expect(_slot_mask, 1)) {
-                __asm__("tzcnt %1, %0" : "=r"((idx)) : "rm"((_slot_mask)));
-                const uint32_t true_idx = FHT_MM_IDX_MULT * outer_idx + idx;
-                new_chunk->set_tag_n(true_idx, tag);
-                NEW(K,
-                    *(new_chunk->get_key_n_ptr(true_idx)),
-                    std::move(new_key));
+    fht_cas_table(const fht_cas_table &) = delete;
+    fht_cas_table & operator=(const fht_cas_table &) = delete;
 
+    ~fht_cas_table() {
+        free(this->stripes);
+    }
 
-                return ((const int8_t * const)new_chunk) + true_idx;
+    // same as fht_spin_lock
+    template<typename Cond>
+    static void
+    _wait_while(Cond cond) {
+        for (uint32_t i = 0; cond(); ++i) {
+            if (i < FHT_SPIN_PAUSES) {
+                _mm_pause();
+            }
+            else {
+                std::this_thread::yield();
             }
         }
-        // probability of this is 1 / (2 ^ 64)
-        assert(0);
     }
-    //////////////////////////////////////////////////////////////////////
-    // stuff related to finding elements
 
+    // threads get stripes round robin the first time they use a table of
+    // this type
+    inline stripe_t &
+    _thread_stripe() const {
+        static std::atomic<uint32_t>       next_stripe(0);
+        static thread_local const uint32_t stripe_idx =
+            next_stripe.fetch_add(1, std::memory_order_relaxed);
+        return this->stripes[stripe_idx & (Stripes - 1)];
+    }
 
-    const int8_t * const __attribute__((pure)) _find(key_pass_t key) const {
-        // seperate version of find
-        const hash_type_t raw_slot = this->hash(key);
+    // fn() once no op is going (new ones wait for it to finish) with the
+    // stripes' counts moved into the table. Not from inside an op
+    template<typename Fn>
+    void
+    _with_all_stopped(Fn fn) {
+        std::lock_guard<std::mutex> lock(this->stop_lock);
+
+        // store stopping then load nactive here, add to nactive then load
+        // stopping in active_t. Every one of those has to be seq_cst: with
+        // acquire loads both sides can miss the other's store and an op runs
+        // during fn
+        this->stopping.store(1, std::memory_order_seq_cst);
+        for (uint32_t i = 0; i < Stripes; ++i) {
+            const stripe_t & s = this->stripes[i];
+            _wait_while([&]() {
+                return s.nactive.load(std::memory_order_seq_cst) != 0;
+            });
+        }
+        for (uint32_t i = 0; i < Stripes; ++i) {
+            stripe_t & s = this->stripes[i];
+            this->table.npairs +=
+                (uint32_t)s.npairs.exchange(0, std::memory_order_relaxed);
+            this->table.nerased +=
+                s.nerased.exchange(0, std::memory_order_relaxed);
+        }
+        fn();
+        this->stopping.store(0, std::memory_order_release);
+    }
 
-        fht_chunk<K, V> * const chunk = (fht_chunk<K, V> * const)(
-            (this->chunks) + (FHT_HASH_TO_IDX(raw_slot, this->log_incr)));
-        __builtin_prefetch(chunk);
+    //////////////////////////////////////////////////////////////////////
+    // whole table ops, these stop everything
 
-        // by setting valid here we can remove delete check
-        const uint32_t start_idx = FHT_GEN_START_IDX(raw_slot);
+    // migrate_chunks is ignored
+    void
+    growth_policy(fht_growth_policy new_growth) {
+        new_growth.migrate_chunks = 0;
+        this->_with_all_stopped(
+            [&]() { this->table.growth_policy(new_growth); });
+    }
 
-        prefetch<K>((const void * const)(
-            chunk->get_key_n_ptr((FHT_MM_IDX_MULT * start_idx))));
+    void
+    rehash() {
+        this->_with_all_stopped([&]() { this->table.rehash(); });
+    }
 
-        const int8_t tag = FHT_GEN_TAG(raw_slot);
+    void
+    reserve(const uint64_t n) {
+        this->_with_all_stopped([&]() { this->table.reserve(n); });
+    }
 
-        // check for valid slot of duplicate
-        uint32_t idx, slot_mask;
-        for (uint32_t j = 0; j < FHT_MM_ITER_LINE; ++j) {
-            // seeded with start_idx we go through idx function
-            const uint32_t outer_idx = (j + start_idx) & FHT_MM_LINE_MASK;
-            slot_mask = chunk->get_tag_matches(tag, outer_idx);
+    inline uint64_t
+    size() const {
+        const active_t active(*this);
+        return this->_size();
+    }
 
-            if (slot_mask) {
-                node_prefetch<K>(slot_mask,
-                                 (const int8_t * const)(chunk->get_key_n_ptr(
-                                     (FHT_MM_IDX_MULT * outer_idx))));
+    inline bool
+    empty() const {
+        return !(this->size());
+    }
 
-                // consider adding incrmenter to compiler knows its not infinite
-                do {
-                    __asm__("tzcnt %1, %0" : "=r"((idx)) : "rm"((slot_mask)));
-                    const uint32_t true_idx = FHT_MM_IDX_MULT * outer_idx + idx;
+    //////////////////////////////////////////////////////////////////////
+    // point ops
 
-                    if (__builtin_expect((chunk->compare_key_n(true_idx, key)),
+    // true if key wasn't in the table. If another thread adds the same key at
+    // the same time exactly one of them gets true (and its value is kept)
+    template<typename... Args>
+    bool
+    emplace(key_pass_t new_key, Args &&... args) {
+        const hash_type_t raw_slot = this->table.hash(new_key);
+        return fht_isa_dispatch([&](auto isa) {
+            const auto val_fn = [&](V * const val) {
+                NEW(V, *val, std::forward<Args>(args)...);
+            };
+            uint32_t log_incr;
+            bool     added;
+            for (;;) {
+                {
+                    const active_t active(*this);
+                    log_incr = this->table.log_incr;
+                    if (__builtin_expect(this->_add(active.stripe,
+                                                    new_key,
+                                                    raw_slot,
+                                                    added,
+                                                    val_fn,
+                                                    isa),
                                          1)) {
-                        return ((const int8_t * const)chunk) + true_idx;
+                        if (__builtin_expect(
+                                !added || !this->_count_add(active.stripe),
+                                1)) {
+                            return added;
+                        }
+                        break;
                     }
-                    slot_mask ^= ((1u) << idx);
-                } while (slot_mask);
-            }
-            if (__builtin_expect(chunk->get_empty(outer_idx), 1)) {
-                return NULL;
+                }
+                // nowhere close enough to the home chunk to put it
+                this->_grow(log_incr, isa);
             }
-        }
-        return NULL;
-    }
-
-
-    inline constexpr fht_iterator
-    find(K && key) const {
-        const int8_t * const res = _find(std::move(key));
-        return (res == NULL) ? this->end() : fht_iterator(res);
+            // at grow_npairs
+            this->_grow(log_incr, isa);
+            return added;
+        });
     }
 
-    inline constexpr fht_iterator
-    find(const K & key) const {
-        const int8_t * const res = _find(std::move(key));
-        return (res == NULL) ? this->end() : fht_iterator(res);
+    // copies key's value to val if its in the table
+    inline bool
+    find(key_pass_t key, V & val) const {
+        return fht_isa_dispatch<key_pass_t, hash_type_t>(
+            [this, &val](auto isa, key_pass_t k, const hash_type_t h) {
+                const active_t                active(*this);
+                uint32_t                      idx;
+                const fht_chunk<K, V, Slots> * const chunk =
+                    this->_find(k, h, idx, isa);
+                if (chunk == NULL) {
+                    return false;
+                }
+                val = *(chunk->get_val_n_ptr(idx));
+                return true;
+            },
+            key,
+            this->table.hash(key));
     }
 
-    inline constexpr uint64_t
-    count(const K & key) const {
-        return (_find(key) != NULL);
+    inline uint64_t
+    count(key_pass_t key) const {
+        return fht_isa_dispatch<key_pass_t, hash_type_t>(
+            [this](auto isa, key_pass_t k, const hash_type_t h) {
+                const active_t active(*this);
+                uint32_t       idx;
+                return (uint64_t)(this->_find(k, h, idx, isa) != NULL);
+            },
+            key,
+            this->table.hash(key));
     }
 
-    inline constexpr uint64_t
-    count(K && key) const {
-        return (_find(std::move(key)) != NULL);
+    inline bool
+    contains(key_pass_t key) const {
+        return this->count(key);
     }
 
-    inline constexpr bool
-    contains(const K & key) const {
-        return count(key);
-    }
+    //////////////////////////////////////////////////////////////////////
+    // rest are only called with an op going (see active_t)
 
-    inline constexpr bool
-    contains(K && key) const {
-        return count(std::move(key));
+    inline uint64_t
+    _size() const {
+        uint64_t n = this->table.npairs;
+        for (uint32_t i = 0; i < Stripes; ++i) {
+            n += this->stripes[i].npairs.load(std::memory_order_relaxed);
+        }
+        return n;
     }
 
-    inline constexpr V &
-    at(const K & key) const {
-        const uint64_t                res = (const uint64_t)_find(key);
-        const fht_chunk<K, V> * const chunk =
-            (const fht_chunk<K, V> * const)(res & (~(FHT_TAGS_PER_CLINE - 1)));
-        return *(chunk->get_val_n_ptr(res & (FHT_TAGS_PER_CLINE - 1)));
+    // counts an add, true if the table should grow now
+    inline bool
+    _count_add(stripe_t & stripe) const {
+        const uint64_t n =
+            stripe.npairs.fetch_add(1, std::memory_order_relaxed) + 1;
+        return __builtin_expect(n % FHT_CAS_SIZE_CHECK == 0, 0) &&
+               this->_size() >= this->table.grow_npairs;
     }
 
-    inline constexpr V &
-    at(K && key) const {
-        const uint64_t res = (const uint64_t)_find(std::move(key));
-        const fht_chunk<K, V> * const chunk =
-            (const fht_chunk<K, V> * const)(res & (~(FHT_TAGS_PER_CLINE - 1)));
-        return *(chunk->get_val_n_ptr(res & (FHT_TAGS_PER_CLINE - 1)));
+    // first of the slots in slot_mask (rotated to key's probe order) before
+    // end with key, FHT_CHUNK_SLOTS if none. Waits on busy ones. Tags can
+    // change under the masks so each is loaded again (with acquire, pairs
+    // with the release that published it) before its key is looked at
+    template<typename Isa>
+    uint32_t
+    _match_in_chunk(const fht_chunk<K, V, Slots> * const chunk,
+                    mask_t                        slot_mask,
+                    const uint64_t                end,
+                    key_pass_t                    key,
+                    const hash_type_t             raw_slot,
+                    const Isa                     isa) const {
+        const uint32_t start_idx = FHT_GEN_START_IDX(raw_slot);
+        const tag_t    busy      = fht_tags<tag_t>::busy;
+        while (slot_mask) {
+            const uint64_t idx = chunk->first_slot(slot_mask, isa);
+            if (idx >= end) {
+                break;
+            }
+            const uint32_t true_idx = (const uint32_t)(
+                (idx + FHT_MM_IDX_MULT * start_idx) & (FHT_CHUNK_SLOTS - 1));
+            const tag_t * const tag_ptr = ((const tag_t *)chunk) + true_idx;
+            tag_t               tag;
+            _wait_while([&]() {
+                tag = __atomic_load_n(tag_ptr, __ATOMIC_ACQUIRE);
+                return tag == busy;
+            });
+            if (tag == FHT_GEN_TAG(raw_slot) &&
+                chunk->compare_hashed_key_n(true_idx, key, raw_slot)) {
+                return true_idx;
+            }
+            slot_mask &= slot_mask - 1;
+        }
+        return FHT_CHUNK_SLOTS;
     }
 
-
-    //////////////////////////////////////////////////////////////////////
-    // deleting stuff
-    uint64_t
-    erase(key_pass_t key) {
-        const hash_type_t raw_slot = this->hash(key);
-
-        fht_chunk<K, V> * const chunk = (fht_chunk<K, V> * const)(
-            (this->chunks) + (FHT_HASH_TO_IDX(raw_slot, this->log_incr)));
-        __builtin_prefetch(chunk);
-
-        // by setting valid here we can remove delete check
+    // slot key is in, FHT_CHUNK_SLOTS if it isn't in chunk. empty_mask is
+    // set to chunk's empty slots (rotated)
+    template<typename Isa>
+    inline uint32_t
+    _find_in_chunk(const fht_chunk<K, V, Slots> * const chunk,
+                   key_pass_t                    key,
+                   const hash_type_t             raw_slot,
+                   mask_t &                      empty_mask,
+                   const Isa                     isa) const {
         const uint32_t start_idx = FHT_GEN_START_IDX(raw_slot);
+        FHT_RACY_READS_BEGIN();
+        empty_mask = chunk->get_empty_all(start_idx, isa);
+        const mask_t slot_mask =
+            chunk->get_tag_matches_all(FHT_GEN_TAG(raw_slot), start_idx, isa);
+        FHT_RACY_READS_END();
+
+        // see empty_line_end
+        const uint64_t end =
+            empty_mask ? (chunk->first_slot(empty_mask, isa) |
+                          (FHT_MM_IDX_MULT - 1)) +
+                             1
+                       : FHT_CHUNK_SLOTS;
+        return this->_match_in_chunk(chunk, slot_mask, end, key, raw_slot, isa);
+    }
 
-        prefetch<K>((const void * const)(
-            chunk->get_key_n_ptr((FHT_MM_IDX_MULT * start_idx))));
-
-        const int8_t tag = FHT_GEN_TAG(raw_slot);
-
-        // check for valid slot of duplicate
-        uint32_t idx, slot_mask;
-        for (uint32_t j = 0; j < FHT_MM_ITER_LINE; ++j) {
-            const uint32_t outer_idx = (j + start_idx) & FHT_MM_LINE_MASK;
-            slot_mask = chunk->get_tag_matches(tag, outer_idx);
-            if (slot_mask) {
-                node_prefetch<K>(slot_mask,
-                                 (const int8_t * const)(chunk->get_key_n_ptr(
-                                     (FHT_MM_IDX_MULT * outer_idx))));
-
-                do {
-
-                    __asm__("tzcnt %1, %0" : "=r"((idx)) : "rm"((slot_mask)));
-                    const uint32_t true_idx = FHT_MM_IDX_MULT * outer_idx + idx;
-                    if (__builtin_expect((chunk->compare_key_n(true_idx, key)),
-                                         1)) {
-                        if (__builtin_expect(chunk->get_empty(outer_idx), 1)) {
-                            chunk->invalidate_tag_n(true_idx);
-                        }
-                        else {
-                            chunk->erase_tag_n(true_idx);
-                        }
-                        --this->npairs;
-                        return FHT_ERASED;
-                    }
-                    slot_mask ^= ((1u) << idx);
-                } while (slot_mask);
+    // chunk (and slot) key is in, NULL if it isn't in the table
+    template<typename Isa>
+    const fht_chunk<K, V, Slots> *
+    _find(key_pass_t        key,
+          const hash_type_t raw_slot,
+          uint32_t &        idx,
+          const Isa         isa) const {
+        const table_t & t          = this->table;
+        const uint32_t  chunk_mask = FHT_CHUNK_MASK(t.log_incr);
+        uint32_t        chunk_idx  = FHT_HASH_TO_IDX(raw_slot, t.log_incr);
+        for (uint32_t k = 0; k <= chunk_mask;) {
+            const fht_chunk<K, V, Slots> * const chunk = t.chunks + chunk_idx;
+
+            mask_t empty_mask;
+            idx = this->_find_in_chunk(chunk, key, raw_slot, empty_mask, isa);
+            if (idx != FHT_CHUNK_SLOTS) {
+                return chunk;
             }
-
-            if (__builtin_expect(chunk->get_empty(outer_idx), 1)) {
-                return FHT_NOT_ERASED;
+            if (empty_mask) {
+                break;
             }
+            ++k;
+            chunk_idx = FHT_NEXT_CHUNK(chunk_idx, k, chunk_mask);
         }
-
-        return FHT_NOT_ERASED;
+        return NULL;
     }
 
-    inline constexpr uint64_t
-    erase(fht_iterator fht_it) {
-        return erase(fht_it->first);
+    // true if key is in a slot of its probe before the slot at (rotated) end
+    // of its k'th chunk. Waits for adds that claimed one of those to finish
+    template<typename Isa>
+    bool
+    _in_earlier_slot(key_pass_t        key,
+                     const hash_type_t raw_slot,
+                     const uint32_t    last_k,
+                     const uint64_t    end,
+                     const Isa         isa) const {
+        const table_t & t          = this->table;
+        const uint32_t  chunk_mask = FHT_CHUNK_MASK(t.log_incr);
+        const uint32_t  start_idx  = FHT_GEN_START_IDX(raw_slot);
+        uint32_t        chunk_idx  = FHT_HASH_TO_IDX(raw_slot, t.log_incr);
+        for (uint32_t k = 0;; ++k) {
+            const fht_chunk<K, V, Slots> * const chunk = t.chunks + chunk_idx;
+            FHT_RACY_READS_BEGIN();
+            const mask_t slot_mask =
+                chunk->get_tag_matches_all(FHT_GEN_TAG(raw_slot),
+                                           start_idx,
+                                           isa) |
+                chunk->get_tag_matches_all(fht_tags<tag_t>::busy,
+                                           start_idx,
+                                           isa);
+            FHT_RACY_READS_END();
+            if (this->_match_in_chunk(chunk,
+                                      slot_mask,
+                                      k == last_k ? end : FHT_CHUNK_SLOTS,
+                                      key,
+                                      raw_slot,
+                                      isa) != FHT_CHUNK_SLOTS) {
+                return true;
+            }
+            if (k == last_k) {
+                return false;
+            }
+            chunk_idx = FHT_NEXT_CHUNK(chunk_idx, k + 1, chunk_mask);
+        }
     }
 
-    void
-    clear() {
-        const uint32_t _num_chunks =
-            ((1u) << (this->log_incr)) / FHT_TAGS_PER_CLINE;
+    // adds key (value_fn constructs its value) unless it is already in the
+    // table, added is set if it wasn't. false if there is no empty slot close
+    // enough to its home chunk. npairs is up to the caller
+    template<typename ValFn, typename Isa>
+    bool
+    _add(stripe_t &        stripe,
+         const K &         new_key,
+         const hash_type_t raw_slot,
+         bool &            added,
+         ValFn             val_fn,
+         const Isa         isa) {
+        table_t &      t          = this->table;
+        const uint32_t chunk_mask = FHT_CHUNK_MASK(t.log_incr);
+        const uint32_t start_idx  = FHT_GEN_START_IDX(raw_slot);
+        uint32_t       chunk_idx  = FHT_HASH_TO_IDX(raw_slot, t.log_incr);
+        for (uint32_t k = 0; k <= chunk_mask && k <= FHT_MAX_OVERFLOW_CHUNKS;) {
+            fht_chunk<K, V, Slots> * const chunk = t.chunks + chunk_idx;
+
+            mask_t empty_mask;
+            if (this->_find_in_chunk(chunk,
+                                     new_key,
+                                     raw_slot,
+                                     empty_mask,
+                                     isa) != FHT_CHUNK_SLOTS) {
+                added = false;
+                return true;
+            }
+            if (empty_mask == 0) {
+                ++k;
+                chunk_idx = FHT_NEXT_CHUNK(chunk_idx, k, chunk_mask);
+                continue;
+            }
 
-        for (uint32_t i = 0; i < _num_chunks; ++i) {
-            ((__m256i * const)(this->chunks + i))[0] = FHT_RESET_VEC;
-            ((__m256i * const)(this->chunks + i))[1] = FHT_RESET_VEC;
+            // if another add claims it first look at the chunk again
+            const uint64_t claim_idx = chunk->first_slot(empty_mask, isa);
+            const uint32_t idx       = (const uint32_t)(
+                (claim_idx + FHT_MM_IDX_MULT * start_idx) &
+                (FHT_CHUNK_SLOTS - 1));
+            tag_t * const tag_ptr = ((tag_t *)chunk) + idx;
+            tag_t         invalid = fht_tags<tag_t>::invalid;
+            if (!__atomic_compare_exchange_n(tag_ptr,
+                                             &invalid,
+                                             fht_tags<tag_t>::busy,
+                                             false,
+                                             __ATOMIC_ACQUIRE,
+                                             __ATOMIC_RELAXED)) {
+                continue;
+            }
+            chunk->set_hash_n(idx, raw_slot);
+            NEW(K, *(chunk->get_key_n_ptr(idx)), new_key);
+
+            added =
+                !this->_in_earlier_slot(new_key, raw_slot, k, claim_idx, isa);
+            if (__builtin_expect(added, 1)) {
+                val_fn((V *)(chunk->get_val_n_ptr(idx)));
+                __atomic_store_n(tag_ptr,
+                                 FHT_GEN_TAG(raw_slot),
+                                 __ATOMIC_RELEASE);
+            }
+            else {
+                // only a matching tag leads to the key so nothing else can be
+                // looking at it
+                chunk->get_key_n_ptr(idx)->~K();
+                __atomic_store_n(tag_ptr,
+                                 fht_tags<tag_t>::erased,
+                                 __ATOMIC_RELEASE);
+                stripe.nerased.fetch_add(1, std::memory_order_relaxed);
+            }
+            return true;
         }
-        this->npairs = 0;
+        return false;
     }
 
+    // unless another thread already did since log_incr was seen
+    template<typename Isa>
+    void
+    _grow(const uint32_t log_incr, const Isa) {
+        fht_isa_run<Isa>::run_cold([&](const Isa cold_isa) {
+            this->_with_all_stopped([&]() {
+                if (this->table.log_incr == log_incr) {
+                    this->table._rehash(cold_isa);
+                }
+            });
+        });
+    }
+};
 
-    inline constexpr fht_iterator
-    begin() const {
-        if (this->empty()) {
-            return this->end();
-        }
-        else {
-            return fht_iterator((const int8_t *)this->chunks,
-                                (const uint64_t)(this->end().cur_tag));
+//////////////////////////////////////////////////////////////////////
+// crc32c. Hashers use the crc32 instruction when the cpu has it and a table
+// otherwise. Both give the same values so which one gets used never changes
+// where anything is in the table
+
+// reflected crc32c table (what the crc32 instruction computes, without the
+// usual inversion at the start / end)
+struct fht_crc_table_t {
+    uint32_t t[256];
+
+    constexpr fht_crc_table_t() : t() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (uint32_t j = 0; j < 8; ++j) {
+                c = (c >> 1) ^ ((c & 1) ? 0x82F63B78u : 0);
+            }
+            t[i] = c;
         }
     }
+};
+static constexpr fht_crc_table_t fht_crc_table{};
 
-    inline constexpr fht_iterator
-    end() const {
-        return fht_iterator(
-            ((const int8_t *)this->chunks) +
-            sizeof(fht_chunk<K, V>) *
-                (((1UL) << (this->log_incr)) / FHT_TAGS_PER_CLINE));
+static inline uint32_t
+fht_crc32_u32_sw(uint32_t crc, const uint32_t v) {
+    crc ^= v;
+    for (uint32_t i = 0; i < sizeof(uint32_t); ++i) {
+        crc = fht_crc_table.t[crc & 0xff] ^ (crc >> 8);
     }
-};
+    return crc;
+}
+
+static inline uint64_t
+fht_crc32_u64_sw(const uint64_t crc, const uint64_t v) {
+    return fht_crc32_u32_sw(fht_crc32_u32_sw((uint32_t)crc, (uint32_t)v),
+                            (uint32_t)(v >> 32));
+}
+
+#if !defined(__SSE4_2__) && defined(FHT_DISPATCH_ISA)
+static inline uint32_t __attribute__((target("sse4.2")))
+fht_crc32_u32_hw(const uint32_t crc, const uint32_t v) {
+    return __builtin_ia32_crc32si(crc, v);
+}
+
+static inline uint64_t __attribute__((target("sse4.2")))
+fht_crc32_u64_hw(const uint64_t crc, const uint64_t v) {
+    return __builtin_ia32_crc32di(crc, v);
+}
+#endif
+
+static inline uint32_t __attribute__((always_inline))
+fht_crc32_u32(const uint32_t crc, const uint32_t v) {
+#if defined(__SSE4_2__)
+    return __builtin_ia32_crc32si(crc, v);
+#elif defined(FHT_DISPATCH_ISA)
+    return FHT_CPU_CRC ? fht_crc32_u32_hw(crc, v) : fht_crc32_u32_sw(crc, v);
+#else
+    return fht_crc32_u32_sw(crc, v);
+#endif
+}
+
+static inline uint64_t __attribute__((always_inline))
+fht_crc32_u64(const uint64_t crc, const uint64_t v) {
+#if defined(__SSE4_2__)
+    return __builtin_ia32_crc32di(crc, v);
+#elif defined(FHT_DISPATCH_ISA)
+    return FHT_CPU_CRC ? fht_crc32_u64_hw(crc, v) : fht_crc32_u64_sw(crc, v);
+#else
+    return fht_crc32_u64_sw(crc, v);
+#endif
+}
 
 //////////////////////////////////////////////////////////////////////
 // 32 bit hashers
@@ -1296,12 +6399,34 @@ crc_32(const uint32_t * const data, const uint32_t len) {
     uint32_t       res = 0;
     const uint32_t l1  = len / u32_sizeof_u32;
     for (uint32_t i = 0; i < l1; ++i) {
-        res ^= __builtin_ia32_crc32si(FHT_HASH_SEED, data[i]);
+        res ^= fht_crc32_u32(FHT_HASH_SEED, data[i]);
     }
 
     if (len & 0x3) {
         const uint32_t final_k = data[l1] & (((1u) << (8 * (len & 0x3))) - 1);
-        res ^= __builtin_ia32_crc32si(FHT_HASH_SEED, final_k);
+        res ^= fht_crc32_u32(FHT_HASH_SEED, final_k);
+    }
+
+    return res;
+}
+
+// crc_32 of bytes that may end right at the end of a page. crc_32 reads the
+// whole word the last bytes are in which is fine inside a std::string but
+// not in some arbitrary buffer. Same hash for the same bytes
+static uint32_t
+crc_32_bytes(const char * const data, const uint32_t len) {
+    uint32_t       res = 0;
+    const uint32_t l1  = len / u32_sizeof_u32;
+    for (uint32_t i = 0; i < l1; ++i) {
+        uint32_t k;
+        memcpy(&k, data + i * u32_sizeof_u32, u32_sizeof_u32);
+        res ^= fht_crc32_u32(FHT_HASH_SEED, k);
+    }
+
+    if (len & 0x3) {
+        uint32_t final_k = 0;
+        memcpy(&final_k, data + l1 * u32_sizeof_u32, len & 0x3);
+        res ^= fht_crc32_u32(FHT_HASH_SEED, final_k);
     }
 
     return res;
@@ -1323,7 +6448,7 @@ struct HASH_32_4 {
 
     constexpr uint32_t
     operator()(const K key) const {
-        return __builtin_ia32_crc32si(FHT_HASH_SEED, key);
+        return fht_crc32_u32(FHT_HASH_SEED, key);
     }
 };
 
@@ -1332,8 +6457,8 @@ struct HASH_32_8 {
 
     constexpr uint32_t
     operator()(const K key) const {
-        return __builtin_ia32_crc32si(FHT_HASH_SEED, key) ^
-               __builtin_ia32_crc32si(FHT_HASH_SEED, key >> 32);
+        return fht_crc32_u32(FHT_HASH_SEED, key) ^
+               fht_crc32_u32(FHT_HASH_SEED, key >> 32);
     }
 };
 
@@ -1345,6 +6470,11 @@ struct HASH_32_CPP_STR {
         return crc_32((const uint32_t * const)(key.c_str()),
                       (const uint32_t)key.length());
     }
+
+    constexpr uint32_t
+    operator()(const fht_str_ref key) const {
+        return crc_32_bytes(key.str, key.len);
+    }
 };
 
 
@@ -1357,7 +6487,7 @@ struct DEFAULT_HASH_32 {
                                        sizeof(_K) <= 4),
                                       uint32_t>::type
     operator()(const K key) const {
-        return __builtin_ia32_crc32si(FHT_HASH_SEED, key);
+        return fht_crc32_u32(FHT_HASH_SEED, key);
     }
 
     template<typename _K = K>
@@ -1365,8 +6495,8 @@ struct DEFAULT_HASH_32 {
                                        sizeof(_K) == 8),
                                       uint32_t>::type
     operator()(const K key) const {
-        return __builtin_ia32_crc32si(FHT_HASH_SEED, key) ^
-               __builtin_ia32_crc32si(FHT_HASH_SEED, key >> 32);
+        return fht_crc32_u32(FHT_HASH_SEED, key) ^
+               fht_crc32_u32(FHT_HASH_SEED, key >> 32);
     }
 
     template<typename _K = K>
@@ -1377,6 +6507,13 @@ struct DEFAULT_HASH_32 {
                       (const uint32_t)key.length());
     }
 
+    template<typename _K = K>
+    constexpr typename std::enable_if<(std::is_same<_K, std::string>::value),
+                                      uint32_t>::type
+    operator()(const fht_str_ref key) const {
+        return crc_32_bytes(key.str, key.len);
+    }
+
     template<typename _K = K>
     constexpr typename std::enable_if<(!std::is_same<_K, std::string>::value) &&
                                           (!std::is_arithmetic<_K>::value),
@@ -1395,12 +6532,31 @@ crc_64(const uint64_t * const data, const uint32_t len) {
     uint64_t       res = 0;
     const uint32_t l1  = len / u32_sizeof_u64;
     for (uint32_t i = 0; i < l1; ++i) {
-        res ^= _mm_crc32_u64(FHT_HASH_SEED, data[i]);
+        res ^= fht_crc32_u64(FHT_HASH_SEED, data[i]);
     }
 
     if (len & 0x7) {
         const uint64_t final_k = data[l1] & (((1UL) << (8 * (len & 0x7))) - 1);
-        res ^= _mm_crc32_u64(FHT_HASH_SEED, final_k);
+        res ^= fht_crc32_u64(FHT_HASH_SEED, final_k);
+    }
+    return res;
+}
+
+// crc_64 version of crc_32_bytes
+static uint64_t
+crc_64_bytes(const char * const data, const uint32_t len) {
+    uint64_t       res = 0;
+    const uint32_t l1  = len / u32_sizeof_u64;
+    for (uint32_t i = 0; i < l1; ++i) {
+        uint64_t k;
+        memcpy(&k, data + i * u32_sizeof_u64, u32_sizeof_u64);
+        res ^= fht_crc32_u64(FHT_HASH_SEED, k);
+    }
+
+    if (len & 0x7) {
+        uint64_t final_k = 0;
+        memcpy(&final_k, data + l1 * u32_sizeof_u64, len & 0x7);
+        res ^= fht_crc32_u64(FHT_HASH_SEED, final_k);
     }
     return res;
 }
@@ -1423,7 +6579,7 @@ struct HASH_64_4 {
 
     constexpr uint32_t
     operator()(const K key) const {
-        return __builtin_ia32_crc32si(FHT_HASH_SEED, key);
+        return fht_crc32_u32(FHT_HASH_SEED, key);
     }
 };
 
@@ -1432,7 +6588,7 @@ struct HASH_64_8 {
 
     constexpr uint64_t
     operator()(const K key) const {
-        return _mm_crc32_u64(FHT_HASH_SEED, key);
+        return fht_crc32_u64(FHT_HASH_SEED, key);
     }
 };
 
@@ -1444,6 +6600,11 @@ struct HASH_64_CPP_STR {
         return crc_64((const uint64_t * const)(key.c_str()),
                       (const uint32_t)key.length());
     }
+
+    constexpr uint64_t
+    operator()(const fht_str_ref key) const {
+        return crc_64_bytes(key.str, key.len);
+    }
 };
 
 
@@ -1456,7 +6617,7 @@ struct DEFAULT_HASH_64 {
                                        sizeof(_K) <= 4),
                                       uint32_t>::type
     operator()(const K key) const {
-        return __builtin_ia32_crc32si(FHT_HASH_SEED, key);
+        return fht_crc32_u32(FHT_HASH_SEED, key);
     }
 
     template<typename _K = K>
@@ -1464,7 +6625,7 @@ struct DEFAULT_HASH_64 {
                                        sizeof(_K) == 8),
                                       uint64_t>::type
     operator()(const K key) const {
-        return _mm_crc32_u64(FHT_HASH_SEED, key);
+        return fht_crc32_u64(FHT_HASH_SEED, key);
     }
 
     template<typename _K = K>
@@ -1475,6 +6636,13 @@ struct DEFAULT_HASH_64 {
                       (const uint32_t)key.length());
     }
 
+    template<typename _K = K>
+    constexpr typename std::enable_if<(std::is_same<_K, std::string>::value),
+                                      uint64_t>::type
+    operator()(const fht_str_ref key) const {
+        return crc_64_bytes(key.str, key.len);
+    }
+
     template<typename _K = K>
     constexpr typename std::enable_if<(!std::is_same<_K, std::string>::value) &&
                                           (!std::is_arithmetic<_K>::value),
@@ -1484,6 +6652,53 @@ struct DEFAULT_HASH_64 {
     }
 };
 
+// high 32 bits of FULL_HASH_64. crc is linear so another seed would only xor
+// a constant into the low half, the multiply breaks that up first
+static inline uint64_t __attribute__((always_inline))
+fht_full_hash_hi(const uint64_t k) {
+    return fht_crc32_u64(FHT_HASH_SEED, k * 0x9E3779B97F4A7C15UL) << 32;
+}
+
+template<typename K>
+struct FULL_HASH_64 {
+
+    template<typename _K = K>
+    constexpr typename std::enable_if<(std::is_arithmetic<_K>::value &&
+                                       sizeof(_K) <= 8),
+                                      uint64_t>::type
+    operator()(const K key) const {
+        return fht_crc32_u64(FHT_HASH_SEED, (uint64_t)key) |
+               fht_full_hash_hi((uint64_t)key);
+    }
+
+    // longer keys only have the low half to go on
+    template<typename _K = K>
+    constexpr typename std::enable_if<(std::is_same<_K, std::string>::value),
+                                      uint64_t>::type
+    operator()(K const & key) const {
+        const uint64_t lo = crc_64((const uint64_t *)(key.c_str()),
+                                   (uint32_t)key.length());
+        return lo | fht_full_hash_hi(lo);
+    }
+
+    template<typename _K = K>
+    constexpr typename std::enable_if<(std::is_same<_K, std::string>::value),
+                                      uint64_t>::type
+    operator()(const fht_str_ref key) const {
+        const uint64_t lo = crc_64_bytes(key.str, key.len);
+        return lo | fht_full_hash_hi(lo);
+    }
+
+    template<typename _K = K>
+    constexpr typename std::enable_if<(!std::is_same<_K, std::string>::value) &&
+                                          (!std::is_arithmetic<_K>::value),
+                                      uint64_t>::type
+    operator()(K const & key) const {
+        const uint64_t lo = crc_64((const uint64_t *)(&key), sizeof(K));
+        return lo | fht_full_hash_hi(lo);
+    }
+};
+
 //////////////////////////////////////////////////////////////////////
 
 
@@ -1501,6 +6716,17 @@ myMmap(void *   addr,
     return p;
 }
 
+// the remap runs even without asserts (only its result is checked)
+static void *
+myMremap(void *   addr,
+         uint64_t old_length,
+         uint64_t new_length,
+         int32_t  remap_flags) {
+    void * p = mremap(addr, old_length, new_length, remap_flags);
+    assert(p != MAP_FAILED);
+    return p;
+}
+
 
 static void
 myMunmap(void * addr, uint64_t length) {
@@ -1517,61 +6743,130 @@ myMunmap(void * addr, uint64_t length) {
            0)
 
 
+// with fht_dense_tags every allocator also has to give each chunk its body.
+// Without these do nothing
+template<typename K, typename V, uint32_t Slots>
+static constexpr
+    typename std::enable_if<!fht_dense_tags<K, V>::value, uint64_t>::type
+    fht_body_bytes(const uint64_t) {
+    return 0;
+}
+
+template<typename K, typename V, uint32_t Slots>
+static constexpr
+    typename std::enable_if<fht_dense_tags<K, V>::value, uint64_t>::type
+    fht_body_bytes(const uint64_t nchunks) {
+    return nchunks * sizeof(fht_chunk_body<K, V, Slots>);
+}
+
+template<typename K, typename V, uint32_t Slots>
+static constexpr
+    typename std::enable_if<!fht_dense_tags<K, V>::value, void>::type
+    fht_set_bodies(fht_chunk<K, V, Slots> * const,
+                   const uint64_t,
+                   void * const) {}
+
+template<typename K, typename V, uint32_t Slots>
+static constexpr
+    typename std::enable_if<fht_dense_tags<K, V>::value, void>::type
+    fht_set_bodies(fht_chunk<K, V, Slots> * const chunks,
+                   const uint64_t          nchunks,
+                   void * const            bodies) {
+    for (uint64_t i = 0; i < nchunks; ++i) {
+        chunks[i].body = ((fht_chunk_body<K, V, Slots> * const)bodies) + i;
+    }
+}
+
+
 // less syscalls this way
-template<typename K, typename V>
+template<typename K,
+         typename V,
+         uint32_t Slots = fht_chunk_slots<K, V>::value>
 struct SMALL_INPLACE_MMAP_ALLOC {
+    typedef fht_chunk<K, V, Slots> chunk_t;
+
     SMALL_INPLACE_MMAP_ALLOC() {}
 
     ~SMALL_INPLACE_MMAP_ALLOC() {}
 
-    constexpr fht_chunk<K, V> *
+    constexpr chunk_t *
     allocate(const uint64_t size) const {
-        assert(size <= sizeof(fht_chunk<K, V>) *
-                           (FHT_DEFAULT_INIT_MEMORY / sizeof(fht_chunk<K, V>)));
-        return (fht_chunk<K, V> *)myMmap(
+        assert(size <= sizeof(chunk_t) *
+                           (FHT_DEFAULT_INIT_MEMORY / sizeof(chunk_t)));
+        const uint64_t bytes = size * sizeof(chunk_t) + FHT_TAGS_PER_CLINE +
+                               fht_body_bytes<K, V, Slots>(size);
+        assert(bytes <=
+               sizeof(chunk_t) * (FHT_DEFAULT_INIT_MEMORY / sizeof(chunk_t)));
+        chunk_t * const ret = (chunk_t *)myMmap(
             NULL,
-            sizeof(fht_chunk<K, V>) *
-                (FHT_DEFAULT_INIT_MEMORY / sizeof(fht_chunk<K, V>)),
+            sizeof(chunk_t) * (FHT_DEFAULT_INIT_MEMORY / sizeof(chunk_t)),
             (PROT_READ | PROT_WRITE),
             (MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE),
             (-1),
             0);
+        fht_set_bodies<K, V, Slots>(
+            ret,
+            size,
+            ((int8_t * const)(ret + size)) + FHT_TAGS_PER_CLINE);
+        return ret;
     }
 
     constexpr void
-    deallocate(fht_chunk<K, V> const * ptr, const size_t size) const {
+    deallocate(chunk_t const * ptr, const size_t size) const {
         myMunmap((void *)ptr,
-                 sizeof(fht_chunk<K, V>) *
-                     (FHT_DEFAULT_INIT_MEMORY / sizeof(fht_chunk<K, V>)));
+                 sizeof(chunk_t) * (FHT_DEFAULT_INIT_MEMORY / sizeof(chunk_t)));
     }
 };
 
 
 // less syscalls this way
-template<typename K, typename V>
+template<typename K, typename V, uint32_t Slots>
 struct INPLACE_MMAP_ALLOC {
+    typedef fht_chunk<K, V, Slots> chunk_t;
 
-    uint32_t                cur_size;
-    uint32_t                start_offset;
-    const fht_chunk<K, V> * base_address;
+    uint32_t        cur_size;
+    uint32_t        start_offset;
+    const chunk_t * base_address;
+
+    // fht_dense_tags bodies get their own mapping (indexed same as the
+    // chunks) so that the chunks can still grow inplace
+    uint64_t body_size;
+    int8_t * body_address;
     INPLACE_MMAP_ALLOC() {
-        this->base_address = (const fht_chunk<K, V> * const)myMmap(
+        this->base_address = (const chunk_t * const)myMmap(
             NULL,
-            sizeof(fht_chunk<K, V>) *
-                (FHT_DEFAULT_INIT_MEMORY / sizeof(fht_chunk<K, V>)),
+            sizeof(chunk_t) * (FHT_DEFAULT_INIT_MEMORY / sizeof(chunk_t)),
             (PROT_READ | PROT_WRITE),
             (MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE),
             (-1),
             0);
 
-        this->cur_size     = FHT_DEFAULT_INIT_MEMORY / sizeof(fht_chunk<K, V>);
+        this->cur_size     = FHT_DEFAULT_INIT_MEMORY / sizeof(chunk_t);
         this->start_offset = 0;
+
+        this->body_size    = 0;
+        this->body_address = NULL;
+        if (fht_body_bytes<K, V, Slots>(1)) {
+            this->body_size =
+                FHT_DEFAULT_INIT_MEMORY / fht_body_bytes<K, V, Slots>(1);
+            this->body_address =
+                (int8_t *)myMmap(NULL,
+                                 fht_body_bytes<K, V, Slots>(this->body_size),
+                                 (PROT_READ | PROT_WRITE),
+                                 (MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE),
+                                 (-1),
+                                 0);
+        }
     }
     ~INPLACE_MMAP_ALLOC() {
         myMunmap((void *)this->base_address, this->cur_size);
+        if (this->body_address) {
+            myMunmap((void *)this->body_address,
+                     fht_body_bytes<K, V, Slots>(this->body_size));
+        }
     }
 
-    fht_chunk<K, V> *
+    chunk_t *
     allocate(const size_t size) {
         const size_t old_start_offset = this->start_offset;
         this->start_offset += size;
@@ -1579,53 +6874,121 @@ struct INPLACE_MMAP_ALLOC {
             // maymove breaks inplace so no flags. This will very probably
             // fail. Can't really generically specify a unique addr.
             // Assumption is that FHT_DEFAULT_INIT_MEMORY will be sufficient
-            assert(MAP_FAILED !=
-                   mremap((void *)this->base_address,
-                          sizeof(fht_chunk<K, V>) * this->cur_size,
-                          2 * sizeof(fht_chunk<K, V>) * this->cur_size,
-                          0));
+            myMremap((void *)this->base_address,
+                     sizeof(chunk_t) * this->cur_size,
+                     2 * sizeof(chunk_t) * this->cur_size,
+                     0);
             this->cur_size = 2 * this->cur_size;
         }
-        return (fht_chunk<K, V> *)(this->base_address + old_start_offset);
+        if (this->body_address && this->start_offset >= this->body_size) {
+            myMremap((void *)this->body_address,
+                     fht_body_bytes<K, V, Slots>(this->body_size),
+                     fht_body_bytes<K, V, Slots>(2 * this->body_size),
+                     0);
+            this->body_size = 2 * this->body_size;
+        }
+        chunk_t * const ret =
+            (chunk_t *)(this->base_address + old_start_offset);
+        fht_set_bodies<K, V, Slots>(
+            ret,
+            size,
+            this->body_address +
+                fht_body_bytes<K, V, Slots>(old_start_offset));
+        return ret;
     }
 
+    // only the end of the mapping can actually be given back (i.e after the
+    // table shrinks). Whats left of the first page is zeroed so the iterator
+    // still finds a valid tag right after the table
     void
-    deallocate(fht_chunk<K, V> * const ptr, const size_t size) const {
-        return;
+    deallocate(chunk_t * const ptr, const size_t size) {
+        if (ptr + size != this->base_address + this->start_offset) {
+            return;
+        }
+        this->start_offset = (uint32_t)(ptr - this->base_address);
+
+        const uint64_t start = (const uint64_t)ptr;
+        const uint64_t end   = start + size * sizeof(chunk_t);
+        const uint64_t page_start =
+            (start + (PAGE_SIZE - 1)) & (~((uint64_t)(PAGE_SIZE - 1)));
+        if (page_start < end) {
+            memset((void * const)ptr, 0, page_start - start);
+            madvise((void * const)page_start, end - page_start, MADV_DONTNEED);
+        }
+        else {
+            memset((void * const)ptr, 0, end - start);
+        }
+
+        if (this->body_address) {
+            const uint64_t body_start =
+                (const uint64_t)(this->body_address +
+                                 fht_body_bytes<K, V, Slots>(
+                                     this->start_offset));
+            const uint64_t body_end =
+                body_start + fht_body_bytes<K, V, Slots>(size);
+            const uint64_t body_page_start =
+                (body_start + (PAGE_SIZE - 1)) &
+                (~((uint64_t)(PAGE_SIZE - 1)));
+            if (body_page_start < body_end) {
+                madvise((void * const)body_page_start,
+                        body_end - body_page_start,
+                        MADV_DONTNEED);
+            }
+        }
     }
 };
 
 
-template<typename K, typename V>
+template<typename K, typename V, uint32_t Slots>
 struct DEFAULT_MMAP_ALLOC {
+    typedef fht_chunk<K, V, Slots> chunk_t;
 
-    fht_chunk<K, V> *
+    // an extra line after the chunks is in a sense null term for iterator.
+    // fht_dense_tags bodies go after that
+    chunk_t *
     allocate(const size_t size) const {
-        return (fht_chunk<K, V> * const)mymmap_alloc(
-            NULL,
-            size * sizeof(fht_chunk<K, V>) +
-                1);  // + 1 is in a sense null term for iterator
+        const uint64_t bytes = size * sizeof(chunk_t) + FHT_TAGS_PER_CLINE +
+                               fht_body_bytes<K, V, Slots>(size);
+        int8_t * const ret = (int8_t * const)mymmap_alloc(NULL, bytes);
+        fht_set_bodies<K, V, Slots>(
+            (chunk_t *)ret,
+            size,
+            ret + size * sizeof(chunk_t) + FHT_TAGS_PER_CLINE);
+        return (chunk_t *)ret;
     }
     void
-    deallocate(fht_chunk<K, V> * const ptr, const size_t size) const {
-        myMunmap((void * const)ptr, size * sizeof(fht_chunk<K, V>));
+    deallocate(chunk_t * const ptr, const size_t size) const {
+        myMunmap((void * const)ptr,
+                 size * sizeof(chunk_t) + FHT_TAGS_PER_CLINE +
+                     fht_body_bytes<K, V, Slots>(size));
     }
 };
 
 
-template<typename K, typename V>
+template<typename K, typename V, uint32_t Slots>
 struct DEFAULT_ALLOC {
-    fht_chunk<K, V> *
+    typedef fht_chunk<K, V, Slots> chunk_t;
+
+    // an extra line after the chunks is in a sense null term for iterator.
+    // fht_dense_tags bodies go after that
+    chunk_t *
     allocate(const size_t size) const {
+        // aligned_alloc wants a multiple of the alignment
+        const size_t align = fht_tag_bytes<K, V, Slots>();
+        const size_t bytes = size * sizeof(chunk_t) + FHT_TAGS_PER_CLINE +
+                             fht_body_bytes<K, V, Slots>(size);
         int8_t * const ret = (int8_t * const)aligned_alloc(
-            FHT_TAGS_PER_CLINE,
-            size * sizeof(fht_chunk<K, V>) +
-                1);  // + 1 is in a sense null term for iterator
-        ret[size * sizeof(fht_chunk<K, V>)] = 0;
-        return (fht_chunk<K, V> *)ret;
+            align,
+            (bytes + align - 1) & (~(align - 1)));
+        memset(ret + size * sizeof(chunk_t), 0, sizeof(fht_tag_t<K, V>));
+        fht_set_bodies<K, V, Slots>(
+            (chunk_t *)ret,
+            size,
+            ret + size * sizeof(chunk_t) + FHT_TAGS_PER_CLINE);
+        return (chunk_t *)ret;
     }
     void
-    deallocate(fht_chunk<K, V> * const ptr, const size_t size) const {
+    deallocate(chunk_t * const ptr, const size_t size) const {
         free(ptr);
     }
 };
@@ -1651,17 +7014,28 @@ struct DEFAULT_ALLOC {
 #undef PREFETCH_BOUND
 #undef FHT_PASS_BY_VAL_THRESH
 #undef CONTENT_BITS
-#undef FHT_IS_ERASED
-#undef FHT_SET_ERASED
-#undef FHT_MM_SET
-#undef FHT_MM_MASK
-#undef FHT_MM_EMPTY
-#undef FHT_MM_EMPTY_OR_ERASED
+#undef WIDE_CONTENT_BITS
+#undef FHT_AVX2_TARGET
+#undef FHT_AVX512_TARGET
+#undef FHT_ISA_INLINE
 #undef FHT_TO_MASK
 #undef FHT_GET_NTH_BIT
 #undef FHT_HASH_TO_IDX
+#undef FHT_CHUNK_SLOTS
+#undef FHT_LOG_CHUNK_SLOTS
+#undef FHT_CHUNK_LINES
+#undef FHT_CHUNK_LINE_MASK
+#undef FHT_MIN_SIZE
+#undef FHT_TAG_BYTES_MASK
+#undef FHT_TAG_PTR_TO_IDX
 #undef FHT_GEN_TAG
 #undef FHT_GEN_START_IDX
+#undef FHT_NUM_CHUNKS
+#undef FHT_CHUNK_MASK
+#undef FHT_NEXT_CHUNK
+#undef FHT_TSAN
+#undef FHT_RACY_READS_BEGIN
+#undef FHT_RACY_READS_END
 #undef mymmap_alloc
 
 //////////////////////////////////////////////////////////////////////
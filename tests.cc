@@ -1,10 +1,59 @@
 #include "fht_ht.hpp"
 
 #include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
 #include <vector>
 #include <iostream>
 
 
+// string keyed tables with 64 bit values keep the hash of each node (see
+// str_u64_stored_hash_small)
+template<>
+struct fht_store_hash<std::string, uint64_t> : std::true_type {};
+
+// and 64 bit keys with string values keep keys and values apart (see
+// u64_str_separate_kv_small)
+template<>
+struct fht_separate_kv<uint64_t, std::string> : std::true_type {};
+
+// <uint32_t, uint64_t> tables keep the bodies out of the chunk array (see
+// u32_u64_dense_tags_small)
+template<>
+struct fht_dense_tags<uint32_t, uint64_t> : std::true_type {};
+
+// tables with int32_t values use 16 bit tags, with 64 bit keys the bodies are
+// out of the chunk array too (see wide_tags_small)
+template<>
+struct fht_wide_tags<std::string, int32_t> : std::true_type {};
+template<>
+struct fht_wide_tags<uint64_t, int32_t> : std::true_type {};
+template<>
+struct fht_dense_tags<uint64_t, int32_t> : std::true_type {};
+
+// and tables with 64 bit values have chunks of other sizes. 16 / 128 slots
+// plain, 32 with the bodies apart and 128 with 16 bit tags (see
+// chunk_slots_small)
+template<>
+struct fht_chunk_slots<uint64_t, uint32_t>
+    : std::integral_constant<uint32_t, 16> {};
+template<>
+struct fht_chunk_slots<uint32_t, int64_t>
+    : std::integral_constant<uint32_t, 32> {};
+template<>
+struct fht_dense_tags<uint32_t, int64_t> : std::true_type {};
+template<>
+struct fht_chunk_slots<uint64_t, int64_t>
+    : std::integral_constant<uint32_t, 128> {};
+template<>
+struct fht_chunk_slots<std::string, int64_t>
+    : std::integral_constant<uint32_t, 128> {};
+template<>
+struct fht_wide_tags<std::string, int64_t> : std::true_type {};
+
+
 #define unit_change (1000)
 #define ns_per_sec  (unit_change * unit_change * unit_change)
 uint64_t
@@ -51,6 +100,20 @@ s_diff(struct timespec t1, struct timespec t2) {
 }
 
 
+// resident set size of the process in bytes
+uint64_t
+get_rss() {
+    uint64_t size = 0, resident = 0;
+    FILE *   fp   = fopen("/proc/self/statm", "r");
+    if (fp != NULL) {
+        const int nread = fscanf(fp, "%lu %lu", &size, &resident);
+        assert(nread == 2);
+        fclose(fp);
+    }
+    return resident * (uint64_t)sysconf(_SC_PAGESIZE);
+}
+
+
 template<typename K, typename V>
 struct tester {
     uint32_t       test_size;
@@ -109,6 +172,62 @@ struct tester {
         assert(t.size() == test_size);
     }
 
+    void
+    run_reserve_insert_perf_test() {
+        fht_table<K, V> t;
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        t.reserve(test_size);
+        const uint64_t reserved_size = t.max_size();
+        for (uint32_t i = 0; i < test_size; i++) {
+            t[keys[i]];
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        fprintf(stderr, "Ms: %lu\n", ms_diff(end, start));
+        assert(t.size() == test_size);
+
+        // reserve should have made room for everything
+        assert(t.max_size() == reserved_size);
+    }
+
+    // same pairs added one at a time (after a reserve so neither grows mid
+    // way) and with insert_many
+    void
+    run_insert_many_perf_test() {
+        std::vector<std::pair<K, V>> pairs;
+        for (uint32_t i = 0; i < test_size; i++) {
+            pairs.push_back(std::pair<K, V>(keys[i], vals[i]));
+        }
+
+        struct timespec start, end;
+        {
+            fht_table<K, V> t;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            t.reserve(test_size);
+            for (uint32_t i = 0; i < test_size; i++) {
+                t.emplace(pairs[i].first, pairs[i].second);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            fprintf(stderr, "Per Key Ms: %lu\n", ms_diff(end, start));
+            assert(t.size() == test_size);
+        }
+
+        fht_table<K, V> t;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        const uint64_t nadded = t.insert_many(pairs.begin(), pairs.end());
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        fprintf(stderr, "insert_many Ms: %lu\n", ms_diff(end, start));
+        assert(nadded == test_size);
+        assert(t.size() == test_size);
+        for (uint32_t i = 0; i < test_size; i++) {
+            assert(t.find(keys[i])->second == vals[i]);
+        }
+
+        // all duplicates so nothing changes
+        assert(t.insert_many(pairs.begin(), pairs.begin() + 1000) == 0);
+        assert(t.size() == test_size);
+    }
+
     void
     run_insert_find_perf_test() {
         fht_table<K, V> t;
@@ -127,6 +246,179 @@ struct tester {
         assert(t.size() == test_size);
     }
 
+    // same lookups (random order so most miss cache) one at a time and
+    // batched
+    void
+    run_find_many_perf_test() {
+        fht_table<K, V> t;
+        for (uint32_t i = 0; i < test_size; i++) {
+            t[keys[i]];
+        }
+
+        // every other probe misses
+        std::vector<K> probes;
+        for (uint32_t i = 0; i < test_size; i++) {
+            probes.push_back(keys[i]);
+            K _miss_k;
+            initializer(_miss_k, test_size + i);
+            probes.push_back(_miss_k);
+        }
+        for (uint64_t i = probes.size() - 1; i > 0; i--) {
+            std::swap(probes[i], probes[(uint64_t)rand() % (i + 1)]);
+        }
+
+        uint64_t        found = 0;
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (uint32_t i = 0; i < probes.size(); i++) {
+            found += (t.find(probes[i]) != t.end());
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        assert(found == test_size);
+        fprintf(stderr, "Scalar Find Ms: %lu\n", ms_diff(end, start));
+
+        std::vector<typename fht_table<K, V>::fht_iterator> res(probes.size(),
+                                                                t.end());
+        found = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        t.find_many(probes.data(), probes.size(), res.data());
+        for (uint32_t i = 0; i < probes.size(); i++) {
+            found += (res[i] != t.end());
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        assert(found == test_size);
+        fprintf(stderr, "find_many Ms: %lu\n", ms_diff(end, start));
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        found = t.count_many(probes.data(), probes.size());
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        assert(found == test_size);
+        fprintf(stderr, "count_many Ms: %lu\n", ms_diff(end, start));
+    }
+
+    // sliding window of erase / insert which leaves tombstones in full lines.
+    // With and without erase purging them
+    void
+    run_churn_find_perf_test() {
+        const double   max_erased[] = { 0.0, FHT_MAX_ERASED_RATIO };
+        const uint32_t window       = (test_size / 10) * 7;
+        for (uint32_t p = 0; p < sizeof(max_erased) / sizeof(max_erased[0]);
+             p++) {
+            fht_table<K, V>   t;
+            fht_growth_policy growth = t.growth_policy();
+            growth.max_erased        = max_erased[p];
+            t.growth_policy(growth);
+
+            for (uint32_t i = 0; i < window; i++) {
+                t[keys[i]];
+            }
+
+            uint64_t        found = 0;
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (uint32_t i = window; i < test_size; i++) {
+                t.erase(keys[i - window]);
+                t[keys[i]];
+                found += t.count(keys[i - window]);
+                found += t.count(keys[i - window / 2]);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            assert(found == test_size - window);
+            assert(t.size() == window);
+
+            fprintf(stderr,
+                    "Max Erased: %.3f, Ms: %lu\n",
+                    max_erased[p],
+                    ms_diff(end, start));
+        }
+    }
+
+    // worst single insert with the whole rehash in one add() vs incremental
+    void
+    run_insert_latency_test() {
+        const uint32_t migrate_chunks[] = { 0, 4 };
+        for (uint32_t p = 0;
+             p < sizeof(migrate_chunks) / sizeof(migrate_chunks[0]);
+             p++) {
+            fht_table<K, V>   t;
+            fht_growth_policy growth = t.growth_policy();
+            growth.migrate_chunks    = migrate_chunks[p];
+            t.growth_policy(growth);
+
+            uint64_t        max_ns = 0;
+            struct timespec start, end, op_start, op_end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (uint32_t i = 0; i < test_size; i++) {
+                clock_gettime(CLOCK_MONOTONIC, &op_start);
+                t[keys[i]];
+                clock_gettime(CLOCK_MONOTONIC, &op_end);
+                if (ns_diff(op_end, op_start) > max_ns) {
+                    max_ns = ns_diff(op_end, op_start);
+                }
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            assert(t.size() == test_size);
+
+            fprintf(stderr,
+                    "Migrate Chunks: %u, Max Insert Us: %lu, Ms: %lu\n",
+                    migrate_chunks[p],
+                    max_ns / 1000,
+                    ms_diff(end, start));
+        }
+    }
+
+    // memory vs speed at different growth policies
+    void
+    run_load_factor_perf_test() {
+        // everything but the load factors left at 0 (never shrink / purge)
+        auto policy = [](const double   max_load,
+                         const uint64_t huge_size,
+                         const double   huge_max_load) {
+            fht_growth_policy growth = fht_growth_policy();
+            growth.max_load          = max_load;
+            growth.huge_size         = huge_size;
+            growth.huge_max_load     = huge_max_load;
+            return growth;
+        };
+        const fht_growth_policy policies[] = {
+            policy(0.5, (~(0UL)), 0.5),
+            policy(0.75, (~(0UL)), 0.75),
+            policy(0.875, (~(0UL)), 0.875),
+            policy(0.95, (~(0UL)), 0.95),
+            policy(0.75, ((1UL) << 22), 0.95),
+        };
+        for (uint32_t p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+            const uint64_t start_rss = get_rss();
+            uint64_t       found     = 0;
+
+            fht_table<K, V> t;
+            t.growth_policy(policies[p]);
+
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (uint32_t i = 0; i < test_size; i++) {
+                t[keys[i]];
+            }
+            for (uint32_t i = 0; i < test_size; i++) {
+                found += t.count(keys[i]);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            assert(found == test_size);
+
+            fprintf(stderr,
+                    "Max Load: %.3f (%.3f past %lu), Load: %.3f, RSS: %lu MB, "
+                    "Ops/Sec: %.2f M, Ms: %lu\n",
+                    policies[p].max_load,
+                    policies[p].huge_max_load,
+                    policies[p].huge_size == (~(0UL)) ? 0
+                                                      : policies[p].huge_size,
+                    t.load_factor(),
+                    (get_rss() - start_rss) / (1024 * 1024),
+                    (2.0 * test_size) / ((double)ns_diff(end, start) / 1000.0),
+                    ms_diff(end, start));
+        }
+    }
+
     void
     run_insert_del_perf_test() {
     fht_table<K, V> t;
@@ -363,12 +655,129 @@ struct tester {
 
 
 static void u32_u32_defaults_small();
+static void u32_u32_overflow_small();
+static void u32_u32_inplace_crossed_small();
+template<typename Allocator>
+static void u32_u32_shrink_small();
+static void u32_u32_tombstone_small();
+static void u32_u32_incremental_small();
+template<typename Allocator>
+static void u32_u32_rehash_threads_small();
+template<typename Allocator>
+static void u32_u32_build_parallel_small();
+template<typename V, typename ValFn>
+static void chunk_range_small(ValFn val_of);
+template<typename K, typename KeyFn>
+static void sharded_small(KeyFn key_of);
+static void sharded_wide_tags_small();
+template<typename K>
+struct CLUMP_HASH;
+template<typename K, typename Hasher, typename KeyFn>
+static void striped_small(KeyFn key_of);
+static void seqlock_small();
+template<typename K, typename Hasher, typename KeyFn>
+static void cas_small(KeyFn key_of);
+static void str_u32_str_ref_small();
+static void str_u32_hashed_small();
+template<typename Allocator>
+static void str_u64_stored_hash_small();
+template<typename Allocator>
+static void u64_str_separate_kv_small();
+template<typename Allocator>
+static void u32_u64_dense_tags_small();
+template<typename K, typename Allocator>
+static void wide_tags_small();
+static void wide_tags_many_chunks_small();
+template<typename K,
+         typename V,
+         typename Allocator,
+         uint32_t Slots = fht_chunk_slots<K, V>::value>
+static void chunk_slots_small();
+template<typename Allocator>
+static void u32_u32_two_slots_small();
+static void tag_ops_small();
 
 int
 main() {
 
     fprintf(stderr, "Doing Small Test\n");
     //    u32_u32_defaults_small();
+    u32_u32_overflow_small();
+    u32_u32_inplace_crossed_small();
+    u32_u32_shrink_small<DEFAULT_ALLOC<uint32_t, uint32_t>>();
+    u32_u32_shrink_small<INPLACE_MMAP_ALLOC<uint32_t, uint32_t>>();
+    u32_u32_tombstone_small();
+    u32_u32_incremental_small();
+    u32_u32_rehash_threads_small<DEFAULT_ALLOC<uint32_t, uint32_t>>();
+    u32_u32_rehash_threads_small<INPLACE_MMAP_ALLOC<uint32_t, uint32_t>>();
+    u32_u32_build_parallel_small<DEFAULT_ALLOC<uint32_t, uint32_t>>();
+    u32_u32_build_parallel_small<INPLACE_MMAP_ALLOC<uint32_t, uint32_t>>();
+    chunk_range_small<uint32_t>(
+        [](const uint64_t i) { return (uint32_t)(i + 1); });
+    chunk_range_small<std::string>(
+        [](const uint64_t i) { return std::to_string(i); });
+    sharded_small<uint32_t>([](const uint32_t i) { return i; });
+    sharded_small<std::string>(
+        [](const uint32_t i) { return std::to_string(i); });
+    sharded_wide_tags_small();
+    striped_small<uint32_t, CLUMP_HASH<uint32_t>>(
+        [](const uint32_t i) { return i; });
+    striped_small<std::string, DEFAULT_HASH_64<std::string>>(
+        [](const uint32_t i) { return std::to_string(i); });
+    seqlock_small();
+    cas_small<uint32_t, CLUMP_HASH<uint32_t>>(
+        [](const uint32_t i) { return i; });
+    cas_small<std::string, DEFAULT_HASH_64<std::string>>(
+        [](const uint32_t i) { return std::to_string(i); });
+    str_u32_str_ref_small();
+    str_u32_hashed_small();
+    str_u64_stored_hash_small<DEFAULT_ALLOC<std::string, uint64_t>>();
+    str_u64_stored_hash_small<INPLACE_MMAP_ALLOC<std::string, uint64_t>>();
+    u64_str_separate_kv_small<DEFAULT_ALLOC<uint64_t, std::string>>();
+    u64_str_separate_kv_small<INPLACE_MMAP_ALLOC<uint64_t, std::string>>();
+    u32_u64_dense_tags_small<DEFAULT_ALLOC<uint32_t, uint64_t>>();
+    u32_u64_dense_tags_small<DEFAULT_MMAP_ALLOC<uint32_t, uint64_t>>();
+    u32_u64_dense_tags_small<INPLACE_MMAP_ALLOC<uint32_t, uint64_t>>();
+    wide_tags_small<std::string, DEFAULT_ALLOC<std::string, int32_t>>();
+    wide_tags_small<std::string, DEFAULT_MMAP_ALLOC<std::string, int32_t>>();
+    wide_tags_small<std::string, INPLACE_MMAP_ALLOC<std::string, int32_t>>();
+    wide_tags_small<uint64_t, DEFAULT_ALLOC<uint64_t, int32_t>>();
+    wide_tags_small<uint64_t, INPLACE_MMAP_ALLOC<uint64_t, int32_t>>();
+    wide_tags_many_chunks_small();
+    chunk_slots_small<uint64_t, uint32_t, DEFAULT_ALLOC<uint64_t, uint32_t>>();
+    chunk_slots_small<uint64_t,
+                      uint32_t,
+                      INPLACE_MMAP_ALLOC<uint64_t, uint32_t>>();
+    chunk_slots_small<uint32_t, int64_t, DEFAULT_ALLOC<uint32_t, int64_t>>();
+    chunk_slots_small<uint32_t,
+                      int64_t,
+                      INPLACE_MMAP_ALLOC<uint32_t, int64_t>>();
+    chunk_slots_small<uint64_t, int64_t, DEFAULT_ALLOC<uint64_t, int64_t>>();
+    chunk_slots_small<uint64_t,
+                      int64_t,
+                      INPLACE_MMAP_ALLOC<uint64_t, int64_t>>();
+    chunk_slots_small<std::string,
+                      int64_t,
+                      DEFAULT_MMAP_ALLOC<std::string, int64_t>>();
+    chunk_slots_small<std::string,
+                      int64_t,
+                      INPLACE_MMAP_ALLOC<std::string, int64_t>>();
+    chunk_slots_small<uint32_t,
+                      uint32_t,
+                      DEFAULT_ALLOC<uint32_t, uint32_t>,
+                      16>();
+    chunk_slots_small<uint32_t,
+                      uint32_t,
+                      INPLACE_MMAP_ALLOC<uint32_t, uint32_t>,
+                      32>();
+    chunk_slots_small<uint32_t,
+                      uint32_t,
+                      DEFAULT_MMAP_ALLOC<uint32_t, uint32_t>,
+                      128>();
+    u32_u32_two_slots_small<DEFAULT_ALLOC<uint32_t, uint32_t>>();
+    u32_u32_two_slots_small<DEFAULT_MMAP_ALLOC<uint32_t, uint32_t>>();
+    u32_u32_two_slots_small<INPLACE_MMAP_ALLOC<uint32_t, uint32_t>>();
+    tag_ops_small();
 
     fprintf(stderr, "Doing 10 Million <int, int>\n");
     tester<uint32_t, uint32_t> t(2 * 1000 * 1000);
@@ -382,6 +791,31 @@ main() {
     tester<uint64_t, uint64_t> t3(10 * 1000 * 1000);
     t3.run_insert_find_perf_test();
 
+    fprintf(stderr, "Doing 10 Million <int64, int64> Find Many\n");
+    t3.run_find_many_perf_test();
+
+    fprintf(stderr, "Doing 10 Million <int64, int64> Insert\n");
+    t3.run_insert_perf_test();
+
+    fprintf(stderr, "Doing 10 Million <int64, int64> Reserve + Insert\n");
+    t3.run_reserve_insert_perf_test();
+
+    fprintf(stderr, "Doing 10 Million <int64, int64> Insert Many\n");
+    t3.run_insert_many_perf_test();
+
+    fprintf(stderr, "Doing 10 Million <int64, int64> Churn\n");
+    t3.run_churn_find_perf_test();
+
+    fprintf(stderr, "Doing 10 Million <int64, int64> Insert Latency\n");
+    t3.run_insert_latency_test();
+
+    // 14 million keys end in 2^25 slots with max loads 0.5 / 0.75 and in
+    // 2^24 with 0.875 / 0.95 (and the huge policy) so the higher loads show
+    // up as half the rss
+    fprintf(stderr, "Doing 14 Million <int64, int64> Load Factors\n");
+    tester<uint64_t, uint64_t> t6(14 * 1000 * 1000);
+    t6.run_load_factor_perf_test();
+
     fprintf(stderr, "Doing 2 Million <string, string>\n");
     tester<std::string, std::string> t4(2 * 1000 * 1000);
     t4.run_insert_find_perf_test();
@@ -389,6 +823,9 @@ main() {
     fprintf(stderr, "Doing 10 Million <string, int>\n");
     tester<std::string, uint32_t> t5(4 * 1000 * 1000);
     t5.run_insert_find_perf_test();
+
+    fprintf(stderr, "Doing 4 Million <string, int> Find Many\n");
+    t5.run_find_many_perf_test();
 }
 
 // some very explicit tests going through basic functionality
@@ -463,3 +900,1419 @@ u32_u32_defaults_small() {
     assert(t.size() == 0);
     assert(t.size() == manual_count);
 }
+
+// hashes every key to chunk 0 so that everything past the first 64 keys has to
+// overflow into other chunks
+template<typename K>
+struct OVERFLOW_HASH {
+    constexpr uint64_t
+    operator()(const K key) const {
+        return (((uint64_t)key) * 0x9E3779B97F4A7C15UL) &
+               (~((0xffffffffUL) << 7));
+    }
+};
+
+static void
+u32_u32_overflow_small() {
+    const uint32_t n = 300;
+    fht_table<uint32_t, uint32_t, OVERFLOW_HASH<uint32_t>> t(4096);
+
+    for (uint32_t i = 0; i < n; i++) {
+        auto p = t.emplace(i, i + 1);
+        assert(p.second);
+    }
+    // should not have grown, 300 keys is well under max load factor
+    assert(t.max_size() == 4096);
+    assert(t.size() == n);
+
+    for (uint32_t i = 0; i < n; i++) {
+        auto it = t.find(i);
+        assert(it != t.end());
+        assert(it->second == i + 1);
+        assert(!t.emplace(i, i).second);
+    }
+    assert(t.find(n) == t.end());
+
+    // erasing from the full home chunk has to leave tombstones so keys that
+    // overflowed can still be found
+    for (uint32_t i = 0; i < n; i += 2) {
+        assert(t.erase(i));
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        assert((t.find(i) != t.end()) == (i & 1));
+    }
+    for (uint32_t i = 0; i < n; i += 2) {
+        assert(t.emplace(i, i + 1).second);
+    }
+    assert(t.size() == n);
+
+    t.rehash();
+    assert(t.max_size() == 8192);
+    assert(t.size() == n);
+
+    uint32_t manual_count = 0;
+    for (auto it = t.begin(); it < t.end(); ++it) {
+        assert(it->second == it->first + 1);
+        manual_count++;
+    }
+    assert(manual_count == n);
+
+    for (uint32_t i = 0; i < n; i++) {
+        auto it = t.find(i);
+        assert(it != t.end());
+        assert(it->second == i + 1);
+    }
+
+    // multiple levels at once
+    t.rehash(100000);
+    assert(t.max_size() == 131072);
+    assert(t.size() == n);
+    for (uint32_t i = 0; i < n; i++) {
+        auto it = t.find(i);
+        assert(it != t.end());
+        assert(it->second == i + 1);
+    }
+
+    // and back down, chunk 0 can only keep 64 of them
+    t.shrink_to_fit();
+    assert(t.max_size() == 512);
+    assert(t.size() == n);
+    for (uint32_t i = 0; i < n; i++) {
+        auto it = t.find(i);
+        assert(it != t.end());
+        assert(it->second == i + 1);
+    }
+}
+
+// odd keys only hash to every 4th chunk so they overflow
+template<typename K>
+struct CLUMP_HASH {
+    constexpr uint64_t
+    operator()(const K key) const {
+        return (key & 1) ? ((((uint64_t)key) * 0x9E3779B97F4A7C15UL) &
+                            (~((3UL) << 7)))
+                         : (((uint64_t)key) * 0x9E3779B97F4A7C15UL);
+    }
+};
+
+// key / 1000 is the start line, everything else stays in chunk 0 (and stays
+// in chunk 0 on rehash)
+template<typename K>
+struct LINE_HASH {
+    constexpr uint64_t
+    operator()(const K key) const {
+        return (((uint64_t)(key / 1000)) << 61) | (((uint64_t)key) << 32);
+    }
+};
+
+// inplace split of a chunk where line 0 holds a node that wants line 3 and
+// line 1 holds one that wants line 0. Line 0 can't make room for it until
+// line 3 has taken its node so the split can't just go line by line
+static void
+u32_u32_inplace_crossed_small() {
+    fht_table<uint32_t,
+              uint32_t,
+              LINE_HASH<uint32_t>,
+              INPLACE_MMAP_ALLOC<uint32_t, uint32_t>>
+        t(4096);
+
+    for (uint32_t i = 0; i < 16; i++) {
+        assert(t.emplace(3000 + i, i).second);
+    }
+    // line 3 is full so goes to line 0
+    assert(t.emplace(3100u, 0u).second);
+    for (uint32_t i = 0; i < 15; i++) {
+        assert(t.emplace(i, i).second);
+    }
+    // line 0 is full so goes to line 1
+    assert(t.emplace(100u, 0u).second);
+    for (uint32_t i = 0; i < 15; i++) {
+        assert(t.emplace(1000 + i, i).second);
+    }
+    assert(t.erase(3000));
+
+    t.rehash();
+    assert(t.max_size() == 8192);
+    assert(t.size() == 47);
+    assert(t.find(3000) == t.end());
+    assert(t.find(3100) != t.end());
+    assert(t.find(100) != t.end());
+    for (uint32_t i = 0; i < 15; i++) {
+        assert(t.find(3001 + i) != t.end());
+        assert(t.find(i) != t.end());
+        assert(t.find(1000 + i) != t.end());
+    }
+
+    // same thing but from chunks that overflowed, at a low load
+    const uint32_t n = 200000;
+    fht_table<uint32_t,
+              uint32_t,
+              CLUMP_HASH<uint32_t>,
+              INPLACE_MMAP_ALLOC<uint32_t, uint32_t>>
+        ct;
+    for (uint32_t i = 0; i < n; i++) {
+        assert(ct.emplace(i, i + 1).second);
+    }
+    for (uint32_t r = 0; r < 3; r++) {
+        for (uint32_t i = r; i < n; i += 3) {
+            assert(ct.erase(i));
+        }
+        ct.rehash();
+        for (uint32_t i = 0; i < n; i++) {
+            auto it = ct.find(i);
+            assert((it != ct.end()) == (i % 3 != r));
+            assert(it == ct.end() || it->second == i + 1);
+        }
+        for (uint32_t i = r; i < n; i += 3) {
+            assert(ct.emplace(i, i + 1).second);
+        }
+        assert(ct.size() == n);
+    }
+}
+
+template<typename Allocator>
+static void
+u32_u32_shrink_small() {
+    const uint32_t n = 100000;
+    const uint32_t m = 1000;
+    fht_table<uint32_t, uint32_t, DEFAULT_HASH_64<uint32_t>, Allocator> t;
+
+    for (uint32_t i = 0; i < n; i++) {
+        assert(t.emplace(i, i + 1).second);
+    }
+    const uint64_t peak_size = t.max_size();
+
+    // by default erase never gives memory back
+    for (uint32_t i = m; i < n; i++) {
+        assert(t.erase(i));
+    }
+    assert(t.max_size() == peak_size);
+
+    t.shrink_to_fit();
+    assert(t.max_size() == 2048);
+    assert(t.size() == m);
+
+    uint32_t manual_count = 0;
+    for (auto it = t.begin(); it < t.end(); ++it) {
+        assert(it->second == it->first + 1);
+        manual_count++;
+    }
+    assert(manual_count == m);
+    for (uint32_t i = 0; i < n; i++) {
+        assert((t.find(i) != t.end()) == (i < m));
+    }
+
+    // with min_load set erase halves the table as it drains
+    fht_growth_policy growth = t.growth_policy();
+    growth.min_load          = 0.2;
+    t.growth_policy(growth);
+
+    for (uint32_t i = m; i < n; i++) {
+        assert(t.emplace(i, i + 1).second);
+    }
+    assert(t.max_size() == peak_size);
+    for (uint32_t i = m; i < n; i++) {
+        assert(t.erase(i));
+    }
+    assert(t.max_size() == 4096);
+    assert(t.size() == m);
+
+    manual_count = 0;
+    for (auto it = t.begin(); it < t.end(); ++it) {
+        assert(it->second == it->first + 1);
+        manual_count++;
+    }
+    assert(manual_count == m);
+    for (uint32_t i = 0; i < n; i++) {
+        auto it = t.find(i);
+        assert((it != t.end()) == (i < m));
+        assert(i >= m || it->second == i + 1);
+    }
+}
+
+static void
+u32_u32_tombstone_small() {
+    const uint32_t n = 300;
+    fht_table<uint32_t, uint32_t, OVERFLOW_HASH<uint32_t>> t(4096);
+
+    // only purge by hand for now
+    fht_growth_policy growth = t.growth_policy();
+    growth.max_erased        = 0.0;
+    t.growth_policy(growth);
+
+    for (uint32_t i = 0; i < n; i++) {
+        assert(t.emplace(i, i + 1).second);
+    }
+
+    // chunk 0 is full so these leave tombstones
+    for (uint32_t i = 0; i < n; i += 2) {
+        assert(t.erase(i));
+    }
+    t.purge_tombstones();
+    assert(t.max_size() == 4096);
+    assert(t.size() == n / 2);
+
+    uint32_t manual_count = 0;
+    for (auto it = t.begin(); it < t.end(); ++it) {
+        assert(it->second == it->first + 1);
+        manual_count++;
+    }
+    assert(manual_count == n / 2);
+    for (uint32_t i = 0; i < n; i++) {
+        assert((t.find(i) != t.end()) == (i & 1));
+    }
+
+    for (uint32_t i = 0; i < n; i += 2) {
+        assert(t.emplace(i, i + 1).second);
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        auto it = t.find(i);
+        assert(it != t.end());
+        assert(it->second == i + 1);
+    }
+
+    // purge as soon as there are 40 tombstones
+    growth.max_erased = 0.01;
+    t.growth_policy(growth);
+    for (uint32_t r = 0; r < 4; r++) {
+        for (uint32_t i = r; i < n; i += 4) {
+            assert(t.erase(i));
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            assert((t.find(i) != t.end()) == ((i & 3) > r));
+        }
+    }
+    assert(t.empty());
+    assert(t.max_size() == 4096);
+}
+
+static void
+u32_u32_incremental_small() {
+    const uint32_t n = 100000;
+    fht_table<uint32_t, uint32_t> t;
+
+    fht_growth_policy growth = t.growth_policy();
+    growth.migrate_chunks    = 1;
+    t.growth_policy(growth);
+
+    // key i - 3 gets erased when adding i if i % 7 == 0
+    auto erased = [](const uint32_t key, const uint32_t added) {
+        return (key + 3) <= added && ((key + 3) % 7) == 0;
+    };
+
+    // finds / erases / duplicate adds all have to check both arrays in the
+    // middle of a resize
+    for (uint32_t i = 0; i < n; i++) {
+        assert(t.emplace(i, i + 1).second);
+        if ((i % 7) == 0 && i >= 3) {
+            assert(t.erase(i - 3));
+            assert(!t.erase(i - 3));
+        }
+
+        const uint32_t old_key = i / 2;
+        auto           it      = t.find(old_key);
+        assert((it != t.end()) == !erased(old_key, i));
+        assert(it == t.end() || it->second == old_key + 1);
+        if (it != t.end()) {
+            assert(!t.emplace(old_key, 0).second);
+        }
+    }
+
+    uint32_t expec = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        assert((t.find(i) != t.end()) == !erased(i, n - 1));
+        expec += !erased(i, n - 1);
+    }
+    assert(t.size() == expec);
+
+    uint32_t manual_count = 0;
+    for (auto it = t.begin(); it < t.end(); ++it) {
+        assert(it->second == it->first + 1);
+        manual_count++;
+    }
+    assert(manual_count == expec);
+}
+
+// rehash / reserve split across threads (see rehash_threads). Each thread
+// also has overflowed nodes to hand back
+template<typename Allocator>
+static void
+u32_u32_rehash_threads_small() {
+    const uint32_t n = 300000;
+    fht_table<uint32_t, uint32_t, CLUMP_HASH<uint32_t>, Allocator> t;
+
+    fht_growth_policy growth = t.growth_policy();
+    growth.rehash_threads    = 4;
+    t.growth_policy(growth);
+
+    auto check = [&]() {
+        assert(t.size() == n);
+        uint32_t manual_count = 0;
+        for (auto it = t.begin(); it < t.end(); ++it) {
+            assert(it->second == it->first + 1);
+            manual_count++;
+        }
+        assert(manual_count == n);
+        for (uint32_t i = 0; i < n + 1000; i++) {
+            auto it = t.find(i);
+            assert((it != t.end()) == (i < n));
+            assert(i >= n || it->second == i + 1);
+        }
+    };
+
+    for (uint32_t i = 0; i < n; i++) {
+        assert(t.emplace(i, i + 1).second);
+    }
+    // last few rehashes had enough chunks to use all 4 threads
+    assert(fht_parallel_threads(
+               t.max_size() / 2 / fht_chunk_slots<uint32_t, uint32_t>::value,
+               4) == 4);
+    check();
+
+    // one level (rehash()) and several at once (_grow_to)
+    t.rehash();
+    check();
+    t.reserve(8 * n);
+    check();
+
+    for (uint32_t i = 0; i < n; i++) {
+        assert(!t.emplace(i, 0).second);
+    }
+    check();
+}
+
+// bulk build across threads into a table that already has some of the keys
+// (and tombstones). Odd keys overflow their home chunks so some keys are left
+// for after the threads are done
+template<typename Allocator>
+static void
+u32_u32_build_parallel_small() {
+    const uint32_t n = 300000;
+    const uint32_t m = 20000;
+    fht_table<uint32_t, uint32_t, CLUMP_HASH<uint32_t>, Allocator> t;
+
+    for (uint32_t i = 0; i < m; i++) {
+        assert(t.emplace(i, i + 1).second);
+    }
+    for (uint32_t i = 0; i < m; i += 5) {
+        assert(t.erase(i));
+    }
+
+    // every key twice, the second copy's value shouldn't be used
+    std::vector<std::pair<uint32_t, uint32_t>> pairs;
+    for (uint32_t i = 0; i < n; i++) {
+        pairs.push_back(std::pair<uint32_t, uint32_t>(i, i + 1));
+    }
+    for (uint32_t i = 0; i < n; i += 3) {
+        pairs.push_back(std::pair<uint32_t, uint32_t>(i, 0));
+    }
+
+    const uint64_t nadded = t.build_parallel(pairs.begin(), pairs.end(), 4);
+    assert(fht_parallel_threads(
+               t.max_size() / fht_chunk_slots<uint32_t, uint32_t>::value,
+               4) == 4);
+    assert(nadded == n - (m - m / 5));
+    assert(t.size() == n);
+
+    uint32_t manual_count = 0;
+    for (auto it = t.begin(); it < t.end(); ++it) {
+        assert(it->second == it->first + 1);
+        manual_count++;
+    }
+    assert(manual_count == n);
+    for (uint32_t i = 0; i < n + 1000; i++) {
+        auto it = t.find(i);
+        assert((it != t.end()) == (i < n));
+        assert(i >= n || it->second == i + 1);
+    }
+
+    // table is still fine to use
+    for (uint32_t i = 0; i < n; i += 2) {
+        assert(t.erase(i));
+    }
+    for (uint32_t i = n; i < n + 1000; i++) {
+        assert(t.emplace(i, i + 1).second);
+    }
+    for (uint32_t i = 0; i < n + 1000; i++) {
+        assert((t.find(i) != t.end()) == ((i & 1) || i >= n));
+    }
+}
+
+// scans split by chunk (chunk_range() / parallel_for_each()) see every pair
+// once. Key 7 * i has value val_of(i)
+template<typename V, typename ValFn>
+static void
+chunk_range_small(ValFn val_of) {
+    const uint32_t         n = 300000;
+    fht_table<uint64_t, V> t;
+
+    for (uint32_t i = 0; i < n; i++) {
+        assert(t.emplace(7 * (uint64_t)i, val_of(i)).second);
+    }
+    for (uint32_t i = 0; i < n; i += 3) {
+        assert(t.erase(7 * (uint64_t)i));
+    }
+    uint64_t expec_sum = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        expec_sum += (i % 3) ? i : 0;
+    }
+
+    // uneven split on purpose, each range by iterator and by for_each
+    const uint32_t nranges = 7;
+    uint64_t       it_count = 0, it_sum = 0, mask_count = 0, mask_sum = 0;
+    for (uint32_t r = 0; r < nranges; r++) {
+        const uint32_t b =
+            (uint32_t)(((uint64_t)t.num_chunks() * r) / nranges);
+        const uint32_t e =
+            (uint32_t)(((uint64_t)t.num_chunks() * (r + 1)) / nranges);
+        auto range = t.chunk_range(b, e);
+        for (auto it = range.begin(); it != range.end(); ++it) {
+            assert(it->second == val_of(it->first / 7));
+            it_count++;
+            it_sum += it->first / 7;
+        }
+        range.for_each([&](const uint64_t & key, const V & val) {
+            assert(val == val_of(key / 7));
+            mask_count++;
+            mask_sum += key / 7;
+        });
+    }
+    assert(it_count == t.size() && it_sum == expec_sum);
+    assert(mask_count == t.size() && mask_sum == expec_sum);
+    assert(t.chunk_range(0, 0).begin() == t.chunk_range(0, 0).end());
+    assert(t.chunk_range(0, t.num_chunks()).begin() == t.begin());
+    assert(t.chunk_range(0, t.num_chunks()).end() == t.end());
+
+    std::atomic<uint64_t> par_count(0), par_sum(0);
+    assert(fht_parallel_threads(t.num_chunks(), 4) == 4);
+    t.parallel_for_each(
+        [&](const uint64_t & key, const V & val) {
+            assert(val == val_of(key / 7));
+            par_count++;
+            par_sum += key / 7;
+        },
+        4);
+    assert(par_count == t.size() && par_sum == expec_sum);
+}
+
+// table used from several threads at once. Thread t adds its own keys, looks
+// up everyone's, bumps a few shared counters through operator[] and then
+// erases every other of its keys. side(nbusy) runs on this thread while they
+// do (nbusy is how many of them are still going). Checks what is left and
+// returns how many keys that is
+template<typename Table, typename KeyFn, typename SideFn>
+static uint64_t
+concurrent_small(Table & t, KeyFn key_of, SideFn side) {
+    const uint32_t n        = 200000;
+    const uint32_t nthreads = 4;
+    const uint32_t ncounter = 16;
+
+    for (uint32_t c = 0; c < ncounter; c++) {
+        assert(t.emplace(key_of(n + c), (uint64_t)0));
+    }
+
+    std::atomic<uint32_t>    nbusy(nthreads);
+    std::vector<std::thread> threads;
+    for (uint32_t tid = 0; tid < nthreads; tid++) {
+        threads.emplace_back([&, tid]() {
+            for (uint32_t i = tid; i < n; i += nthreads) {
+                assert(t.emplace(key_of(i), i + 1));
+                assert(!t.emplace(key_of(i), (uint64_t)0));
+
+                uint64_t val = 0;
+                assert(t.find(key_of(i), val) && val == i + 1);
+                // someone else's key, might not be there yet
+                const uint32_t other = (i * 7) % n;
+                if (t.find(key_of(other), val)) {
+                    assert(val == other + 1);
+                }
+                *t[key_of(n + (i % ncounter))] += 1;
+            }
+            // erase every other of this thread's keys
+            for (uint32_t i = tid; i < n; i += 2 * nthreads) {
+                assert(t.erase(key_of(i)) == 1);
+                assert(!t.contains(key_of(i)));
+                assert(!t.erase(key_of(i)));
+            }
+            nbusy--;
+        });
+    }
+    side(nbusy);
+    for (auto & th : threads) {
+        th.join();
+    }
+
+    uint64_t expec_size = ncounter;
+    for (uint32_t i = 0; i < n; i++) {
+        const bool erased = (i % (2 * nthreads)) < nthreads;
+        uint64_t   val    = 0;
+        assert(t.find(key_of(i), val) == !erased);
+        assert(erased || val == i + 1);
+        expec_size += !erased;
+    }
+    assert(t.size() == expec_size);
+    for (uint32_t c = 0; c < ncounter; c++) {
+        uint64_t val = 0;
+        assert(t.find(key_of(n + c), val) && val == n / ncounter);
+        t[key_of(n + c)] = 7UL;
+        assert(t.count(key_of(n + c)) && *t[key_of(n + c)] == 7);
+    }
+    return expec_size;
+}
+
+// fht_sharded_table through concurrent_small
+template<typename K, typename KeyFn>
+static void
+sharded_small(KeyFn key_of) {
+    const uint32_t nshards = 8;
+    fht_sharded_table<K, uint64_t, nshards> t;
+
+    const uint64_t expec_size =
+        concurrent_small(t, key_of, [](const std::atomic<uint32_t> &) {});
+
+    // shard bits don't take away chunk idx bits: every shard has a share of
+    // the keys and every chunk of every shard has some
+    for (uint32_t s = 0; s < nshards; s++) {
+        auto & shard = t.shards[s].table;
+        assert(shard.size() > expec_size / nshards / 2);
+        assert(shard.num_chunks() > 64);
+        for (uint32_t c = 0; c < shard.num_chunks(); c++) {
+            auto range = shard.chunk_range(c, c + 1);
+            assert(range.begin() != range.end());
+        }
+    }
+}
+
+// with 16 bit tags and 8 shards the chunk idx of a shard reaches the bits
+// above 2^26 at 2048 chunks per shard. Shards twice that size still have keys
+// in every chunk
+static void
+sharded_wide_tags_small() {
+    const uint32_t nshards = 8;
+    const uint64_t nchunks = 4096;
+    const uint64_t slots   = fht_chunk_slots<uint64_t, int32_t>::value;
+    const uint32_t n       = 1 << 19;
+    fht_sharded_table<uint64_t, int32_t, nshards> t(nshards * nchunks * slots);
+
+    for (uint32_t i = 0; i < n; i++) {
+        assert(t.emplace(i, (int32_t)i));
+    }
+    assert(t.size() == n);
+
+    for (uint32_t s = 0; s < nshards; s++) {
+        auto & shard = t.shards[s].table;
+        assert(shard.num_chunks() == nchunks);
+        for (uint32_t c = 0; c < shard.num_chunks(); c++) {
+            auto range = shard.chunk_range(c, c + 1);
+            assert(range.begin() != range.end());
+        }
+    }
+}
+
+// fht_striped_table with a thread rehashing along the way. Starts at the
+// smallest size so it grows while being used and CLUMP_HASH keys overflow
+// their home chunks
+template<typename K, typename Hasher, typename KeyFn>
+static void
+striped_small(KeyFn key_of) {
+    fht_striped_table<K, uint64_t, 64, Hasher> t;
+
+    // rehash() doubles the table so only a few times
+    const uint64_t expec_size =
+        concurrent_small(t, key_of, [&](const std::atomic<uint32_t> & nbusy) {
+            for (uint32_t r = 0; r < 3 && nbusy; r++) {
+                t.rehash();
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            }
+        });
+
+    // underlying table is still consistent
+    uint64_t manual_count = 0;
+    for (auto it = t.table.begin(); it != t.table.end(); ++it) {
+        manual_count++;
+    }
+    assert(manual_count == expec_size);
+}
+
+// fht_seqlock_table with readers going the whole time the writer adds,
+// updates and erases. Values are key << 32 | round so a reader that used
+// a half written slot (or one that was reused for another key) would see
+// it. Starts at the smallest size so it grows while being read
+static void
+seqlock_small() {
+    const uint32_t n        = 100000;
+    const uint32_t nreaders = 3;
+    const uint32_t nrounds  = 4;
+    fht_seqlock_table<uint32_t, uint64_t> t;
+
+    std::atomic<bool>        done(false);
+    std::atomic<uint64_t>    nfound(0);
+    std::vector<std::thread> readers;
+    for (uint32_t r = 0; r < nreaders; r++) {
+        readers.emplace_back([&, r]() {
+            uint64_t found = 0;
+            for (uint32_t i = r; !done; i = (i + 7) % n) {
+                uint64_t val;
+                if (t.find(i, val)) {
+                    assert((val >> 32) == i && (uint32_t)val < nrounds);
+                    found++;
+                }
+                found += t.count(i);
+            }
+            nfound += found;
+        });
+    }
+
+    // round r sets every key's round to r and erases those = r mod 4
+    for (uint32_t r = 0; r < nrounds; r++) {
+        for (uint32_t i = 0; i < n; i++) {
+            const uint64_t val = ((uint64_t)i << 32) | r;
+            if (r == 0) {
+                assert(t.emplace(i, val));
+            }
+            else {
+                assert(t.insert_or_assign(i, val) == (i % 4 == r - 1));
+            }
+        }
+        for (uint32_t i = r; i < n; i += 4) {
+            assert(t.erase(i) == 1);
+            assert(!t.erase(i));
+        }
+    }
+    done = true;
+    for (auto & th : readers) {
+        th.join();
+    }
+    assert(nfound > 0);
+    assert(!t.retired.empty());
+
+    // erases never rebuild so the kept tables are the ones grown out of,
+    // each at most half the next
+    uint64_t retired_size = 0;
+    for (const auto * const s : t.retired) {
+        retired_size += s->table.max_size();
+    }
+    assert(retired_size < t.cur.load()->table.max_size());
+    t.reclaim();
+
+    assert(t.size() == n - n / 4);
+    for (uint32_t i = 0; i < n; i++) {
+        uint64_t val;
+        assert(t.find(i, val) == (i % 4 != nrounds - 1));
+        assert(i % 4 == nrounds - 1 ||
+               val == (((uint64_t)i << 32) | (nrounds - 1)));
+    }
+}
+
+// fht_cas_table with every thread adding every key (half of them in the
+// same order, half starting from the middle) so that adds of the same key
+// race. Exactly one add of each key may win and its value has to be the one
+// that stays. Starts at the smallest size so it grows under the adds
+template<typename K, typename Hasher, typename KeyFn>
+static void
+cas_small(KeyFn key_of) {
+    const uint32_t n        = 100000;
+    const uint32_t nthreads = 4;
+    fht_cas_table<K, uint64_t, 64, Hasher> t;
+
+    std::vector<std::atomic<uint32_t>> winner(n);
+    std::atomic<uint32_t>              nadded(0);
+    std::atomic<uint32_t>              ndone(0);
+    std::vector<std::thread>           threads;
+    for (uint32_t tid = 0; tid < nthreads; tid++) {
+        threads.emplace_back([&, tid]() {
+            uint32_t added = 0;
+            for (uint32_t j = 0; j < n; j++) {
+                const uint32_t i = (j + (tid & 1) * (n / 2)) % n;
+                if (t.emplace(key_of(i), (uint64_t)tid)) {
+                    assert(winner[i].exchange(tid + 1) == 0);
+                    added++;
+                }
+                uint64_t val = nthreads;
+                assert(t.find(key_of(i), val) && val < nthreads);
+                // a win seen here was before this contains()
+                assert(!winner[(i * 7) % n] || t.contains(key_of((i * 7) % n)));
+            }
+            nadded += added;
+            ndone++;
+        });
+    }
+    // rehash() doubles the table so only a few times
+    threads.emplace_back([&]() {
+        for (uint32_t r = 0; r < 3 && ndone < nthreads; r++) {
+            t.rehash();
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+    });
+    for (auto & th : threads) {
+        th.join();
+    }
+
+    assert(nadded == n);
+    assert(t.size() == n);
+    for (uint32_t i = 0; i < n; i++) {
+        uint64_t val = nthreads;
+        assert(t.find(key_of(i), val) && val + 1 == winner[i]);
+        assert(!t.emplace(key_of(i), (uint64_t)0));
+    }
+    assert(!t.contains(key_of(n)));
+
+    // underlying table is still consistent (once everything is stopped)
+    t.rehash();
+    uint64_t manual_count = 0;
+    for (auto it = t.table.begin(); it != t.table.end(); ++it) {
+        manual_count++;
+    }
+    assert(manual_count == n && t.table.size() == n);
+}
+
+// lookups by (const char *, len) / string_view
+static void
+str_u32_str_ref_small() {
+    const uint32_t n = 2000;
+    fht_table<std::string, uint32_t> t;
+    std::vector<std::string>         keys;
+    for (uint32_t i = 0; i < n; i++) {
+        // all the lengths of the tail word
+        keys.push_back(std::string(i % 40, 'a') + std::to_string(i));
+        assert(t.emplace(keys[i], i).second);
+    }
+
+    // keys copied to the very end of a page with the next one unmapped so a
+    // hash or compare reading past len faults
+    const uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    char * const   buf  = (char *)mmap(NULL,
+                                    2 * page,
+                                    PROT_READ | PROT_WRITE,
+                                    MAP_ANONYMOUS | MAP_PRIVATE,
+                                    -1,
+                                    0);
+    assert(buf != MAP_FAILED);
+    const int protect_ret = mprotect(buf + page, page, PROT_NONE);
+    assert(!protect_ret);
+    for (uint32_t i = 0; i < n; i++) {
+        const uint32_t len = (uint32_t)keys[i].length();
+        char * const   key = buf + page - len;
+        memcpy(key, keys[i].data(), len);
+
+        const fht_str_ref ref = { key, len };
+        assert(t.hash(ref) == t.hash(keys[i]));
+        assert(t.find(key, len) == t.find(keys[i]));
+        assert(t.find(key, len)->second == i);
+        assert(t.count(key, len) == 1);
+        assert(t.contains(key, len));
+        assert(t.at(key, len) == i);
+
+        // prefix is a different key (which may or may not be in the table)
+        const std::string prefix(key, len - 1);
+        assert(t.find(key, len - 1) == t.find(prefix));
+#ifdef FHT_HAS_STRING_VIEW
+        assert(t.find(std::string_view(key, len)) == t.find(keys[i]));
+        assert(t.contains(std::string_view(key, len)));
+#endif
+    }
+    for (uint32_t i = 0; i < n; i += 2) {
+        const uint32_t len = (uint32_t)keys[i].length();
+        char * const   key = buf + page - len;
+        memcpy(key, keys[i].data(), len);
+        assert(t.erase(key, len));
+        assert(!t.erase(key, len));
+    }
+    assert(t.size() == n / 2);
+    for (uint32_t i = 0; i < n; i++) {
+        assert(t.count(keys[i]) == (i & 1));
+    }
+    munmap(buf, 2 * page);
+}
+
+// hash computed outside the table (incremental so some of the lookups land
+// in the old array)
+static void
+str_u32_hashed_small() {
+    const uint32_t                   n = 100000;
+    fht_table<std::string, uint32_t> t;
+    typedef fht_table<std::string, uint32_t>::hash_type_t hash_type_t;
+
+    fht_growth_policy growth = t.growth_policy();
+    growth.migrate_chunks    = 1;
+    t.growth_policy(growth);
+
+    std::vector<std::string> keys;
+    std::vector<hash_type_t> hashes;
+    for (uint32_t i = 0; i < n; i++) {
+        keys.push_back(std::to_string(i) + "-some-padding-to-a-longer-key");
+        hashes.push_back(t.hash(keys[i]));
+        assert(t.insert_hashed(keys[i], hashes[i], i).second);
+        assert(!t.insert_hashed(keys[i], hashes[i], i).second);
+        assert(t.find_hashed(keys[i / 2], hashes[i / 2])->second == i / 2);
+    }
+    assert(t.size() == n);
+    for (uint32_t i = 0; i < n; i++) {
+        assert(t.find_hashed(keys[i], hashes[i]) == t.find(keys[i]));
+    }
+    for (uint32_t i = 0; i < n; i += 2) {
+        assert(t.erase_hashed(keys[i], hashes[i]));
+        assert(!t.erase_hashed(keys[i], hashes[i]));
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        assert((t.find_hashed(keys[i], hashes[i]) != t.end()) == (i & 1));
+    }
+}
+
+// every way nodes get moved has to keep the stored hash right
+template<typename Allocator>
+static void
+str_u64_stored_hash_small() {
+    const uint32_t n = 20000;
+    fht_table<std::string, uint64_t, DEFAULT_HASH_64<std::string>, Allocator>
+        t;
+
+    fht_growth_policy growth = t.growth_policy();
+    growth.min_load          = 0.2;
+    growth.max_erased        = 0.05;
+    t.growth_policy(growth);
+
+    auto check = [&](const uint32_t step) {
+        uint64_t manual_count = 0;
+        for (uint64_t i = 0; i < t.max_size() / 64; i++) {
+            for (uint32_t j = 0; j < 64; j++) {
+                if (!(t.chunks[i].get_tag_n(j) & INVALID_MASK)) {
+                    assert(t.chunks[i].get_hash_n(j) ==
+                           t.hash(t.chunks[i].get_key_n(j)));
+                    manual_count++;
+                }
+            }
+        }
+        assert(manual_count == t.size());
+        for (uint32_t i = 0; i < n; i++) {
+            auto it = t.find(std::to_string(i));
+            assert((it != t.end()) == (i % step == 0));
+            assert(it == t.end() || it->second == i);
+        }
+    };
+
+    for (uint32_t i = 0; i < n; i++) {
+        assert(t.emplace(std::to_string(i), i).second);
+    }
+    check(1);
+
+    // tombstones get purged and table shrinks on the way down
+    for (uint32_t i = 0; i < n; i++) {
+        if (i % 4) {
+            assert(t.erase(std::to_string(i)));
+        }
+    }
+    check(4);
+
+    t.reserve(8 * n);
+    check(4);
+    t.shrink_to_fit();
+    check(4);
+}
+
+// keys / values in separate arrays, iterators give fht_kv_ref
+template<typename Allocator>
+static void
+u64_str_separate_kv_small() {
+    const uint32_t n = 20000;
+    fht_table<uint64_t, std::string, DEFAULT_HASH_64<uint64_t>, Allocator> t;
+
+    // keys of a chunk are next to each other
+    assert(t.chunks[0].get_key_n_ptr(1) == t.chunks[0].get_key_n_ptr(0) + 1);
+    assert(t.chunks[0].get_val_n_ptr(1) == t.chunks[0].get_val_n_ptr(0) + 1);
+
+    auto check = [&](const uint32_t step) {
+        std::vector<const int8_t *> tags;
+        for (auto it = t.begin(); it < t.end(); ++it) {
+            assert(it->second == std::to_string(it->first / 7));
+            assert((*it).first % (7 * step) == 0);
+            tags.push_back(it.cur_tag);
+        }
+        assert(tags.size() == t.size());
+
+        // and back the other way across chunk boundaries
+        auto it = typename fht_table<uint64_t,
+                                     std::string,
+                                     DEFAULT_HASH_64<uint64_t>,
+                                     Allocator>::fht_iterator(tags.back());
+        for (uint64_t i = tags.size() - 1; i; i--) {
+            --it;
+            assert(it.cur_tag == tags[i - 1]);
+        }
+
+        for (uint32_t i = 0; i < n; i++) {
+            auto found = t.find(7 * (uint64_t)i);
+            assert((found != t.end()) == (i % step == 0));
+            assert(found == t.end() || found->second == std::to_string(i));
+        }
+    };
+
+    for (uint32_t i = 0; i < n; i++) {
+        assert(t.emplace(7 * (uint64_t)i, std::to_string(i)).second);
+    }
+    check(1);
+
+    for (uint32_t i = 0; i < n; i++) {
+        if (i % 2) {
+            assert(t.erase(t.find(7 * (uint64_t)i)));
+        }
+    }
+    check(2);
+
+    t.reserve(8 * n);
+    check(2);
+    t.shrink_to_fit();
+    check(2);
+    assert(t.at(14) == "2");
+}
+
+// chunks are only tags + body pointer, bodies are outside the chunk array
+template<typename Allocator>
+static void
+u32_u64_dense_tags_small() {
+    typedef fht_table<uint32_t, uint64_t, DEFAULT_HASH_64<uint32_t>, Allocator>
+                   table_t;
+    const uint32_t n = 20000;
+    table_t        t;
+
+    assert(sizeof(fht_chunk<uint32_t, uint64_t>) == 128);
+
+    auto check = [&](const uint32_t step) {
+        const uint64_t nchunks = t.max_size() / 64;
+        for (uint64_t i = 0; i < nchunks; i++) {
+            assert((uint64_t)t.chunks[i].body >=
+                       (uint64_t)(t.chunks + nchunks) ||
+                   (uint64_t)(t.chunks[i].body + 1) <= (uint64_t)t.chunks);
+        }
+
+        std::vector<const int8_t *> tags;
+        for (auto it = t.begin(); it < t.end(); ++it) {
+            assert(it->second == 3 * (uint64_t)it->first);
+            assert((*it).first % step == 0);
+            tags.push_back(it.cur_tag);
+        }
+        assert(tags.size() == t.size());
+
+        auto it = typename table_t::fht_iterator(tags.back());
+        for (uint64_t i = tags.size() - 1; i; i--) {
+            --it;
+            assert(it.cur_tag == tags[i - 1]);
+        }
+
+        for (uint32_t i = 0; i < 2 * n; i++) {
+            auto found = t.find(i);
+            assert((found != t.end()) == (i < n && i % step == 0));
+            assert(found == t.end() || found->second == 3 * (uint64_t)i);
+        }
+    };
+
+    for (uint32_t i = 0; i < n; i++) {
+        assert(t.emplace(i, 3 * (uint64_t)i).second);
+    }
+    check(1);
+
+    for (uint32_t i = 0; i < n; i++) {
+        if (i % 3) {
+            assert(t.erase(i));
+        }
+    }
+    check(3);
+
+    t.reserve(8 * n);
+    check(3);
+    t.shrink_to_fit();
+    check(3);
+}
+
+// keys for tests that run with both integer and string keys
+template<typename K>
+static typename std::enable_if<std::is_integral<K>::value, K>::type
+test_key(const uint32_t i) {
+    return 7 * (K)i;
+}
+
+template<typename K>
+static typename std::enable_if<!std::is_integral<K>::value, K>::type
+test_key(const uint32_t i) {
+    return std::to_string(i);
+}
+
+// 16 bit tags. Chunks are aligned to their 128 bytes of tags which is how the
+// iterator gets from a tag to its chunk
+template<typename K, typename Allocator>
+static void
+wide_tags_small() {
+    typedef fht_table<K, int32_t, fht_default_hash<K, int32_t>, Allocator>
+                   table_t;
+    const uint32_t n = 20000;
+    table_t        t;
+
+    assert(alignof(fht_chunk<K, int32_t>) == 128);
+    assert(sizeof(fht_chunk<K, int32_t>) % 128 == 0);
+
+    auto check = [&](const uint32_t step) {
+        assert(((uint64_t)t.chunks) % 128 == 0);
+
+        // tags really are 15 bits of the hash
+        std::vector<const int16_t *> tags;
+        bool                         wide = false;
+        for (auto it = t.begin(); it < t.end(); ++it) {
+            assert(it->first == test_key<K>((uint32_t)it->second));
+            assert(((uint32_t)(*it).second) % step == 0);
+            wide |= *(it.cur_tag) > CONTENT_MASK;
+            tags.push_back(it.cur_tag);
+        }
+        assert(tags.size() == t.size());
+        assert(wide);
+
+        auto it = typename table_t::fht_iterator(tags.back());
+        for (uint64_t i = tags.size() - 1; i; i--) {
+            --it;
+            assert(it.cur_tag == tags[i - 1]);
+        }
+
+        for (uint32_t i = 0; i < 2 * n; i++) {
+            auto found = t.find(test_key<K>(i));
+            assert((found != t.end()) == (i < n && i % step == 0));
+            assert(found == t.end() || found->second == (int32_t)i);
+        }
+    };
+
+    for (uint32_t i = 0; i < n; i++) {
+        assert(t.emplace(test_key<K>(i), (int32_t)i).second);
+    }
+    check(1);
+
+    for (uint32_t i = 0; i < n; i++) {
+        if (i % 3) {
+            assert(t.erase(test_key<K>(i)));
+        }
+    }
+    check(3);
+
+    t.reserve(8 * n);
+    check(3);
+    t.shrink_to_fit();
+    check(3);
+    t.purge_tombstones();
+    check(3);
+}
+
+// with 16 bit tags the chunk idx starts at bit 15 of the hash so past 2^17
+// chunks it needs the high half. Keys have to spread over all the chunks
+// instead of only the ones a 32 bit hash reaches
+static void
+wide_tags_many_chunks_small() {
+    typedef fht_table<uint64_t, int32_t> table_t;
+    typedef fht_chunk<uint64_t, int32_t> chunk_t;
+
+    const uint64_t nchunks = (1UL) << 18;
+    const uint64_t slots   = fht_chunk_slots<uint64_t, int32_t>::value;
+    const uint32_t n       = 1 << 20;
+    table_t        t(nchunks * slots);
+
+    for (uint32_t i = 0; i < n; i++) {
+        assert(t.emplace(i, (int32_t)i).second);
+    }
+    assert(t.max_size() == nchunks * slots);
+
+    uint64_t upper = 0;
+    for (auto it = t.begin(); it < t.end(); ++it) {
+        const uint64_t idx =
+            ((uint64_t)it.cur_tag - (uint64_t)t.chunks) / sizeof(chunk_t);
+        assert(idx < nchunks);
+        upper += idx >= nchunks / 2;
+    }
+    assert(upper > n / 4 && upper < 3 * (uint64_t)n / 4);
+
+    for (uint32_t i = 0; i < 2 * n; i++) {
+        auto found = t.find(i);
+        assert((found != t.end()) == (i < n));
+        assert(found == t.end() || found->second == (int32_t)i);
+    }
+}
+
+// chunks with Slots slots (fht_chunk_slots unless the table is given it).
+// Every slot of a chunk gets used (a small table is a single chunk) and ops
+// that move nodes between chunks keep them findable
+template<typename K, typename V, typename Allocator, uint32_t Slots>
+static void
+chunk_slots_small() {
+    typedef fht_table<K, V, fht_default_hash<K, V>, Allocator, Slots> table_t;
+    const uint32_t slots = Slots;
+    const uint32_t n     = 20000;
+
+    assert((sizeof(fht_chunk<K, V, Slots>) % fht_tag_bytes<K, V, Slots>()) ==
+           0);
+
+    // smallest table is at least one chunk. Where each node is by its tag
+    // pointer (what find gives too)
+    table_t small(1);
+    assert(small.max_size() == (slots > 64 ? slots : 64));
+    for (uint32_t i = 0; small.size() < small.max_size() / 2; i++) {
+        small.emplace(test_key<K>(i), (V)i);
+    }
+    std::vector<uint32_t> used(small.max_size(), 0);
+    for (auto it = small.begin(); it < small.end(); ++it) {
+        const uint64_t tag_ptr = (uint64_t)(it.cur_tag);
+        const uint64_t chunk_idx =
+            (tag_ptr - (uint64_t)small.chunks) / sizeof(fht_chunk<K, V, Slots>);
+        const uint64_t slot_idx =
+            (tag_ptr % fht_tag_bytes<K, V, Slots>()) / sizeof(*(it.cur_tag));
+        assert(slot_idx < slots);
+        assert(!used[chunk_idx * slots + slot_idx]);
+        used[chunk_idx * slots + slot_idx] = 1;
+    }
+
+    table_t t;
+    auto    check = [&](const uint32_t step) {
+        uint64_t count = 0;
+        for (auto it = t.begin(); it < t.end(); ++it) {
+            assert(it->first == test_key<K>((uint32_t)it->second));
+            assert((*it).second % step == 0);
+            ++count;
+        }
+        assert(count == t.size());
+        for (uint32_t i = 0; i < 2 * n; i++) {
+            auto it = t.find(test_key<K>(i));
+            assert((it != t.end()) == (i < n && i % step == 0));
+            assert(it == t.end() || it->second == (V)i);
+        }
+    };
+
+    for (uint32_t i = 0; i < n; i++) {
+        assert(t.emplace(test_key<K>(i), (V)i).second);
+    }
+    assert(t.max_size() % slots == 0);
+    check(1);
+
+    for (uint32_t i = 0; i < n; i++) {
+        if (i % 3) {
+            assert(t.erase(test_key<K>(i)));
+        }
+    }
+    check(3);
+
+    t.reserve(8 * n);
+    check(3);
+    t.shrink_to_fit();
+    check(3);
+    t.purge_tombstones();
+    check(3);
+}
+
+// tables of the same K / V with different chunk sizes side by side. Each
+// allocator is rebound to its table's chunks
+template<typename Allocator>
+static void
+u32_u32_two_slots_small() {
+    typedef DEFAULT_HASH_64<uint32_t> hash_t;
+    fht_table<uint32_t, uint32_t, hash_t, Allocator, 16>  narrow;
+    fht_table<uint32_t, uint32_t, hash_t, Allocator, 128> wide;
+    const uint32_t                                        n = 20000;
+
+    static_assert(sizeof(fht_chunk<uint32_t, uint32_t, 128>) ==
+                      8 * sizeof(fht_chunk<uint32_t, uint32_t, 16>),
+                  "chunk size is per table");
+
+    for (uint32_t i = 0; i < n; i++) {
+        assert(narrow.emplace(i, i).second);
+        assert(wide.emplace(i, i).second);
+    }
+    assert(narrow.max_size() == wide.max_size());
+    assert(narrow.num_chunks() == 8 * wide.num_chunks());
+
+    for (uint32_t i = 0; i < n; i += 2) {
+        assert(narrow.erase(i) && wide.erase(i));
+    }
+    narrow.shrink_to_fit();
+    wide.rehash();
+    for (uint32_t i = 0; i < 2 * n; i++) {
+        const bool in = i < n && (i & 1);
+        assert((narrow.find(i) != narrow.end()) == in);
+        assert((wide.find(i) != wide.end()) == in);
+    }
+}
+
+// SSE2 tag kernels against doing it a tag at a time
+template<typename Tag>
+static void
+tag_ops_scalar(const __m128i * const tags, const Tag tag) {
+    typedef fht_tag_ops<fht_isa_sse2, Tag> ops;
+    const Tag * const                      t = (const Tag *)tags;
+
+    uint64_t match = 0, empty = 0, empty_or_erased = 0;
+    for (uint32_t j = 0; j < 64; j++) {
+        match |= ((uint64_t)(t[j] == tag)) << j;
+        empty |= ((uint64_t)(t[j] == fht_tags<Tag>::invalid)) << j;
+        empty_or_erased |= ((uint64_t)(t[j] < 0)) << j;
+    }
+    assert(ops::match_64(tags, tag) == match);
+    assert(ops::empty_64(tags) == empty);
+    assert(ops::empty_or_erased_64(tags) == empty_or_erased);
+    for (uint32_t i = 0; i < 4; i++) {
+        const __m128i * const line = tags + sizeof(Tag) * i;
+        assert(ops::match(line, tag) == ((match >> (16 * i)) & 0xffff));
+        assert(ops::empty(line) == ((empty >> (16 * i)) & 0xffff));
+        assert(ops::empty_or_erased(line) ==
+               ((empty_or_erased >> (16 * i)) & 0xffff));
+    }
+
+    alignas(64) __m128i cleared[8];
+    memcpy(cleared, tags, sizeof(cleared));
+    ops::clear_erased(cleared);
+    for (uint32_t j = 0; j < 64; j++) {
+        assert(((const Tag *)cleared)[j] ==
+               (t[j] < 0 ? fht_tags<Tag>::invalid : t[j]));
+    }
+}
+
+// every instruction set's tag kernels have to give the same masks as the SSE2
+// ones
+template<typename Isa, typename Tag>
+static void
+tag_ops_agree(const __m128i * const tags, const Tag tag) {
+    typedef fht_tag_ops<fht_isa_sse2, Tag> sse2_ops;
+    typedef fht_tag_ops<Isa, Tag>          isa_ops;
+
+    assert(isa_ops::match_64(tags, tag) == sse2_ops::match_64(tags, tag));
+    assert(isa_ops::empty_64(tags) == sse2_ops::empty_64(tags));
+    assert(isa_ops::empty_or_erased_64(tags) ==
+           sse2_ops::empty_or_erased_64(tags));
+    for (uint32_t i = 0; i < 4; i++) {
+        const __m128i * const line = tags + sizeof(Tag) * i;
+        assert(isa_ops::match(line, tag) == sse2_ops::match(line, tag));
+        assert(isa_ops::empty(line) == sse2_ops::empty(line));
+        assert(isa_ops::empty_or_erased(line) ==
+               sse2_ops::empty_or_erased(line));
+    }
+    const uint64_t m = isa_ops::match_64(tags, tag);
+    assert(isa_ops::tzcnt_64(m) == sse2_ops::tzcnt_64(m));
+
+    // kernels can assume whole cache lines like a chunk's tags
+    const uint32_t      nbytes = 64 * sizeof(Tag);
+    alignas(64) __m128i isa_tags[8];
+    alignas(64) __m128i sse2_tags[8];
+    memcpy(isa_tags, tags, nbytes);
+    memcpy(sse2_tags, tags, nbytes);
+    isa_ops::clear_erased(isa_tags);
+    sse2_ops::clear_erased(sse2_tags);
+    assert(!memcmp(isa_tags, sse2_tags, nbytes));
+    isa_ops::reset(isa_tags);
+    sse2_ops::reset(sse2_tags);
+    assert(!memcmp(isa_tags, sse2_tags, nbytes));
+}
+
+// whole chunk kernels for N slots against doing it a tag at a time. Tags past
+// the chunk are left alone
+template<typename Isa, typename Tag, uint32_t N>
+static void
+slot_ops_scalar(const __m128i * const tags, const Tag tag, const uint32_t n) {
+    typedef fht_slot_ops<Isa, Tag, N> ops;
+    typedef typename ops::mask_t      mask_t;
+    const Tag * const                 t = (const Tag *)tags;
+
+    mask_t   match = 0, empty = 0, empty_or_erased = 0, rotated = 0;
+    uint64_t first = N;
+    for (uint32_t j = 0; j < N; j++) {
+        match |= ((mask_t)(t[j] == tag)) << j;
+        empty |= ((mask_t)(t[j] == fht_tags<Tag>::invalid)) << j;
+        empty_or_erased |= ((mask_t)(t[j] < 0)) << j;
+        rotated |= ((mask_t)(t[(j + n) % N] == tag)) << j;
+        first = (first == N && t[j] == tag) ? j : first;
+    }
+    assert(ops::match(tags, tag) == match);
+    assert(ops::empty(tags) == empty);
+    assert(ops::empty_or_erased(tags) == empty_or_erased);
+    assert(ops::rotr(match, n) == rotated);
+    assert(match ? ops::tzcnt(match) == first : ops::tzcnt(match) >= N);
+    assert(!match || ops::first(match) == first);
+
+    alignas(64) __m128i cleared[16];
+    const Tag * const   c = (const Tag *)cleared;
+    const uint32_t      ntags = sizeof(__m128i) * 16 / sizeof(Tag);
+    memcpy(cleared, tags, sizeof(cleared));
+    ops::clear_erased(cleared);
+    for (uint32_t j = 0; j < ntags; j++) {
+        assert(c[j] ==
+               ((j < N && t[j] < 0) ? fht_tags<Tag>::invalid : t[j]));
+    }
+    ops::reset(cleared);
+    for (uint32_t j = 0; j < ntags; j++) {
+        assert(c[j] == (j < N ? fht_tags<Tag>::invalid : t[j]));
+    }
+}
+
+template<typename Isa, typename Tag>
+static void
+slot_ops_all(const __m128i * const tags, const Tag tag, const uint32_t n) {
+    slot_ops_scalar<Isa, Tag, 16>(tags, tag, n);
+    slot_ops_scalar<Isa, Tag, 32>(tags, tag, n);
+    slot_ops_scalar<Isa, Tag, 64>(tags, tag, n);
+    slot_ops_scalar<Isa, Tag, 128>(tags, tag, n);
+}
+
+// random tags, mostly empty / erased so all the masks get some bits. Content
+// is small or has its top bit set (which clear_erased must keep)
+template<typename Tag>
+static void
+tag_ops_random() {
+    // top content bit, kept so matches cover the whole tag width
+    const Tag top =
+        (Tag)(fht_tags<Tag>::content ^ (fht_tags<Tag>::content >> 1));
+    for (uint32_t i = 0; i < 10000; i++) {
+        alignas(64) __m128i tags[16];
+        Tag * const         t = (Tag *)tags;
+        for (uint32_t j = 0; j < 128; j++) {
+            const uint32_t r = (uint32_t)rand();
+            t[j] = (r % 4 == 0)
+                       ? fht_tags<Tag>::invalid
+                       : ((r % 4 == 1) ? fht_tags<Tag>::erased
+                                       : (Tag)(((r >> 2) % 8) |
+                                               ((r & 32) ? top : 0)));
+        }
+        const uint32_t r   = (uint32_t)rand();
+        const Tag      tag = (Tag)((r % 8) | ((r & 32) ? top : 0));
+
+        const uint32_t n   = (uint32_t)rand() % 256;
+
+        tag_ops_scalar<Tag>(tags, tag);
+        tag_ops_agree<fht_isa_swar, Tag>(tags, tag);
+        slot_ops_all<fht_isa_sse2, Tag>(tags, tag, n);
+        slot_ops_all<fht_isa_swar, Tag>(tags, tag, n);
+#if defined(FHT_DISPATCH_ISA) || defined(__AVX2__)
+        if (__builtin_cpu_supports("avx2")) {
+            tag_ops_agree<fht_isa_avx2, Tag>(tags, tag);
+            slot_ops_all<fht_isa_avx2, Tag>(tags, tag, n);
+        }
+#endif
+#if defined(FHT_DISPATCH_ISA) || defined(__AVX512BW__)
+        if (__builtin_cpu_supports("avx512bw")) {
+            tag_ops_agree<fht_isa_avx512, Tag>(tags, tag);
+            slot_ops_all<fht_isa_avx512, Tag>(tags, tag, n);
+        }
+#endif
+    }
+}
+
+// kernels picked at runtime and SWAR ones against each other for both tag
+// widths and every chunk size and crc32 instruction against the table
+static void
+tag_ops_small() {
+    tag_ops_random<int8_t>();
+    tag_ops_random<int16_t>();
+
+    // crc32c("12345678") is 0x6087809a
+    const uint32_t lo = 0x34333231, hi = 0x38373635;
+    const uint64_t k  = (((uint64_t)hi) << 32) | lo;
+    assert(~fht_crc32_u32_sw(fht_crc32_u32_sw(~0u, lo), hi) == 0x6087809a);
+    assert(~fht_crc32_u32(fht_crc32_u32(~0u, lo), hi) == 0x6087809a);
+    assert((uint32_t)~fht_crc32_u64_sw(~0u, k) == 0x6087809a);
+    assert((uint32_t)~fht_crc32_u64(~0u, k) == 0x6087809a);
+    for (uint32_t i = 0; i < 10000; i++) {
+        const uint64_t v = (((uint64_t)rand()) << 32) ^ (uint64_t)rand();
+        assert(fht_crc32_u32(i, (uint32_t)v) ==
+               fht_crc32_u32_sw(i, (uint32_t)v));
+        assert(fht_crc32_u64(i, v) == fht_crc32_u64_sw(i, v));
+    }
+}